@@ -1,219 +1,1030 @@
 #include <stdlib.h>
 #include <stdio.h>
-#include <math.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "../parallel.h"
+
+// Block shapes are numbered with 16 bits, there are Catalan(11) + 1 < 2^16 shapes for blocks of 11 elements, which
+// is enough for arrays up to 2^44 elements.
+#define FHS_MAX_BLOCK_SIZE 11
+
+/// Type of the keys the minimum is taken over.
+enum fhs_type {
+    FHS_INT,
+    FHS_INT64,
+    // NaN is larger than any number and equal to itself, so it is only the minimum of a range of NaNs.
+    FHS_FLOAT,
+    FHS_DOUBLE,
+    // Ordered by the comparator of the elements.
+    FHS_CUSTOM
+};
+
+/// Orders two keys like strcmp, it must be a strict weak order.
+typedef int (*fhs_compare_t)(const void *a, const void *b, void *context);
+
+/// Describes the array to preprocess: the key of element k is at keys + k * stride.
+struct fhs_elements {
+    const void *keys;
+    size_t stride;
+    enum fhs_type type;
+    fhs_compare_t compare; // FHS_CUSTOM only
+    void *context; // passed to compare
+};
+
+/// Elements of an array of structs ordered by one of their fields,
+/// e.g. FHS_FIELD(events, struct event, time, FHS_INT64).
+#define FHS_FIELD(arr, element_type, field, key_type) \
+    ((struct fhs_elements) {&(arr)[0].field, sizeof(element_type), key_type, 0, 0})
+
+// State of a structure built by appends, see fhs_new.
+struct fhs_appendable {
+    size_t key_capacity; // elements the keys have room for
+    size_t shape_capacity; // tables block_tables has room for
+    uint16_t *shape_of; // slot of each cartesian number in block_tables, UINT16_MAX if not seen yet
+    // Cartesian number of the last block is cartesian_prefix << depth, stack holds the positions of its right spine.
+    size_t cartesian_prefix;
+    size_t depth;
+    size_t stack[FHS_MAX_BLOCK_SIZE];
+};
+
+/// How the minimum inside a block is found.
+enum fhs_block_mode {
+    // Look up the table of the block shape, see fhs_table_entry.
+    FHS_BLOCK_TABLES,
+    // Scan the elements with SIMD min reductions, ints only, no tables are built.
+    FHS_BLOCK_SCAN
+};
+
+// Leftmost minimum of arr[i, j), i < j.
+typedef size_t (*fhs_scan_t)(const int *arr, size_t i, size_t j);
 
 struct fhs_t {
-    int *arr;
+    struct fhs_elements elements;
     size_t size;
     size_t *summary;
+    // Length of a summary row: num_blocks when preprocessed, the number of blocks there is room for when appendable.
+    size_t summary_stride;
     size_t block_size;
     size_t num_blocks;
 
-    size_t *cartesian;
-    size_t **block_rmqs;
+    // Slot of the table of each block in block_tables, blocks with the same cartesian number share the slot.
+    uint16_t *block_shapes;
+    // One triangular table of in-block minimum positions per distinct shape, see fhs_table_entry.
+    uint8_t *block_tables;
+    size_t num_shapes;
+
+    enum fhs_block_mode block_mode;
+    fhs_scan_t scan; // FHS_BLOCK_SCAN only, the best scan the CPU runs
+
+    struct fhs_appendable *appendable; // 0 unless created by fhs_new
+    // File mapping the arrays above point into, 0 unless loaded by fhs_load.
+    void *mapping;
+    size_t mapping_size;
+};
+
+// floor(log2(x)) for x > 0, a single count leading zeros instruction.
+size_t fhs_log2(size_t x) {
+  return 63 - __builtin_clzll(x);
+}
+
+// ceil(log2(x)) for x > 0.
+size_t fhs_ceil_log2(size_t x) {
+  return x == 1 ? 0 : fhs_log2(x - 1) + 1;
+}
+
+// Summary level and the two overlapping windows covering the full blocks [block_i, block_j). Level k holds the
+// minimum of the 2^k blocks starting at each block, so the two windows of 2^level blocks starting at block_i and
+// ending at block_j cover the range exactly.
+size_t fhs_summary_windows(size_t block_i, size_t block_j, size_t *second_window) {
+  size_t level = fhs_log2(block_j - block_i);
+  *second_window = block_j - ((size_t) 1 << level);
+  return level;
+}
+
+const void *fhs_key(const struct fhs_t *fhs, size_t i) {
+  return (const char *) fhs->elements.keys + i * fhs->elements.stride;
+}
+
+// Copy of a primitive key, taken to compare against it without going back to the array.
+union fhs_key_copy {
+    int i;
+    int64_t i64;
+    float f;
+    double d;
 };
 
-size_t *fhs_build_full_rmq(int arr[], size_t size) {
-  size_t *rmq = (size_t *) malloc(sizeof(size_t) * size * (size - 1));
+// Bytes of a key of a primitive type, 0 for FHS_CUSTOM.
+size_t fhs_key_size(enum fhs_type type) {
+  switch (type) {
+    case FHS_INT:
+      return sizeof(int);
+    case FHS_INT64:
+      return sizeof(int64_t);
+    case FHS_FLOAT:
+      return sizeof(float);
+    case FHS_DOUBLE:
+      return sizeof(double);
+    default:
+      return 0;
+  }
+}
+
+// Functions taking the element type as an argument are forced inline, so that the queries can be compiled once per
+// type with the comparisons specialized, instead of testing the type in the middle of every query.
+#define FHS_INLINE static inline __attribute__((always_inline))
+
+// Whether key a is smaller than key b, the primitive types are compared inline instead of calling a comparator.
+FHS_INLINE int fhs_key_less(const struct fhs_t *fhs, enum fhs_type type, const void *a, const void *b) {
+  switch (type) {
+    case FHS_INT:
+      return *(const int *) a < *(const int *) b;
+    case FHS_INT64:
+      return *(const int64_t *) a < *(const int64_t *) b;
+    case FHS_FLOAT: {
+      float x = *(const float *) a;
+      float y = *(const float *) b;
+      return x < y || (x == x && y != y);
+    }
+    case FHS_DOUBLE: {
+      double x = *(const double *) a;
+      double y = *(const double *) b;
+      return x < y || (x == x && y != y);
+    }
+    default:
+      return fhs->elements.compare(a, b, fhs->elements.context) < 0;
+  }
+}
+
+// Whether element a is smaller than element b.
+FHS_INLINE int fhs_less(const struct fhs_t *fhs, enum fhs_type type, size_t a, size_t b) {
+  return fhs_key_less(fhs, type, fhs_key(fhs, a), fhs_key(fhs, b));
+}
+
+// Number of entries in the table of a block, one for each range [i, i + range) in the block.
+size_t fhs_table_size(size_t block_size) {
+  return block_size * (block_size + 1) / 2;
+}
+
+// Position of the range [i, i + range) in a table, ranges are grouped by length, the longer the fewer.
+size_t fhs_table_entry(size_t block_size, size_t i, size_t range) {
+  return (range - 1) * block_size - (range - 1) * (range - 2) / 2 + i;
+}
+
+// Fills the table of the block values[0, size), laid out for blocks of block_size elements. The last block may be
+// shorter, it then only uses the entries of its own ranges.
+void fhs_build_table(const int values[], size_t size, size_t block_size, uint8_t *table) {
   for (size_t i = 0; i < size; ++i) {
-    rmq[i] = i;
+    table[i] = i;
   }
 
-  for (size_t range_length = 2; range_length < size; ++range_length) {
+  for (size_t range_length = 2; range_length <= size; ++range_length) {
     for (size_t i = 0; i + range_length <= size; ++i) {
-      size_t almost_minimum = rmq[(range_length - 2) * size + i];
-      if (arr[i + range_length - 1] < arr[almost_minimum]) {
-        rmq[(range_length - 1) * size + i] = i + range_length - 1;
+      uint8_t almost_minimum = table[fhs_table_entry(block_size, i, range_length - 1)];
+      if (values[i + range_length - 1] < values[almost_minimum]) {
+        table[fhs_table_entry(block_size, i, range_length)] = i + range_length - 1;
       } else {
-        rmq[(range_length - 1) * size + i] = almost_minimum;
+        table[fhs_table_entry(block_size, i, range_length)] = almost_minimum;
       }
     }
   }
-
-  return rmq;
 }
 
-size_t *fhs_build_summary(int arr[], size_t size, size_t block_size, size_t num_blocks) {
-  size_t summary_spans = (size_t) ceil(log2(num_blocks));
-  size_t *summary = (size_t *) malloc(sizeof(size_t) * num_blocks * summary_spans);
+struct fhs_summary_level {
+    struct fhs_t *fhs;
+    size_t level;
+};
 
-  size_t offset = 0;
-  for (size_t i = 0; i < num_blocks; ++i) {
-    int minimum = offset;
-    for (size_t j = 1; j < block_size && offset + j < size; ++j) {
-      if (arr[offset + j] < arr[minimum]) {
+FHS_INLINE void fhs_build_block_minimums_typed(struct fhs_t *fhs, enum fhs_type type, size_t begin, size_t end) {
+  for (size_t i = begin; i < end; ++i) {
+    size_t offset = i * fhs->block_size;
+    size_t minimum = offset;
+    for (size_t j = 1; j < fhs->block_size && offset + j < fhs->size; ++j) {
+      if (fhs_less(fhs, type, offset + j, minimum)) {
         minimum = offset + j;
       }
     }
-    summary[i] = minimum;
-
-    offset += block_size;
+    fhs->summary[i] = minimum;
   }
+}
 
-  size_t half_span = 1;
-  offset = num_blocks;
-  for (size_t i = 1; i < summary_spans; ++i) {
-    for (size_t j = 0; j + half_span + half_span <= num_blocks; ++j) {
-      size_t current = offset + j;
-      size_t first_half = current - num_blocks;
-      size_t second_half = first_half + half_span;
-      if (arr[summary[second_half]] < arr[summary[first_half]]) {
-        summary[current] = summary[second_half];
-      } else {
-        summary[current] = summary[first_half];
-      }
-    }
+// Minimum of each block in [begin, end), the level 0 of the summary.
+void fhs_build_block_minimums(void *context, size_t begin, size_t end) {
+  struct fhs_t *fhs = context;
+  switch (fhs->elements.type) {
+    case FHS_INT:
+      fhs_build_block_minimums_typed(fhs, FHS_INT, begin, end);
+      break;
+    case FHS_INT64:
+      fhs_build_block_minimums_typed(fhs, FHS_INT64, begin, end);
+      break;
+    case FHS_FLOAT:
+      fhs_build_block_minimums_typed(fhs, FHS_FLOAT, begin, end);
+      break;
+    case FHS_DOUBLE:
+      fhs_build_block_minimums_typed(fhs, FHS_DOUBLE, begin, end);
+      break;
+    default:
+      fhs_build_block_minimums_typed(fhs, FHS_CUSTOM, begin, end);
+      break;
+  }
+}
 
-    half_span *= 2;
-    offset += num_blocks;
+FHS_INLINE void fhs_build_summary_level_typed(struct fhs_t *fhs, enum fhs_type type, size_t level, size_t begin,
+                                              size_t end) {
+  size_t half_span = (size_t) 1 << (level - 1);
+  // Locals, or the stores to the summary would make every field of fhs reload.
+  size_t *row = fhs->summary + level * fhs->summary_stride;
+  const size_t *below = row - fhs->summary_stride;
+  for (size_t j = begin; j < end; ++j) {
+    size_t first_half = below[j];
+    size_t second_half = below[j + half_span];
+    // A select rather than a branch, which random data would mispredict half of the time.
+    size_t take_second = -(size_t) fhs_less(fhs, type, second_half, first_half);
+    row[j] = first_half ^ ((first_half ^ second_half) & take_second);
   }
+}
 
-  return summary;
+// Entries [begin, end) of a summary level, from the level below.
+void fhs_build_summary_level(void *context, size_t begin, size_t end) {
+  struct fhs_summary_level *level = context;
+  struct fhs_t *fhs = level->fhs;
+  switch (fhs->elements.type) {
+    case FHS_INT:
+      fhs_build_summary_level_typed(fhs, FHS_INT, level->level, begin, end);
+      break;
+    case FHS_INT64:
+      fhs_build_summary_level_typed(fhs, FHS_INT64, level->level, begin, end);
+      break;
+    case FHS_FLOAT:
+      fhs_build_summary_level_typed(fhs, FHS_FLOAT, level->level, begin, end);
+      break;
+    case FHS_DOUBLE:
+      fhs_build_summary_level_typed(fhs, FHS_DOUBLE, level->level, begin, end);
+      break;
+    default:
+      fhs_build_summary_level_typed(fhs, FHS_CUSTOM, level->level, begin, end);
+      break;
+  }
 }
 
-size_t fhs_cartesian_number(int arr[], size_t size, int *stack) {
+// Cartesian number of the block [offset, offset + size). The right spine is kept in stack, its bottom is left on the
+// leftmost minimum of the block, so the number and the minimum come out of the same pass.
+FHS_INLINE size_t fhs_cartesian_number(struct fhs_t *fhs, enum fhs_type type, size_t offset, size_t size,
+                                       size_t *stack) {
   size_t n = 1;
-  stack[0] = arr[0];
+  stack[0] = offset;
   size_t sp = 1;
 
-  for (size_t i = 1; i < size; ++i) {
-    while (sp > 0 && arr[i] < stack[sp - 1]) {
-      // pop larger
-      sp = sp - 1;
-      n = n << 1;
+  // Keys of the spine, for the primitive types. The spine is sorted, the elements to pop are the ones larger than i,
+  // counting them over the whole block costs a few comparisons but no mispredicted branch, which is what popping
+  // them one at a time pays on random data.
+  union fhs_key_copy spine[FHS_MAX_BLOCK_SIZE];
+  size_t key_size = fhs_key_size(type);
+  for (size_t k = 0; k < fhs->block_size; ++k) {
+    memcpy(spine + k, fhs_key(fhs, offset), key_size);
+  }
+
+  for (size_t i = offset + 1; i < offset + size; ++i) {
+    if (type == FHS_CUSTOM) {
+      while (sp > 0 && fhs_less(fhs, type, i, stack[sp - 1])) {
+        // pop larger
+        sp = sp - 1;
+        n = n << 1;
+      }
+    } else {
+      union fhs_key_copy key;
+      memcpy(&key, fhs_key(fhs, i), key_size);
+      size_t pops = 0;
+      for (size_t k = 0; k < fhs->block_size; ++k) {
+        pops += (k < sp) & fhs_key_less(fhs, type, &key, spine + k);
+      }
+      sp -= pops;
+      n <<= pops;
+      spine[sp] = key;
     }
 
     // push
-    stack[sp] = arr[i];
+    stack[sp] = i;
     sp = sp + 1;
     n = (n << 1) + 1;
   }
 
-  while (sp > 0) {
-    n = n << 1;
-    sp = sp - 1;
+  // the pops of what is left on the spine, which are only trailing zeros
+  return n << sp;
+}
+
+// Number of elements of the block with the given cartesian number, each one is a push and a pop.
+size_t fhs_cartesian_block_size(size_t cartesian_number) {
+  return (fhs_log2(cartesian_number) + 1) / 2;
+}
+
+// Canonical values of a shape: the depth of each element in the cartesian tree. A parent is smaller than its
+// children, so the leftmost minimum of every range, the top of its subtree, is the same as for any block of the shape.
+// Returns the size of the block.
+size_t fhs_canonical_block(size_t cartesian_number, int *values) {
+  size_t size = fhs_cartesian_block_size(cartesian_number);
+  int parent[FHS_MAX_BLOCK_SIZE];
+  int stack[FHS_MAX_BLOCK_SIZE];
+  size_t sp = 0;
+  size_t bit = 2 * size;
+  for (size_t i = 0; i < size; ++i) {
+    int popped = -1;
+    // a 0 is a pop, a 1 the push of the next element
+    while (!((cartesian_number >> --bit) & 1)) {
+      popped = stack[--sp];
+    }
+    if (popped >= 0) {
+      // the last element popped is the left child
+      parent[popped] = i;
+    }
+    parent[i] = sp > 0 ? stack[sp - 1] : -1;
+    stack[sp++] = i;
+  }
+
+  for (size_t i = 0; i < size; ++i) {
+    values[i] = 0;
+    for (int p = parent[i]; p >= 0; p = parent[p]) {
+      ++values[i];
+    }
   }
-  
-  return n;
+  return size;
 }
 
-void fhs_build_block_rmqs(struct fhs_t *fhs) {
-  size_t *cartesian = (size_t *) malloc(sizeof(size_t) * fhs->num_blocks);
-  size_t num_cartesian = 1;
-  for (size_t i = 0; i < fhs->block_size * 2; ++i) {
-    num_cartesian *= 2;
+struct fhs_block_tables {
+    struct fhs_t *fhs;
+    uint32_t *cartesian; // cartesian number of each block
+    uint32_t *shape_cartesian; // cartesian number of each shape
+};
+
+size_t fhs_actual_block_size(struct fhs_t *fhs, size_t block) {
+  if (block + 1 == fhs->num_blocks && fhs->size % fhs->block_size != 0) {
+    return fhs->size % fhs->block_size;
   }
-  size_t **rmqs = (size_t **) calloc(num_cartesian, sizeof(size_t *));
+  return fhs->block_size;
+}
 
-  int *stack = (int *) malloc(sizeof(size_t) * fhs->block_size);
+FHS_INLINE void fhs_build_blocks_typed(struct fhs_block_tables *tables, enum fhs_type type, size_t begin, size_t end) {
+  struct fhs_t *fhs = tables->fhs;
+  size_t stack[FHS_MAX_BLOCK_SIZE];
 
-  for (int i = 0; i < fhs->num_blocks; ++i) {
-    size_t actual_block_size = fhs->block_size;
-    if (i + 1 == fhs->num_blocks && fhs->size % fhs->block_size != 0) {
-      actual_block_size = fhs->size % fhs->block_size;
-    }
-    size_t cartesian_number = fhs_cartesian_number(fhs->arr + i * fhs->block_size, actual_block_size, stack);
-    cartesian[i] = cartesian_number;
-    if (rmqs[cartesian_number] == 0) {
-      rmqs[cartesian_number] = fhs_build_full_rmq(fhs->arr + i * fhs->block_size, actual_block_size);
+  for (size_t i = begin; i < end; ++i) {
+    size_t actual_block_size = fhs_actual_block_size(fhs, i);
+    tables->cartesian[i] = fhs_cartesian_number(fhs, type, i * fhs->block_size, actual_block_size, stack);
+    fhs->summary[i] = stack[0];
+  }
+}
+
+// Cartesian numbers and minimums, the level 0 of the summary, of the blocks in [begin, end), in one pass over them.
+void fhs_build_blocks(void *context, size_t begin, size_t end) {
+  struct fhs_block_tables *tables = context;
+  struct fhs_t *fhs = tables->fhs;
+  switch (fhs->elements.type) {
+    case FHS_INT:
+      fhs_build_blocks_typed(tables, FHS_INT, begin, end);
+      break;
+    case FHS_INT64:
+      fhs_build_blocks_typed(tables, FHS_INT64, begin, end);
+      break;
+    case FHS_FLOAT:
+      fhs_build_blocks_typed(tables, FHS_FLOAT, begin, end);
+      break;
+    case FHS_DOUBLE:
+      fhs_build_blocks_typed(tables, FHS_DOUBLE, begin, end);
+      break;
+    default:
+      fhs_build_blocks_typed(tables, FHS_CUSTOM, begin, end);
+      break;
+  }
+}
+
+// Builds the summary, with tables the level 0 and the cartesian numbers of the blocks come out of fhs_build_blocks,
+// without only the minimums are computed, for blocks too large to be numbered.
+void fhs_build_summary(struct fhs_t *fhs, size_t num_threads, struct fhs_block_tables *tables) {
+  size_t summary_spans = fhs->num_blocks == 0 ? 0 : fhs_log2(fhs->num_blocks) + 1;
+  fhs->summary_stride = fhs->num_blocks;
+  fhs->summary = (size_t *) malloc(sizeof(size_t) * fhs->num_blocks * summary_spans);
+
+  if (tables) {
+    parallel_for(num_threads, fhs->num_blocks, fhs_build_blocks, tables);
+  } else {
+    parallel_for(num_threads, fhs->num_blocks, fhs_build_block_minimums, fhs);
+  }
+
+  // Each level only reads the one below, so the entries of a level are independent.
+  for (size_t i = 1; i < summary_spans; ++i) {
+    struct fhs_summary_level level = {fhs, i};
+    parallel_for(num_threads, fhs->num_blocks - ((size_t) 1 << i) + 1, fhs_build_summary_level, &level);
+  }
+}
+
+// Fills the table of the shape with the given cartesian number.
+void fhs_build_shape_table(size_t cartesian_number, size_t block_size, uint8_t *table) {
+  int values[FHS_MAX_BLOCK_SIZE];
+  size_t size = fhs_canonical_block(cartesian_number, values);
+  fhs_build_table(values, size, block_size, table);
+}
+
+// Tables of the shapes in [begin, end).
+void fhs_build_shape_tables(void *context, size_t begin, size_t end) {
+  struct fhs_block_tables *tables = context;
+  struct fhs_t *fhs = tables->fhs;
+  size_t table_size = fhs_table_size(fhs->block_size);
+
+  for (size_t shape = begin; shape < end; ++shape) {
+    fhs_build_shape_table(tables->shape_cartesian[shape], fhs->block_size, fhs->block_tables + shape * table_size);
+  }
+}
+
+// Numbers the shapes of the blocks from their cartesian numbers and builds a table per shape.
+void fhs_build_block_tables(struct fhs_t *fhs, size_t num_threads, struct fhs_block_tables *tables) {
+  // Shapes are numbered in the order they first appear, which keeps the parallel build identical to the serial one.
+  // This pass only does a lookup per block, it is left serial.
+  size_t num_cartesian = (size_t) 1 << (fhs->block_size * 2);
+  uint16_t *shape_of = malloc(sizeof(uint16_t) * num_cartesian);
+  memset(shape_of, 0xff, sizeof(uint16_t) * num_cartesian);
+  fhs->block_shapes = malloc(sizeof(uint16_t) * fhs->num_blocks);
+  tables->shape_cartesian =
+      malloc(sizeof(uint32_t) * (fhs->num_blocks < num_cartesian ? fhs->num_blocks : num_cartesian));
+  fhs->num_shapes = 0;
+  for (size_t i = 0; i < fhs->num_blocks; ++i) {
+    uint32_t cartesian_number = tables->cartesian[i];
+    if (shape_of[cartesian_number] == UINT16_MAX) {
+      shape_of[cartesian_number] = fhs->num_shapes;
+      tables->shape_cartesian[fhs->num_shapes] = cartesian_number;
+      ++fhs->num_shapes;
     }
+    fhs->block_shapes[i] = shape_of[cartesian_number];
   }
+  free(shape_of);
 
-  free(stack);
+  fhs->block_tables = calloc(fhs->num_shapes, fhs_table_size(fhs->block_size));
+  parallel_for(num_threads, fhs->num_shapes, fhs_build_shape_tables, tables);
+  free(tables->shape_cartesian);
+}
 
-  fhs->cartesian = cartesian;
-  fhs->block_rmqs = rmqs;
+size_t fhs_block_size_for(size_t size) {
+  // ceil(log2(size) / 4), which is the same as ceil(ceil(log2(size)) / 4)
+  size_t block_size = size == 0 ? 0 : (fhs_ceil_log2(size) + 3) / 4;
+  if (block_size == 0) {
+    block_size = 1;
+  }
+  if (block_size > FHS_MAX_BLOCK_SIZE) {
+    block_size = FHS_MAX_BLOCK_SIZE;
+  }
+  return block_size;
 }
 
-struct fhs_t *fhs_preprocess(int arr[], size_t size) {
+/// Preprocesses an array of any element type with num_threads threads. The array is not copied, it must outlive the
+/// structure.
+struct fhs_t *fhs_preprocess_elements(const struct fhs_elements *elements, size_t size, size_t num_threads) {
   struct fhs_t *fhs = malloc(sizeof(struct fhs_t));
-  fhs->arr = arr;
+  fhs->elements = *elements;
   fhs->size = size;
+  fhs->appendable = 0;
+  fhs->mapping = 0;
+  fhs->block_mode = FHS_BLOCK_TABLES;
 
-  double log2_of_size = log2(size);
-  size_t block_size = (size_t) ceil(log2_of_size / 4);
-  if (block_size == 0) {
-    block_size = 1;
+  fhs->block_size = fhs_block_size_for(size);
+  fhs->num_blocks = (size + fhs->block_size - 1) / fhs->block_size;
+  struct fhs_block_tables tables = {fhs, malloc(sizeof(uint32_t) * fhs->num_blocks), 0};
+  fhs_build_summary(fhs, num_threads, &tables);
+  fhs_build_block_tables(fhs, num_threads, &tables);
+  free(tables.cartesian);
+
+  return fhs;
+}
+
+/// Preprocesses arr with num_threads threads, the result is identical to fhs_preprocess.
+struct fhs_t *fhs_preprocess_parallel(int arr[], size_t size, size_t num_threads) {
+  struct fhs_elements elements = {arr, sizeof(int), FHS_INT, 0, 0};
+  return fhs_preprocess_elements(&elements, size, num_threads);
+}
+
+struct fhs_t *fhs_preprocess(int arr[], size_t size) {
+  return fhs_preprocess_parallel(arr, size, 1);
+}
+
+// Ranges up to two cache lines of ints are scanned whole in FHS_BLOCK_SCAN mode, without going through the summary.
+#define FHS_SCAN_SHORT_RANGE 32
+
+size_t fhs_scan_scalar(const int *arr, size_t i, size_t j) {
+  size_t minimum = i;
+  for (size_t k = i + 1; k < j; ++k) {
+    if (arr[k] < arr[minimum]) {
+      minimum = k;
+    }
+  }
+  return minimum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The scans take the minimum over vectors first, the last vector overlapping the one before it instead of a scalar
+// tail, then look for the first lane equal to it, which is where the leftmost minimum is.
+
+__attribute__((target("sse4.1"))) size_t fhs_scan_sse41(const int *arr, size_t i, size_t j) {
+  if (j - i < 4) {
+    return fhs_scan_scalar(arr, i, j);
+  }
+  __m128i minimum = _mm_loadu_si128((const __m128i *) (arr + i));
+  for (size_t k = i + 4; k + 4 <= j; k += 4) {
+    minimum = _mm_min_epi32(minimum, _mm_loadu_si128((const __m128i *) (arr + k)));
   }
+  minimum = _mm_min_epi32(minimum, _mm_loadu_si128((const __m128i *) (arr + j - 4)));
+  minimum = _mm_min_epi32(minimum, _mm_shuffle_epi32(minimum, _MM_SHUFFLE(1, 0, 3, 2)));
+  minimum = _mm_min_epi32(minimum, _mm_shuffle_epi32(minimum, _MM_SHUFFLE(2, 3, 0, 1)));
 
-  fhs->block_size = block_size;
-  fhs->num_blocks = (size + block_size - 1) / block_size;
-  fhs->summary = fhs_build_summary(arr, size, block_size, fhs->num_blocks);
-  fhs_build_block_rmqs(fhs);
+  for (size_t k = i;; k += 4) {
+    size_t at = k + 4 <= j ? k : j - 4;
+    __m128i equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (arr + at)), minimum);
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(equal));
+    if (mask) {
+      return at + __builtin_ctz(mask);
+    }
+  }
+}
+
+__attribute__((target("avx2"))) size_t fhs_scan_avx2(const int *arr, size_t i, size_t j) {
+  if (j - i < 8) {
+    return fhs_scan_sse41(arr, i, j);
+  }
+  __m256i minimum = _mm256_loadu_si256((const __m256i *) (arr + i));
+  for (size_t k = i + 8; k + 8 <= j; k += 8) {
+    minimum = _mm256_min_epi32(minimum, _mm256_loadu_si256((const __m256i *) (arr + k)));
+  }
+  minimum = _mm256_min_epi32(minimum, _mm256_loadu_si256((const __m256i *) (arr + j - 8)));
+  __m128i half = _mm_min_epi32(_mm256_castsi256_si128(minimum), _mm256_extracti128_si256(minimum, 1));
+  half = _mm_min_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+  half = _mm_min_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+  minimum = _mm256_broadcastd_epi32(half);
+
+  for (size_t k = i;; k += 8) {
+    size_t at = k + 8 <= j ? k : j - 8;
+    __m256i equal = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) (arr + at)), minimum);
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(equal));
+    if (mask) {
+      return at + __builtin_ctz(mask);
+    }
+  }
+}
+#endif
+
+/// The fastest scan the CPU runs.
+fhs_scan_t fhs_scan_best() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return fhs_scan_avx2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return fhs_scan_sse41;
+  }
+#endif
+  return fhs_scan_scalar;
+}
+
+/// Preprocesses arr in FHS_BLOCK_SCAN mode: only the summary is built, the partial blocks of a query and the ranges
+/// of up to FHS_SCAN_SHORT_RANGE elements are scanned. The blocks can be much larger than in the table mode, which
+/// shrinks the summary by as much, block_size 0 picks 16, a cache line of ints.
+struct fhs_t *fhs_preprocess_scan(int arr[], size_t size, size_t block_size, size_t num_threads) {
+  struct fhs_t *fhs = malloc(sizeof(struct fhs_t));
+  struct fhs_elements elements = {arr, sizeof(int), FHS_INT, 0, 0};
+  fhs->elements = elements;
+  fhs->size = size;
+  fhs->appendable = 0;
+  fhs->mapping = 0;
+  fhs->block_mode = FHS_BLOCK_SCAN;
+  fhs->scan = fhs_scan_best();
+
+  fhs->block_size = block_size == 0 ? 16 : block_size;
+  fhs->num_blocks = (size + fhs->block_size - 1) / fhs->block_size;
+  fhs_build_summary(fhs, num_threads, 0);
+  fhs->block_shapes = 0;
+  fhs->block_tables = 0;
+  fhs->num_shapes = 0;
 
   return fhs;
 }
 
-void fhs_free(struct fhs_t *fhs) {
+/// Creates an empty structure to be filled by fhs_append, it keeps its own copy of the keys.
+///
+/// The block size is chosen for expected_size elements and stays fixed, the structure keeps growing past it but the
+/// work per append is only O(1) amortised while log2(size) / 4 <= block size.
+///
+/// \param layout Type and comparator of the keys, stride is the size of a key and keys is ignored.
+struct fhs_t *fhs_new(const struct fhs_elements *layout, size_t expected_size) {
+  struct fhs_t *fhs = malloc(sizeof(struct fhs_t));
+  struct fhs_appendable *appendable = malloc(sizeof(struct fhs_appendable));
+  fhs->appendable = appendable;
+  fhs->mapping = 0;
+  fhs->block_mode = FHS_BLOCK_TABLES;
+  fhs->elements = *layout;
+  fhs->size = 0;
+  fhs->block_size = fhs_block_size_for(expected_size);
+  fhs->num_blocks = 0;
+
+  appendable->key_capacity = expected_size == 0 ? 1 : expected_size;
+  fhs->elements.keys = malloc(fhs->elements.stride * appendable->key_capacity);
+
+  fhs->summary_stride = (appendable->key_capacity + fhs->block_size - 1) / fhs->block_size;
+  fhs->summary = malloc(sizeof(size_t) * fhs->summary_stride * (fhs_log2(fhs->summary_stride) + 1));
+  fhs->block_shapes = malloc(sizeof(uint16_t) * fhs->summary_stride);
+
+  size_t num_cartesian = (size_t) 1 << (fhs->block_size * 2);
+  appendable->shape_of = malloc(sizeof(uint16_t) * num_cartesian);
+  memset(appendable->shape_of, 0xff, sizeof(uint16_t) * num_cartesian);
+  appendable->shape_capacity = 1;
+  fhs->block_tables = malloc(fhs_table_size(fhs->block_size) * appendable->shape_capacity);
+  fhs->num_shapes = 0;
+
+  return fhs;
+}
+
+// Doubles the blocks there is room for, the summary rows move apart.
+void fhs_grow_blocks(struct fhs_t *fhs) {
+  size_t stride = fhs->summary_stride * 2;
+  size_t *summary = malloc(sizeof(size_t) * stride * (fhs_log2(stride) + 1));
+  for (size_t level = 0; level <= fhs_log2(fhs->summary_stride); ++level) {
+    memcpy(summary + level * stride, fhs->summary + level * fhs->summary_stride, sizeof(size_t) * fhs->summary_stride);
+  }
   free(fhs->summary);
+  fhs->summary = summary;
+  fhs->summary_stride = stride;
+  fhs->block_shapes = realloc(fhs->block_shapes, sizeof(uint16_t) * stride);
+}
 
-  for (size_t i = 0; i < fhs->num_blocks; ++i) {
-    size_t cartesian_number = fhs->cartesian[i];
-    if (fhs->block_rmqs[cartesian_number] != 0) {
-      free(fhs->block_rmqs[cartesian_number]);
-      fhs->block_rmqs[cartesian_number] = 0;
+// Slot of the table of the last block, built the first time its shape appears.
+uint16_t fhs_append_shape(struct fhs_t *fhs) {
+  struct fhs_appendable *appendable = fhs->appendable;
+  size_t cartesian_number = appendable->cartesian_prefix << appendable->depth;
+  if (appendable->shape_of[cartesian_number] == UINT16_MAX) {
+    size_t table_size = fhs_table_size(fhs->block_size);
+    if (fhs->num_shapes == appendable->shape_capacity) {
+      appendable->shape_capacity *= 2;
+      fhs->block_tables = realloc(fhs->block_tables, table_size * appendable->shape_capacity);
     }
+    fhs_build_shape_table(cartesian_number, fhs->block_size, fhs->block_tables + fhs->num_shapes * table_size);
+    appendable->shape_of[cartesian_number] = fhs->num_shapes;
+    ++fhs->num_shapes;
   }
+  return appendable->shape_of[cartesian_number];
+}
 
-  free(fhs->cartesian);
-  free(fhs->block_rmqs);
+// Summary entries ending at a block which has just been completed, one per level.
+void fhs_append_summary(struct fhs_t *fhs, size_t block) {
+  // The bottom of the right spine is the leftmost minimum of the block.
+  fhs->summary[block] = fhs->appendable->stack[0];
+  for (size_t level = 1; ((size_t) 1 << level) <= block + 1; ++level) {
+    size_t start = block + 1 - ((size_t) 1 << level);
+    size_t first_half = fhs->summary[(level - 1) * fhs->summary_stride + start];
+    size_t second_half = fhs->summary[(level - 1) * fhs->summary_stride + start + ((size_t) 1 << (level - 1))];
+    fhs->summary[level * fhs->summary_stride + start] =
+        fhs_less(fhs, fhs->elements.type, second_half, first_half) ? second_half : first_half;
+  }
+}
+
+/// Appends the element with the given key to a structure created by fhs_new, fhs_query covers it on return.
+///
+/// The cartesian number of the last block is extended by one push, a table is only built for a shape never seen
+/// before, and the summary gains one entry per level when the block is complete, which is O(log(size) / block size)
+/// per element.
+void fhs_append(struct fhs_t *fhs, const void *key) {
+  struct fhs_appendable *appendable = fhs->appendable;
+  if (fhs->size == appendable->key_capacity) {
+    appendable->key_capacity *= 2;
+    fhs->elements.keys = realloc((void *) fhs->elements.keys, fhs->elements.stride * appendable->key_capacity);
+  }
+  size_t i = fhs->size;
+  memcpy((char *) fhs->elements.keys + i * fhs->elements.stride, key, fhs->elements.stride);
+  ++fhs->size;
+
+  size_t block = i / fhs->block_size;
+  size_t offset = i - block * fhs->block_size;
+  if (offset == 0) {
+    if (block == fhs->summary_stride) {
+      fhs_grow_blocks(fhs);
+    }
+    ++fhs->num_blocks;
+    appendable->cartesian_prefix = 1;
+    appendable->stack[0] = i;
+    appendable->depth = 1;
+  } else {
+    while (appendable->depth > 0 && fhs_less(fhs, fhs->elements.type, i, appendable->stack[appendable->depth - 1])) {
+      // pop larger
+      --appendable->depth;
+      appendable->cartesian_prefix <<= 1;
+    }
+
+    // push
+    appendable->stack[appendable->depth] = i;
+    ++appendable->depth;
+    appendable->cartesian_prefix = (appendable->cartesian_prefix << 1) + 1;
+  }
+
+  fhs->block_shapes[block] = fhs_append_shape(fhs);
+  if (offset + 1 == fhs->block_size) {
+    fhs_append_summary(fhs, block);
+  }
+}
+
+void fhs_free(struct fhs_t *fhs) {
+  if (fhs->mapping) {
+    munmap(fhs->mapping, fhs->mapping_size);
+    free(fhs);
+    return;
+  }
+
+  free(fhs->summary);
+  free(fhs->block_shapes);
+  free(fhs->block_tables);
+  if (fhs->appendable) {
+    free((void *) fhs->elements.keys);
+    free(fhs->appendable->shape_of);
+    free(fhs->appendable);
+  }
 
   free(fhs);
 }
 
+/// Bytes used by the index, not counting the array itself.
+size_t fhs_memory(struct fhs_t *fhs) {
+  size_t summary_spans = fhs->summary_stride == 0 ? 0 : fhs_log2(fhs->summary_stride) + 1;
+  // No block shapes in FHS_BLOCK_SCAN mode
+  size_t num_block_shapes = fhs->block_mode == FHS_BLOCK_TABLES ? fhs->summary_stride : 0;
+  size_t memory = sizeof(struct fhs_t) + sizeof(size_t) * fhs->summary_stride * summary_spans +
+                  sizeof(uint16_t) * num_block_shapes;
+  if (fhs->appendable) {
+    return memory + sizeof(struct fhs_appendable) + fhs_table_size(fhs->block_size) * fhs->appendable->shape_capacity +
+           sizeof(uint16_t) * ((size_t) 1 << (fhs->block_size * 2));
+  }
+  return memory + fhs_table_size(fhs->block_size) * fhs->num_shapes;
+}
+
 size_t fhs_size(struct fhs_t *fhs) {
   return fhs->size;
 }
 
-size_t fhs_query_summary(struct fhs_t *fhs, size_t block_i, size_t block_j) {
-  if (block_i >= block_j || block_j > ((fhs->size + fhs->block_size - 1) / fhs->block_size)) {
-    return block_j * fhs->block_size;
+#define FHS_FILE_MAGIC "FHSINDEX"
+// Bumped on every change of the layout, files of other versions are rejected.
+#define FHS_FILE_VERSION 2
+#define FHS_FILE_BYTE_ORDER 0x01020304
+// Sections start on cache lines, which also aligns the summary for reading it in place.
+#define FHS_FILE_ALIGNMENT 64
+
+/// Layout of the file written by fhs_save: this header, then the summary, the block shapes, the block tables and
+/// optionally the keys, each section at its offset. The sections are the arrays of struct fhs_t as they are in memory,
+/// so the file is only readable on machines with the same byte order and size_t.
+struct fhs_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t size_t_bytes;
+    uint32_t type;
+    uint32_t block_mode;
+    uint32_t reserved;
+    uint64_t key_size; // 0 when the keys are not in the file
+    uint64_t size;
+    uint64_t block_size;
+    uint64_t num_blocks;
+    uint64_t summary_stride;
+    uint64_t num_shapes;
+    uint64_t summary_offset;
+    uint64_t block_shapes_offset;
+    uint64_t block_tables_offset;
+    uint64_t keys_offset;
+};
+
+size_t fhs_file_align(size_t offset) {
+  return (offset + FHS_FILE_ALIGNMENT - 1) / FHS_FILE_ALIGNMENT * FHS_FILE_ALIGNMENT;
+}
+
+size_t fhs_summary_bytes(size_t summary_stride) {
+  return summary_stride == 0 ? 0 : sizeof(size_t) * summary_stride * (fhs_log2(summary_stride) + 1);
+}
+
+// Pads the file up to offset, returns 0 on error.
+int fhs_file_pad(FILE *file, size_t *written, size_t offset) {
+  static const char zeros[FHS_FILE_ALIGNMENT] = {0};
+  size_t padding = offset - *written;
+  *written = offset;
+  return fwrite(zeros, 1, padding, file) == padding;
+}
+
+/// Writes the index to path, and the keys after it when with_keys is set. Keys are written packed, a key of a
+/// primitive type is taken out of its struct. Elements of type FHS_CUSTOM may hold pointers, which mean nothing to
+/// another process, so their keys are never written and fhs_load takes them from the caller.
+///
+/// \return 0 on success, -1 on error or when with_keys is set for FHS_CUSTOM.
+int fhs_save(const struct fhs_t *fhs, const char *path, int with_keys) {
+  size_t key_size = fhs_key_size(fhs->elements.type);
+  if (with_keys && key_size == 0) {
+    return -1;
   }
 
-  if (block_i + 1 == block_j) {
-    return fhs->summary[block_i];
+  struct fhs_file_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FHS_FILE_MAGIC, sizeof(header.magic));
+  header.version = FHS_FILE_VERSION;
+  header.byte_order = FHS_FILE_BYTE_ORDER;
+  header.size_t_bytes = sizeof(size_t);
+  header.type = fhs->elements.type;
+  header.block_mode = fhs->block_mode;
+  header.key_size = with_keys ? key_size : 0;
+  header.size = fhs->size;
+  header.block_size = fhs->block_size;
+  header.num_blocks = fhs->num_blocks;
+  header.summary_stride = fhs->summary_stride;
+  header.num_shapes = fhs->num_shapes;
+  header.summary_offset = fhs_file_align(sizeof(header));
+  header.block_shapes_offset = fhs_file_align(header.summary_offset + fhs_summary_bytes(fhs->summary_stride));
+  size_t num_block_shapes = fhs->block_mode == FHS_BLOCK_TABLES ? fhs->num_blocks : 0;
+  header.block_tables_offset = fhs_file_align(header.block_shapes_offset + sizeof(uint16_t) * num_block_shapes);
+  header.keys_offset = fhs_file_align(header.block_tables_offset +
+                                      fhs_table_size(fhs->block_size) * fhs->num_shapes);
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return -1;
+  }
+  size_t written = sizeof(header);
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok && fhs_file_pad(file, &written, header.summary_offset);
+  ok = ok && fwrite(fhs->summary, 1, fhs_summary_bytes(fhs->summary_stride), file) ==
+                 fhs_summary_bytes(fhs->summary_stride);
+  written += fhs_summary_bytes(fhs->summary_stride);
+  ok = ok && fhs_file_pad(file, &written, header.block_shapes_offset);
+  // No shapes nor tables in FHS_BLOCK_SCAN mode, their arrays are 0.
+  ok = ok && (num_block_shapes == 0 ||
+              fwrite(fhs->block_shapes, sizeof(uint16_t), num_block_shapes, file) == num_block_shapes);
+  written += sizeof(uint16_t) * num_block_shapes;
+  ok = ok && fhs_file_pad(file, &written, header.block_tables_offset);
+  ok = ok && (fhs->num_shapes == 0 ||
+              fwrite(fhs->block_tables, fhs_table_size(fhs->block_size), fhs->num_shapes, file) == fhs->num_shapes);
+  written += fhs_table_size(fhs->block_size) * fhs->num_shapes;
+  if (with_keys) {
+    ok = ok && fhs_file_pad(file, &written, header.keys_offset);
+    if (fhs->elements.stride == key_size) {
+      ok = ok && fwrite(fhs->elements.keys, key_size, fhs->size, file) == fhs->size;
+    } else {
+      for (size_t i = 0; ok && i < fhs->size; ++i) {
+        ok = fwrite(fhs_key(fhs, i), key_size, 1, file) == 1;
+      }
+    }
   }
 
-  if (block_i + 2 == block_j) {
-    return fhs->summary[fhs->num_blocks + block_i];
+  if (fclose(file) != 0) {
+    ok = 0;
+  }
+  return ok ? 0 : -1;
+}
+
+// Whether the section [offset, offset + bytes) lies in a file of file_size bytes.
+int fhs_file_contains(uint64_t offset, uint64_t bytes, size_t file_size) {
+  return offset % sizeof(size_t) == 0 && offset <= file_size && bytes <= file_size - offset;
+}
+
+// Whether count entries of entry_size bytes at offset lie in a file of file_size bytes, the count is checked before
+// it is multiplied so that a corrupt header cannot wrap the product.
+int fhs_file_contains_array(uint64_t offset, uint64_t count, uint64_t entry_size, size_t file_size) {
+  return (entry_size == 0 || count <= file_size / entry_size) &&
+         fhs_file_contains(offset, count * entry_size, file_size);
+}
+
+/// Maps a file written by fhs_save and answers queries straight from the mapping, nothing is copied or rebuilt. The
+/// structure is read-only, fhs_free unmaps it. The header and the block shapes are checked, the entries of the summary
+/// and the block tables are trusted.
+///
+/// \param elements Keys to query. With 0 or a 0 keys pointer the keys saved in the file are used, which FHS_CUSTOM
+///                 indexes never have, so they need the keys of the caller.
+/// \return 0 if the file cannot be mapped, is not an index of this version, or does not match elements.
+struct fhs_t *fhs_load(const char *path, const struct fhs_elements *elements) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct fhs_file_header)) {
+    close(fd);
+    return 0;
+  }
+  size_t file_size = st.st_size;
+  void *mapping = mmap(0, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return 0;
   }
 
-  size_t size_log2 = (size_t) ceil(log2(block_j - block_i));
-  size_t half_span = 1;
-  for (size_t i = 1; i < size_log2; ++i) {
-    half_span *= 2;
+  const struct fhs_file_header *header = mapping;
+  int from_file = !elements || !elements->keys;
+  int ok = memcmp(header->magic, FHS_FILE_MAGIC, sizeof(header->magic)) == 0 &&
+           header->version == FHS_FILE_VERSION && header->byte_order == FHS_FILE_BYTE_ORDER &&
+           header->size_t_bytes == sizeof(size_t) && header->type <= FHS_CUSTOM && header->block_size >= 1 &&
+           (header->block_mode == FHS_BLOCK_TABLES ? header->block_size <= FHS_MAX_BLOCK_SIZE
+                                                   : header->block_mode == FHS_BLOCK_SCAN && header->type == FHS_INT) &&
+           header->num_blocks == header->size / header->block_size + (header->size % header->block_size != 0) &&
+           header->summary_stride >= header->num_blocks &&
+           (header->key_size == 0 || header->key_size == fhs_key_size((enum fhs_type) header->type)) &&
+           (header->block_mode == FHS_BLOCK_TABLES || header->num_shapes == 0) &&
+           header->num_shapes <= UINT16_MAX + 1 &&
+           (header->summary_stride == 0 ||
+            fhs_file_contains_array(header->summary_offset, header->summary_stride,
+                                    sizeof(size_t) * (fhs_log2(header->summary_stride) + 1), file_size)) &&
+           fhs_file_contains_array(header->block_shapes_offset,
+                                   header->block_mode == FHS_BLOCK_TABLES ? header->num_blocks : 0, sizeof(uint16_t),
+                                   file_size) &&
+           (header->num_shapes == 0 ||
+            fhs_file_contains_array(header->block_tables_offset, header->num_shapes,
+                                    fhs_table_size(header->block_size), file_size));
+  if (ok && elements) {
+    // The scans read the keys as a plain array of ints.
+    ok = elements->type == header->type &&
+         (header->block_mode == FHS_BLOCK_TABLES || !elements->keys || elements->stride == sizeof(int));
   }
-  if (block_j - block_i == half_span + half_span) {
-    return fhs->summary[size_log2 * fhs->num_blocks + block_i];
+  if (ok && from_file) {
+    ok = header->key_size != 0 &&
+         fhs_file_contains_array(header->keys_offset, header->size, header->key_size, file_size);
   }
-  size_t first_half = fhs->summary[(size_log2 - 1) * fhs->num_blocks + block_i];
-  size_t second_half = fhs->summary[(size_log2 - 1) * fhs->num_blocks + block_j - half_span];
-  if (fhs->arr[second_half] < fhs->arr[first_half]) {
-    return second_half;
+  if (ok && header->block_mode == FHS_BLOCK_TABLES) {
+    // Every block points at a table in the file.
+    const uint16_t *block_shapes = (const uint16_t *) ((const char *) mapping + header->block_shapes_offset);
+    for (size_t block = 0; ok && block < header->num_blocks; ++block) {
+      ok = block_shapes[block] < header->num_shapes;
+    }
+  }
+  if (!ok) {
+    munmap(mapping, file_size);
+    return 0;
+  }
+
+  struct fhs_t *fhs = malloc(sizeof(struct fhs_t));
+  if (from_file) {
+    struct fhs_elements saved = {(const char *) mapping + header->keys_offset, header->key_size,
+                                 (enum fhs_type) header->type, 0, 0};
+    fhs->elements = saved;
+  } else {
+    fhs->elements = *elements;
   }
-  return first_half;
+  fhs->size = header->size;
+  fhs->summary = (size_t *) ((char *) mapping + header->summary_offset);
+  fhs->summary_stride = header->summary_stride;
+  fhs->block_size = header->block_size;
+  fhs->num_blocks = header->num_blocks;
+  fhs->block_shapes = (uint16_t *) ((char *) mapping + header->block_shapes_offset);
+  fhs->block_tables = (uint8_t *) mapping + header->block_tables_offset;
+  fhs->num_shapes = header->num_shapes;
+  fhs->block_mode = header->block_mode;
+  fhs->scan = fhs_scan_best();
+  fhs->appendable = 0;
+  fhs->mapping = mapping;
+  fhs->mapping_size = file_size;
+  return fhs;
+}
+
+// Finds the index of the minimum element in the full blocks [block_i, block_j), requires
+// block_i < block_j <= num_blocks, and only complete blocks for an appendable structure.
+FHS_INLINE size_t fhs_query_summary_typed(struct fhs_t *fhs, enum fhs_type type, size_t block_i, size_t block_j) {
+  size_t second_window;
+  size_t level = fhs_summary_windows(block_i, block_j, &second_window);
+  const size_t *row = fhs->summary + level * fhs->summary_stride;
+  size_t first_half = row[block_i];
+  size_t second_half = row[second_window];
+  return fhs_less(fhs, type, second_half, first_half) ? second_half : first_half;
+}
+
+size_t fhs_query_summary(struct fhs_t *fhs, size_t block_i, size_t block_j) {
+  return fhs_query_summary_typed(fhs, fhs->elements.type, block_i, block_j);
 }
 
 size_t fhs_query_block(struct fhs_t *fhs, size_t block, size_t i, size_t j) {
-  size_t actual_block_size = fhs->block_size;
-  if (i + 1 == fhs->num_blocks && fhs->size % fhs->block_size != 0) {
-    actual_block_size = fhs->size % fhs->block_size;
+  if (fhs->block_mode == FHS_BLOCK_SCAN) {
+    return fhs->scan(fhs->elements.keys, block * fhs->block_size + i, block * fhs->block_size + j);
   }
-  size_t cartesian_number = fhs->cartesian[block];
-  size_t* rmq = fhs->block_rmqs[cartesian_number];
-
-  size_t range = j - i;
-  size_t minimum_in_block = rmq[(range - 1) * actual_block_size + i];
-  return block * fhs->block_size + minimum_in_block;
+  const uint8_t *table = fhs->block_tables + fhs->block_shapes[block] * fhs_table_size(fhs->block_size);
+  return block * fhs->block_size + table[fhs_table_entry(fhs->block_size, i, j - i)];
 }
 
-// Finds the index of the minimum element in the range [i, j), returns value greater then or equal to j on error.
-size_t fhs_query(struct fhs_t *fhs, size_t i, size_t j) {
+FHS_INLINE size_t fhs_query_typed(struct fhs_t *fhs, enum fhs_type type, size_t i, size_t j) {
   if (i >= j || j > fhs_size(fhs)) {
     return j;
   }
 
+  if (type == FHS_INT && fhs->block_mode == FHS_BLOCK_SCAN && j - i <= FHS_SCAN_SHORT_RANGE) {
+    return fhs->scan(fhs->elements.keys, i, j);
+  }
+
   size_t block_i = i / fhs->block_size;
+  if ((j - 1) / fhs->block_size == block_i) {
+    // The range lies in a single block
+    return fhs_query_block(fhs, block_i, i % fhs->block_size, j - block_i * fhs->block_size);
+  }
+
   size_t block_j = (j + fhs->block_size - 1) / fhs->block_size;
   size_t full_block_i = block_i * fhs->block_size == i ? block_i : block_i + 1;
   size_t full_block_j = block_j * fhs->block_size == j ? block_j : block_j - 1;
@@ -224,15 +1035,15 @@ size_t fhs_query(struct fhs_t *fhs, size_t i, size_t j) {
   }
 
   if (full_block_i < full_block_j) {
-    size_t summary_minimum = fhs_query_summary(fhs, full_block_i, full_block_j);
-    if (fhs->arr[summary_minimum] < fhs->arr[minimum]) {
+    size_t summary_minimum = fhs_query_summary_typed(fhs, type, full_block_i, full_block_j);
+    if (fhs_less(fhs, type, summary_minimum, minimum)) {
       minimum = summary_minimum;
     }
   }
 
   if (block_j != full_block_j && (block_i == full_block_i || block_j > block_i + 1)) {
     size_t last_block_minimum = fhs_query_block(fhs, block_j - 1, 0, j % fhs->block_size);
-    if (fhs->arr[last_block_minimum] < fhs->arr[minimum]) {
+    if (fhs_less(fhs, type, last_block_minimum, minimum)) {
       minimum = last_block_minimum;
     }
   }
@@ -240,6 +1051,100 @@ size_t fhs_query(struct fhs_t *fhs, size_t i, size_t j) {
   return minimum;
 }
 
+// Finds the index of the minimum element in the range [i, j), returns value greater then or equal to j on error.
+size_t fhs_query(struct fhs_t *fhs, size_t i, size_t j) {
+  switch (fhs->elements.type) {
+    case FHS_INT:
+      return fhs_query_typed(fhs, FHS_INT, i, j);
+    case FHS_INT64:
+      return fhs_query_typed(fhs, FHS_INT64, i, j);
+    case FHS_FLOAT:
+      return fhs_query_typed(fhs, FHS_FLOAT, i, j);
+    case FHS_DOUBLE:
+      return fhs_query_typed(fhs, FHS_DOUBLE, i, j);
+    default:
+      return fhs_query_typed(fhs, FHS_CUSTOM, i, j);
+  }
+}
+
+// Number of queries the batch runs ahead of the one being answered when prefetching.
+#define FHS_BATCH_PREFETCH_DISTANCE 16
+// Structures up to this size stay in cache across a batch, where prefetching only costs instructions.
+#define FHS_BATCH_CACHE_BYTES (8 << 20)
+
+// Prefetches the keys at both ends, the block shapes and the summary entries a query of [i, j) reads. The keys of
+// the summary minima are only known once the entries are loaded.
+FHS_INLINE void fhs_query_prefetch(const struct fhs_t *fhs, size_t i, size_t j) {
+  if (i >= j || j > fhs->size) {
+    return;
+  }
+  size_t block_i = i / fhs->block_size;
+  size_t block_j = (j - 1) / fhs->block_size;
+  __builtin_prefetch(fhs_key(fhs, i));
+  __builtin_prefetch(fhs_key(fhs, j - 1));
+  if (fhs->block_mode == FHS_BLOCK_TABLES) {
+    __builtin_prefetch(fhs->block_shapes + block_i);
+    __builtin_prefetch(fhs->block_shapes + block_j);
+  }
+  size_t full_block_i = block_i * fhs->block_size == i ? block_i : block_i + 1;
+  size_t full_block_j = j / fhs->block_size;
+  if (full_block_i < full_block_j) {
+    size_t second_window;
+    size_t level = fhs_summary_windows(full_block_i, full_block_j, &second_window);
+    __builtin_prefetch(fhs->summary + level * fhs->summary_stride + full_block_i);
+    __builtin_prefetch(fhs->summary + level * fhs->summary_stride + second_window);
+  }
+}
+
+FHS_INLINE void fhs_query_batch_typed(struct fhs_t *fhs, enum fhs_type type, const size_t *is, const size_t *js,
+                                      size_t count, size_t *out) {
+  size_t bytes = fhs_memory(fhs) + fhs->size * fhs->elements.stride;
+  if (count <= FHS_BATCH_PREFETCH_DISTANCE || bytes <= FHS_BATCH_CACHE_BYTES) {
+    for (size_t k = 0; k < count; ++k) {
+      out[k] = fhs_query_typed(fhs, type, is[k], js[k]);
+    }
+    return;
+  }
+
+  for (size_t k = 0; k < count; ++k) {
+    if (k + FHS_BATCH_PREFETCH_DISTANCE < count) {
+      fhs_query_prefetch(fhs, is[k + FHS_BATCH_PREFETCH_DISTANCE], js[k + FHS_BATCH_PREFETCH_DISTANCE]);
+    }
+    out[k] = fhs_query_typed(fhs, type, is[k], js[k]);
+  }
+}
+
+/// Answers a batch of range minimum queries.
+///
+/// The queries are answered in order, and each one prefetches what the query FHS_BATCH_PREFETCH_DISTANCE places
+/// ahead reads, so the cache misses of several queries overlap instead of each waiting for its own. Small batches and
+/// structures that fit in FHS_BATCH_CACHE_BYTES are answered by a plain loop of fhs_query, where there are no misses
+/// to overlap, so the batch is never slower than calling fhs_query for each query.
+///
+/// \param is Left ends of the queries, inclusive.
+/// \param js Right ends of the queries, exclusive.
+/// \param count Number of queries.
+/// \param out Receives fhs_query(fhs, is[k], js[k]) in out[k].
+void fhs_query_batch(struct fhs_t *fhs, const size_t *is, const size_t *js, size_t count, size_t *out) {
+  switch (fhs->elements.type) {
+    case FHS_INT:
+      fhs_query_batch_typed(fhs, FHS_INT, is, js, count, out);
+      break;
+    case FHS_INT64:
+      fhs_query_batch_typed(fhs, FHS_INT64, is, js, count, out);
+      break;
+    case FHS_FLOAT:
+      fhs_query_batch_typed(fhs, FHS_FLOAT, is, js, count, out);
+      break;
+    case FHS_DOUBLE:
+      fhs_query_batch_typed(fhs, FHS_DOUBLE, is, js, count, out);
+      break;
+    default:
+      fhs_query_batch_typed(fhs, FHS_CUSTOM, is, js, count, out);
+      break;
+  }
+}
+
 void fhs_assert(struct fhs_t *fhs, size_t i, size_t j, size_t expect) {
   size_t actual = fhs_query(fhs, i, j);
   if (actual == expect) {
@@ -248,15 +1153,184 @@ void fhs_assert(struct fhs_t *fhs, size_t i, size_t j, size_t expect) {
     printf("Expect RMQ(%zu, %ld) = A[%zu]: fail, got %zu\n", i, ((long)j) - 1, expect, actual);
     for (size_t k = i; k < j; ++k) {
       if (k == i) {
-        printf("[ %d%s", fhs->arr[k], k == expect ? "*" : (k == actual ? "x" : " "));
+        printf("[ %d%s", *(const int *) fhs_key(fhs, k), k == expect ? "*" : (k == actual ? "x" : " "));
       } else {
-        printf(", %d%s", fhs->arr[k], k == expect ? "*" : (k == actual ? "x" : " "));
+        printf(", %d%s", *(const int *) fhs_key(fhs, k), k == expect ? "*" : (k == actual ? "x" : " "));
       }
     }
     printf(" ]\n");
   }
 }
 
+// Checks that two structures built over the same array hold the same summary, block shapes and block tables.
+int fhs_identical(struct fhs_t *a, struct fhs_t *b) {
+  if (a->block_size != b->block_size || a->num_blocks != b->num_blocks) {
+    return 0;
+  }
+  for (size_t level = 0; ((size_t) 1 << level) <= a->num_blocks; ++level) {
+    size_t entries = a->num_blocks - ((size_t) 1 << level) + 1;
+    if (memcmp(a->summary + level * a->summary_stride, b->summary + level * b->summary_stride,
+               sizeof(size_t) * entries)) {
+      return 0;
+    }
+  }
+  if (a->num_shapes != b->num_shapes ||
+      memcmp(a->block_shapes, b->block_shapes, sizeof(uint16_t) * a->num_blocks) ||
+      memcmp(a->block_tables, b->block_tables, fhs_table_size(a->block_size) * a->num_shapes)) {
+    return 0;
+  }
+  return 1;
+}
+
+#ifndef FHS_NO_MAIN
+// Leftmost minimum of [i, j) by scanning, to check fhs_query on other element types.
+size_t fhs_brute_force(const struct fhs_t *fhs, size_t i, size_t j) {
+  size_t minimum = i;
+  for (size_t k = i + 1; k < j; ++k) {
+    if (fhs_less(fhs, fhs->elements.type, k, minimum)) {
+      minimum = k;
+    }
+  }
+  return minimum;
+}
+
+// Checks every range of a small array and random ranges through the batch.
+int fhs_check_all(const struct fhs_elements *elements, size_t size) {
+  struct fhs_t *fhs = fhs_preprocess_elements(elements, size, 1);
+  int ok = 1;
+  for (size_t i = 0; i < size; ++i) {
+    for (size_t j = i + 1; j <= size; ++j) {
+      ok &= fhs_query(fhs, i, j) == fhs_brute_force(fhs, i, j);
+    }
+  }
+
+  size_t is[64], js[64], out[64];
+  for (size_t k = 0; k < 64; ++k) {
+    is[k] = rand() % size;
+    js[k] = is[k] + 1 + rand() % (size - is[k]);
+  }
+  fhs_query_batch(fhs, is, js, 64, out);
+  for (size_t k = 0; k < 64; ++k) {
+    ok &= out[k] == fhs_brute_force(fhs, is[k], js[k]);
+  }
+
+  fhs_free(fhs);
+  return ok;
+}
+
+struct fhs_test_event {
+    int priority;
+    int64_t time;
+};
+
+int fhs_compare_strings(const void *a, const void *b, void *context) {
+  (void) context;
+  return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+// Appends arr one element at a time, checking queries against a scan of the array after each append.
+int fhs_check_appends(int *arr, size_t size, size_t expected_size) {
+  struct fhs_elements layout = {0, sizeof(int), FHS_INT, 0, 0};
+  struct fhs_t *fhs = fhs_new(&layout, expected_size);
+  struct fhs_t *scan = fhs_preprocess(arr, size);
+  int ok = 1;
+  for (size_t n = 1; n <= size; ++n) {
+    fhs_append(fhs, arr + n - 1);
+    for (size_t k = 0; k < 16; ++k) {
+      size_t i = k == 0 ? 0 : rand() % n;
+      size_t j = k < 2 ? n : i + 1 + rand() % (n - i);
+      ok &= fhs_query(fhs, i, j) == fhs_brute_force(scan, i, j);
+    }
+  }
+
+  size_t is[64], js[64], out[64];
+  for (size_t k = 0; k < 64; ++k) {
+    is[k] = rand() % size;
+    js[k] = is[k] + 1 + rand() % (size - is[k]);
+  }
+  fhs_query_batch(fhs, is, js, 64, out);
+  for (size_t k = 0; k < 64; ++k) {
+    ok &= out[k] == fhs_query(scan, is[k], js[k]);
+  }
+
+  fhs_free(scan);
+  fhs_free(fhs);
+  return ok;
+}
+
+// Whether both structures answer every query of 2000 random ones the same.
+int fhs_same_answers(struct fhs_t *a, struct fhs_t *b) {
+  if (fhs_size(a) != fhs_size(b)) {
+    return 0;
+  }
+  int ok = 1;
+  for (size_t k = 0; k < 2000; ++k) {
+    size_t i = rand() % fhs_size(a);
+    size_t j = i + 1 + rand() % (fhs_size(a) - i);
+    ok &= fhs_query(a, i, j) == fhs_query(b, i, j);
+  }
+  return ok;
+}
+
+// Saves fhs with its keys to path, overwrites size bytes at offset of the file with value, and checks that fhs_load
+// rejects the file.
+int fhs_rejects_corrupt(const struct fhs_t *fhs, const char *path, uint64_t offset, const void *value, size_t size) {
+  if (fhs_save(fhs, path, 1) != 0) {
+    return 0;
+  }
+  int fd = open(path, O_WRONLY);
+  int written = fd >= 0 && pwrite(fd, value, size, offset) == (ssize_t) size;
+  if (fd >= 0) {
+    close(fd);
+  }
+  struct fhs_t *loaded = fhs_load(path, 0);
+  if (loaded) {
+    fhs_free(loaded);
+  }
+  return written && loaded == 0;
+}
+
+// Checks every scan the CPU runs against the scalar one, and the scan mode for a few block sizes against the tables.
+int fhs_check_scan(int *arr, size_t size) {
+  int ok = 1;
+  fhs_scan_t scans[3] = {fhs_scan_scalar, fhs_scan_scalar, fhs_scan_scalar};
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("sse4.1")) {
+    scans[1] = fhs_scan_sse41;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    scans[2] = fhs_scan_avx2;
+  }
+#endif
+  for (size_t k = 0; k < 5000; ++k) {
+    size_t i = rand() % size;
+    size_t j = i + 1 + rand() % (size - i < 100 ? size - i : 100);
+    size_t expect = fhs_scan_scalar(arr, i, j);
+    ok &= scans[1](arr, i, j) == expect && scans[2](arr, i, j) == expect;
+  }
+
+  struct fhs_t *tables = fhs_preprocess(arr, size);
+  size_t block_sizes[] = {1, 3, 16, 40};
+  for (size_t b = 0; b < 4; ++b) {
+    struct fhs_t *scan = fhs_preprocess_scan(arr, size, block_sizes[b], 2);
+    ok &= fhs_same_answers(tables, scan);
+
+    size_t is[64], js[64], out[64];
+    for (size_t k = 0; k < 64; ++k) {
+      is[k] = rand() % size;
+      js[k] = is[k] + 1 + rand() % (size - is[k]);
+    }
+    fhs_query_batch(scan, is, js, 64, out);
+    for (size_t k = 0; k < 64; ++k) {
+      ok &= out[k] == fhs_query(tables, is[k], js[k]);
+    }
+    fhs_free(scan);
+  }
+
+  fhs_free(tables);
+  return ok;
+}
+
 int main() {
   int arr[] = {31, 41, 59, 26, 53, 58, 97, 23, 93, 84, 33, 64, 62, 83, 27,
                31, 41, 59, 26, 53, 58, 97, 23, 93, 84, 33, 64, 62, 83, 27,
@@ -310,7 +1384,165 @@ int main() {
     fhs_assert(fhs, i, j, expect);
   }
 
+  printf("===> batch\n");
+  size_t is[64], js[64], batch[64];
+  for (size_t k = 0; k < 64; ++k) {
+    is[k] = ((size_t) rand()) % (n + 2);
+    js[k] = ((size_t) rand()) % (n + 2);
+  }
+  fhs_query_batch(fhs, is, js, 64, batch);
+  size_t batch_failures = 0;
+  for (size_t k = 0; k < 64; ++k) {
+    if (batch[k] != fhs_query(fhs, is[k], js[k])) {
+      printf("Expect batch RMQ(%zu, %ld) = A[%zu]: fail, got %zu\n", is[k], ((long) js[k]) - 1,
+             fhs_query(fhs, is[k], js[k]), batch[k]);
+      ++batch_failures;
+    }
+  }
+  printf("%zu of 64 batch queries match fhs_query\n", 64 - batch_failures);
+
   fhs_free(fhs);
 
+  // Larger than FHS_BATCH_CACHE_BYTES, so the batch prefetches
+  size_t large_n = 1 << 20;
+  int *large_arr = malloc(sizeof(int) * large_n);
+  for (size_t k = 0; k < large_n; ++k) {
+    large_arr[k] = rand();
+  }
+  struct fhs_t *large_fhs = fhs_preprocess(large_arr, large_n);
+  size_t large_is[4096], large_js[4096], large_batch[4096];
+  for (size_t k = 0; k < 4096; ++k) {
+    large_is[k] = ((size_t) rand()) % (large_n + 2);
+    large_js[k] = k % 2 == 0 ? large_is[k] + 1 + ((size_t) rand()) % 64 : ((size_t) rand()) % (large_n + 2);
+  }
+  fhs_query_batch(large_fhs, large_is, large_js, 4096, large_batch);
+  size_t large_failures = 0;
+  for (size_t k = 0; k < 4096; ++k) {
+    large_failures += large_batch[k] != fhs_query(large_fhs, large_is[k], large_js[k]);
+  }
+  printf("prefetching batch on %zu bytes: %s\n", fhs_memory(large_fhs) + sizeof(int) * large_n,
+         large_failures == 0 ? "pass" : "fail");
+  fhs_free(large_fhs);
+  free(large_arr);
+
+  printf("===> parallel build\n");
+  size_t random_n = 100003;
+  int *random_arr = malloc(sizeof(int) * random_n);
+  for (size_t k = 0; k < random_n; ++k) {
+    random_arr[k] = rand() % 1000;
+  }
+  struct fhs_t *serial_fhs = fhs_preprocess(random_arr, random_n);
+  struct fhs_t *parallel_fhs = fhs_preprocess_parallel(random_arr, random_n, 4);
+  printf("parallel build is %s to the serial build\n",
+         fhs_identical(serial_fhs, parallel_fhs) ? "identical" : "not identical");
+  fhs_free(parallel_fhs);
+  fhs_free(serial_fhs);
+
+  printf("===> element types\n");
+  size_t typed_n = 300;
+  int64_t *int64_arr = malloc(sizeof(int64_t) * typed_n);
+  float *float_arr = malloc(sizeof(float) * typed_n);
+  double *double_arr = malloc(sizeof(double) * typed_n);
+  struct fhs_test_event *events = malloc(sizeof(struct fhs_test_event) * typed_n);
+  const char **strings = malloc(sizeof(char *) * typed_n);
+  const char *words[] = {"fig", "apple", "kiwi", "banana", "date", "cherry", "apple", "grape"};
+  for (size_t k = 0; k < typed_n; ++k) {
+    int64_arr[k] = ((int64_t) (rand() % 100) << 40) - ((int64_t) 1 << 45);
+    float_arr[k] = rand() % 7 == 0 ? 0.0f / 0.0f : (float) (rand() % 100) / 8;
+    double_arr[k] = k % 100 < 10 ? 0.0 / 0.0 : (double) (rand() % 100) - 50.5;
+    events[k].priority = rand() % 20;
+    events[k].time = rand() % 50;
+    strings[k] = words[rand() % 8];
+  }
+  struct fhs_elements int64_elements = {int64_arr, sizeof(int64_t), FHS_INT64, 0, 0};
+  struct fhs_elements float_elements = {float_arr, sizeof(float), FHS_FLOAT, 0, 0};
+  struct fhs_elements double_elements = {double_arr, sizeof(double), FHS_DOUBLE, 0, 0};
+  struct fhs_elements priority_elements = FHS_FIELD(events, struct fhs_test_event, priority, FHS_INT);
+  struct fhs_elements time_elements = FHS_FIELD(events, struct fhs_test_event, time, FHS_INT64);
+  struct fhs_elements string_elements = {strings, sizeof(char *), FHS_CUSTOM, fhs_compare_strings, 0};
+  printf("int64: %s\n", fhs_check_all(&int64_elements, typed_n) ? "pass" : "fail");
+  printf("float with NaN: %s\n", fhs_check_all(&float_elements, typed_n) ? "pass" : "fail");
+  printf("double with NaN: %s\n", fhs_check_all(&double_elements, typed_n) ? "pass" : "fail");
+  printf("int struct field: %s\n", fhs_check_all(&priority_elements, typed_n) ? "pass" : "fail");
+  printf("int64 struct field: %s\n", fhs_check_all(&time_elements, typed_n) ? "pass" : "fail");
+  printf("custom comparator: %s\n", fhs_check_all(&string_elements, typed_n) ? "pass" : "fail");
+
+  printf("===> save and load\n");
+  char index_path[] = "/tmp/fhs_test-XXXXXX";
+  int index_fd = mkstemp(index_path);
+  if (index_fd >= 0) {
+    close(index_fd);
+  }
+  struct fhs_t *event_fhs = fhs_preprocess_elements(&time_elements, typed_n, 1);
+  int saved = fhs_save(event_fhs, index_path, 1);
+  struct fhs_t *loaded = fhs_load(index_path, 0);
+  printf("load with the keys of the file: %s\n",
+         saved == 0 && loaded && fhs_same_answers(event_fhs, loaded) ? "pass" : "fail");
+  fhs_free(loaded);
+  saved = fhs_save(event_fhs, index_path, 0);
+  loaded = fhs_load(index_path, &time_elements);
+  printf("load with the keys of the caller: %s\n",
+         saved == 0 && loaded && fhs_same_answers(event_fhs, loaded) ? "pass" : "fail");
+  fhs_free(loaded);
+  printf("load without keys: %s\n", fhs_load(index_path, 0) == 0 ? "pass" : "fail");
+  printf("load with another type: %s\n", fhs_load(index_path, &double_elements) == 0 ? "pass" : "fail");
+  printf("load a truncated file: %s\n",
+         truncate(index_path, 200) == 0 && fhs_load(index_path, &time_elements) == 0 ? "pass" : "fail");
+  uint64_t wrong_key_size = sizeof(int);
+  printf("load a key size of another type: %s\n",
+         fhs_rejects_corrupt(event_fhs, index_path, offsetof(struct fhs_file_header, key_size), &wrong_key_size,
+                             sizeof(wrong_key_size)) ? "pass" : "fail");
+  // The summary takes 8 * 2^62 * 63 bytes, which wraps to 0.
+  uint64_t huge_stride = (uint64_t) 1 << 62;
+  printf("load a summary too large to count: %s\n",
+         fhs_rejects_corrupt(event_fhs, index_path, offsetof(struct fhs_file_header, summary_stride), &huge_stride,
+                             sizeof(huge_stride)) ? "pass" : "fail");
+  uint16_t missing_shape = event_fhs->num_shapes;
+  size_t shapes_offset = fhs_file_align(fhs_file_align(sizeof(struct fhs_file_header)) +
+                                        fhs_summary_bytes(event_fhs->summary_stride));
+  printf("load a block without a table: %s\n",
+         fhs_rejects_corrupt(event_fhs, index_path, shapes_offset + sizeof(uint16_t) * (event_fhs->num_blocks - 1),
+                             &missing_shape, sizeof(missing_shape)) ? "pass" : "fail");
+  fhs_free(event_fhs);
+
+  struct fhs_elements string_layout = {0, sizeof(char *), FHS_CUSTOM, fhs_compare_strings, 0};
+  struct fhs_t *appended = fhs_new(&string_layout, 10);
+  for (size_t k = 0; k < typed_n; ++k) {
+    fhs_append(appended, strings + k);
+  }
+  printf("save the keys of custom elements: %s\n", fhs_save(appended, index_path, 1) == -1 ? "pass" : "fail");
+  saved = fhs_save(appended, index_path, 0);
+  printf("load custom elements without keys: %s\n", fhs_load(index_path, &string_layout) == 0 ? "pass" : "fail");
+  loaded = fhs_load(index_path, &string_elements);
+  printf("load an appended structure: %s\n",
+         saved == 0 && loaded && fhs_same_answers(appended, loaded) ? "pass" : "fail");
+  fhs_free(loaded);
+  fhs_free(appended);
+  remove(index_path);
+
+  free(strings);
+  free(events);
+  free(double_arr);
+  free(float_arr);
+  free(int64_arr);
+
+  printf("===> scan mode\n");
+  printf("scans and scan mode: %s\n", fhs_check_scan(random_arr, random_n) ? "pass" : "fail");
+  struct fhs_t *scan_fhs = fhs_preprocess_scan(random_arr, random_n, 0, 1);
+  saved = fhs_save(scan_fhs, index_path, 0);
+  struct fhs_elements random_elements = {random_arr, sizeof(int), FHS_INT, 0, 0};
+  loaded = fhs_load(index_path, &random_elements);
+  printf("load a scan mode index: %s\n",
+         saved == 0 && loaded && fhs_same_answers(scan_fhs, loaded) ? "pass" : "fail");
+  fhs_free(loaded);
+  fhs_free(scan_fhs);
+  remove(index_path);
+
+  printf("===> append\n");
+  printf("append with a small expected size: %s\n", fhs_check_appends(random_arr, 3000, 1) ? "pass" : "fail");
+  printf("append with a large expected size: %s\n", fhs_check_appends(random_arr, 3000, 1 << 20) ? "pass" : "fail");
+  free(random_arr);
+
   return 0;
 }
+#endif
@@ -0,0 +1,424 @@
+// Benchmarks for the Fischer-Heun structure.
+//
+// Usage: fhs_bench [array size] [number of queries] [build threads] [index file], build with
+// -DCMAKE_BUILD_TYPE=Release for meaningful numbers. The index file is written by the load benchmark and removed after.
+
+#define FHS_NO_MAIN
+#include "fhs.c"
+
+#include "../bench.h"
+#include <math.h>
+
+void bench_batch(struct fhs_t *fhs, size_t num_queries) {
+  size_t n = fhs_size(fhs);
+  size_t *is = malloc(sizeof(size_t) * num_queries);
+  size_t *js = malloc(sizeof(size_t) * num_queries);
+  size_t *single = malloc(sizeof(size_t) * num_queries);
+  size_t *batch = malloc(sizeof(size_t) * num_queries);
+
+  size_t state = 0x9e3779b97f4a7c15ULL;
+  for (size_t k = 0; k < num_queries; ++k) {
+    is[k] = bench_random(&state) % n;
+    js[k] = is[k] + 1 + bench_random(&state) % (n - is[k]);
+  }
+
+  double start = now_seconds();
+  for (size_t k = 0; k < num_queries; ++k) {
+    single[k] = fhs_query(fhs, is[k], js[k]);
+  }
+  double single_seconds = now_seconds() - start;
+
+  start = now_seconds();
+  fhs_query_batch(fhs, is, js, num_queries, batch);
+  double batch_seconds = now_seconds() - start;
+
+  for (size_t k = 0; k < num_queries; ++k) {
+    if (single[k] != batch[k]) {
+      printf("batch mismatch on query [%zu, %zu): %zu != %zu\n", is[k], js[k], batch[k], single[k]);
+      exit(1);
+    }
+  }
+
+  printf("fhs_query        %8.1f ns/query\n", single_seconds * 1e9 / num_queries);
+  printf("fhs_query_batch  %8.1f ns/query (%.2fx)\n", batch_seconds * 1e9 / num_queries,
+         single_seconds / batch_seconds);
+
+  free(batch);
+  free(single);
+  free(js);
+  free(is);
+}
+
+// fhs_query_summary as it was before the integer log, kept as the baseline of bench_summary.
+size_t fhs_query_summary_libm(struct fhs_t *fhs, size_t block_i, size_t block_j) {
+  if (block_i >= block_j || block_j > ((fhs->size + fhs->block_size - 1) / fhs->block_size)) {
+    return block_j * fhs->block_size;
+  }
+
+  if (block_i + 1 == block_j) {
+    return fhs->summary[block_i];
+  }
+
+  if (block_i + 2 == block_j) {
+    return fhs->summary[fhs->summary_stride + block_i];
+  }
+
+  size_t size_log2 = (size_t) ceil(log2(block_j - block_i));
+  size_t half_span = 1;
+  for (size_t i = 1; i < size_log2; ++i) {
+    half_span *= 2;
+  }
+  if (block_j - block_i == half_span + half_span) {
+    return fhs->summary[size_log2 * fhs->summary_stride + block_i];
+  }
+  size_t first_half = fhs->summary[(size_log2 - 1) * fhs->summary_stride + block_i];
+  size_t second_half = fhs->summary[(size_log2 - 1) * fhs->summary_stride + block_j - half_span];
+  if (fhs_less(fhs, fhs->elements.type, second_half, first_half)) {
+    return second_half;
+  }
+  return first_half;
+}
+
+// Latency of one summary lookup: each query depends on the answer of the previous one, so lookups cannot overlap.
+// The structure is small enough to stay in the cache, leaving only the cost of the lookup itself.
+void bench_summary(size_t num_queries) {
+  size_t n = 1 << 16;
+  int *arr = malloc(sizeof(int) * n);
+  size_t state = 0x5851f42d4c957f2dULL;
+  for (size_t k = 0; k < n; ++k) {
+    arr[k] = (int) bench_random(&state);
+  }
+  struct fhs_t *fhs = fhs_preprocess(arr, n);
+
+  size_t *block_is = malloc(sizeof(size_t) * num_queries);
+  size_t *block_js = malloc(sizeof(size_t) * num_queries);
+  for (size_t k = 0; k < num_queries; ++k) {
+    block_is[k] = bench_random(&state) % fhs->num_blocks;
+    block_js[k] = block_is[k] + 1 + bench_random(&state) % (fhs->num_blocks - block_is[k]);
+  }
+
+  size_t libm_chain = 0;
+  double start = now_seconds();
+  for (size_t k = 0; k < num_queries; ++k) {
+    // always 0, but the compiler cannot tell
+    size_t dependency = libm_chain >> 63;
+    libm_chain = fhs_query_summary_libm(fhs, block_is[k] + dependency, block_js[k] + dependency);
+  }
+  double libm_seconds = now_seconds() - start;
+
+  size_t chain = 0;
+  start = now_seconds();
+  for (size_t k = 0; k < num_queries; ++k) {
+    size_t dependency = chain >> 63;
+    chain = fhs_query_summary(fhs, block_is[k] + dependency, block_js[k] + dependency);
+  }
+  double seconds = now_seconds() - start;
+
+  if (libm_chain != chain) {
+    printf("summary lookups differ\n");
+    exit(1);
+  }
+
+  printf("fhs_query_summary, libm log2    %8.2f ns/query\n", libm_seconds * 1e9 / num_queries);
+  printf("fhs_query_summary, integer log  %8.2f ns/query (%.2fx)\n", seconds * 1e9 / num_queries,
+         libm_seconds / seconds);
+
+  free(block_js);
+  free(block_is);
+  fhs_free(fhs);
+  free(arr);
+}
+
+// Memory of the block tables, before: a size_t cartesian number per block, an array of 4^block_size table pointers
+// and a block_size^2 table of size_t per shape; after: a 16 bits shape per block and the uint8_t triangular tables.
+void bench_memory(int *arr, size_t n) {
+  struct fhs_t *fhs = fhs_preprocess(arr, n);
+  size_t b = fhs->block_size;
+  size_t before = sizeof(size_t) * fhs->num_blocks + sizeof(size_t *) * ((size_t) 1 << (2 * b)) +
+                  sizeof(size_t) * b * b * fhs->num_shapes;
+  size_t after = sizeof(uint16_t) * fhs->num_blocks + fhs_table_size(b) * fhs->num_shapes;
+  size_t summary = fhs_memory(fhs) - sizeof(struct fhs_t) - after;
+
+  printf("block size %zu, %zu blocks, %zu distinct shapes\n", b, fhs->num_blocks, fhs->num_shapes);
+  printf("block tables before  %12zu bytes, %6.3f bytes/element\n", before, (double) before / n);
+  printf("block tables after   %12zu bytes, %6.3f bytes/element\n", after, (double) after / n);
+  printf("summary              %12zu bytes, %6.3f bytes/element\n", summary, (double) summary / n);
+
+  fhs_free(fhs);
+}
+
+void bench_build(int *arr, size_t n, size_t num_threads) {
+  double start = now_seconds();
+  struct fhs_t *serial_fhs = fhs_preprocess(arr, n);
+  double serial_seconds = now_seconds() - start;
+
+  start = now_seconds();
+  struct fhs_t *parallel_fhs = fhs_preprocess_parallel(arr, n, num_threads);
+  double parallel_seconds = now_seconds() - start;
+
+  if (!fhs_identical(serial_fhs, parallel_fhs)) {
+    printf("parallel build differs from the serial build\n");
+    exit(1);
+  }
+
+  printf("fhs_preprocess            %8.2f ns/element\n", serial_seconds * 1e9 / n);
+  printf("fhs_preprocess_parallel   %8.2f ns/element (%zu threads, %.2fx)\n", parallel_seconds * 1e9 / n,
+         num_threads, serial_seconds / parallel_seconds);
+
+  fhs_free(parallel_fhs);
+  fhs_free(serial_fhs);
+}
+
+// Cost of growing the structure one element at a time, against building it once over the whole array. The block size
+// of the appendable structure is chosen for n elements, so that both have the same shape.
+void bench_append(int *arr, size_t n) {
+  struct fhs_elements layout = {0, sizeof(int), FHS_INT, 0, 0};
+  double start = now_seconds();
+  struct fhs_t *appended = fhs_new(&layout, n);
+  for (size_t k = 0; k < n; ++k) {
+    fhs_append(appended, arr + k);
+  }
+  double append_seconds = now_seconds() - start;
+
+  start = now_seconds();
+  struct fhs_t *built = fhs_preprocess(arr, n);
+  double build_seconds = now_seconds() - start;
+
+  size_t state = 0x6a09e667f3bcc908ULL;
+  for (size_t k = 0; k < 100000; ++k) {
+    size_t i = bench_random(&state) % n;
+    size_t j = i + 1 + bench_random(&state) % (n - i);
+    if (fhs_query(appended, i, j) != fhs_query(built, i, j)) {
+      printf("appended structure differs on query [%zu, %zu)\n", i, j);
+      exit(1);
+    }
+  }
+
+  printf("fhs_append       %8.2f ns/element, %12zu bytes\n", append_seconds * 1e9 / n, fhs_memory(appended));
+  printf("fhs_preprocess   %8.2f ns/element, %12zu bytes\n", build_seconds * 1e9 / n, fhs_memory(built));
+
+  fhs_free(built);
+  fhs_free(appended);
+}
+
+// Startup from a saved index against preprocessing the array again. The file was just written, so it is likely in the
+// page cache, the first queries fault in the pages they touch.
+void bench_load(int *arr, size_t n, const char *path) {
+  struct fhs_t *built = fhs_preprocess(arr, n);
+  double start = now_seconds();
+  struct fhs_t *rebuilt = fhs_preprocess(arr, n);
+  double build_seconds = now_seconds() - start;
+  fhs_free(rebuilt);
+
+  start = now_seconds();
+  if (fhs_save(built, path, 1) != 0) {
+    printf("cannot write %s\n", path);
+    exit(1);
+  }
+  double save_seconds = now_seconds() - start;
+
+  start = now_seconds();
+  struct fhs_t *loaded = fhs_load(path, 0);
+  double load_seconds = now_seconds() - start;
+  if (!loaded) {
+    printf("cannot load %s\n", path);
+    exit(1);
+  }
+
+  size_t state = 0x3c6ef372fe94f82bULL;
+  start = now_seconds();
+  for (size_t k = 0; k < 1000; ++k) {
+    size_t i = bench_random(&state) % n;
+    size_t j = i + 1 + bench_random(&state) % (n - i);
+    if (fhs_query(loaded, i, j) != fhs_query(built, i, j)) {
+      printf("loaded index differs on query [%zu, %zu)\n", i, j);
+      exit(1);
+    }
+  }
+  double query_seconds = now_seconds() - start;
+
+  printf("fhs_preprocess            %10.3f ms\n", build_seconds * 1e3);
+  printf("fhs_save                  %10.3f ms\n", save_seconds * 1e3);
+  printf("fhs_load                  %10.3f ms (%.0fx)\n", load_seconds * 1e3, build_seconds / load_seconds);
+  printf("first 1000 queries        %10.3f ms, with page faults\n", query_seconds * 1e3);
+
+  fhs_free(loaded);
+  fhs_free(built);
+  remove(path);
+}
+
+double bench_queries(struct fhs_t *fhs, const size_t *is, const size_t *js, size_t num_queries, size_t *checksum) {
+  *checksum = 0;
+  double start = now_seconds();
+  for (size_t k = 0; k < num_queries; ++k) {
+    *checksum += fhs_query(fhs, is[k], js[k]);
+  }
+  return (now_seconds() - start) * 1e9 / num_queries;
+}
+
+// Table mode against scan mode over block sizes and range lengths: short ranges up to 16 elements, medium ranges
+// up to 1024 and ranges of uniformly random ends.
+void bench_scan(int *arr, size_t n, size_t num_queries) {
+  const char *names[] = {"short", "medium", "uniform"};
+  size_t max_lengths[] = {16, 1024, n};
+  size_t *is = malloc(sizeof(size_t) * num_queries);
+  size_t *js = malloc(sizeof(size_t) * num_queries);
+  struct fhs_t *tables = fhs_preprocess(arr, n);
+  size_t block_sizes[] = {4, 8, 16, 32, 64};
+  struct fhs_t *scans[5];
+  for (size_t b = 0; b < 5; ++b) {
+    scans[b] = fhs_preprocess_scan(arr, n, block_sizes[b], 1);
+  }
+
+  printf("%-8s %-20s %12s %12s\n", "ranges", "mode", "ns/query", "bytes/elem");
+  for (size_t d = 0; d < 3; ++d) {
+    size_t state = 0x510e527fade682d1ULL;
+    for (size_t k = 0; k < num_queries; ++k) {
+      size_t length = 1 + bench_random(&state) % (max_lengths[d] < n ? max_lengths[d] : n);
+      is[k] = bench_random(&state) % (n - length + 1);
+      js[k] = is[k] + length;
+    }
+    if (d == 2) {
+      for (size_t k = 0; k < num_queries; ++k) {
+        is[k] = bench_random(&state) % n;
+        js[k] = is[k] + 1 + bench_random(&state) % (n - is[k]);
+      }
+    }
+
+    size_t expect;
+    double table_ns = bench_queries(tables, is, js, num_queries, &expect);
+    printf("%-8s tables, block %-6zu %12.1f %12.2f\n", names[d], tables->block_size, table_ns,
+           (double) (fhs_memory(tables) - sizeof(struct fhs_t)) / n);
+    for (size_t b = 0; b < 5; ++b) {
+      fhs_scan_t best = scans[b]->scan;
+      fhs_scan_t variants[] = {best, fhs_scan_scalar};
+      const char *best_name = best == fhs_scan_scalar ? "scalar" : "sse4.1";
+#if defined(__x86_64__) || defined(__i386__)
+      best_name = best == fhs_scan_avx2 ? "avx2" : best_name;
+#endif
+      const char *variant_names[] = {best_name, "scalar"};
+      for (size_t v = 0; v < 2; ++v) {
+        scans[b]->scan = variants[v];
+        size_t checksum;
+        double ns = bench_queries(scans[b], is, js, num_queries, &checksum);
+        if (checksum != expect) {
+          printf("scan mode differs from table mode\n");
+          exit(1);
+        }
+        printf("%-8s %-6s, block %-6zu %12.1f %12.2f\n", names[d], variant_names[v], block_sizes[b], ns,
+               (double) (fhs_memory(scans[b]) - sizeof(struct fhs_t)) / n);
+      }
+      scans[b]->scan = best;
+    }
+  }
+
+  for (size_t b = 0; b < 5; ++b) {
+    fhs_free(scans[b]);
+  }
+  fhs_free(tables);
+  free(js);
+  free(is);
+}
+
+int bench_compare_ints(const void *a, const void *b, void *context) {
+  (void) context;
+  int x = *(const int *) a;
+  int y = *(const int *) b;
+  return (x > y) - (x < y);
+}
+
+// Build and query cost per element type, the keys hold the same order in every type, up to ties among the floats.
+// FHS_CUSTOM orders ints through a comparator, which is the price of an indirect call per comparison.
+void bench_types(int *arr, size_t n, size_t num_queries) {
+  int64_t *int64_arr = malloc(sizeof(int64_t) * n);
+  float *float_arr = malloc(sizeof(float) * n);
+  double *double_arr = malloc(sizeof(double) * n);
+  for (size_t k = 0; k < n; ++k) {
+    int64_arr[k] = arr[k];
+    float_arr[k] = (float) (arr[k] >> 8); // exact in a float
+    double_arr[k] = arr[k];
+  }
+  struct {
+      const char *name;
+      struct fhs_elements elements;
+  } types[] = {
+      {"int", {arr, sizeof(int), FHS_INT, 0, 0}},
+      {"int64", {int64_arr, sizeof(int64_t), FHS_INT64, 0, 0}},
+      {"float", {float_arr, sizeof(float), FHS_FLOAT, 0, 0}},
+      {"double", {double_arr, sizeof(double), FHS_DOUBLE, 0, 0}},
+      {"custom", {arr, sizeof(int), FHS_CUSTOM, bench_compare_ints, 0}},
+  };
+
+  size_t *is = malloc(sizeof(size_t) * num_queries);
+  size_t *js = malloc(sizeof(size_t) * num_queries);
+  size_t state = 0x9e3779b97f4a7c15ULL;
+  for (size_t k = 0; k < num_queries; ++k) {
+    is[k] = bench_random(&state) % n;
+    js[k] = is[k] + 1 + bench_random(&state) % (n - is[k]);
+  }
+
+  for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); ++t) {
+    double start = now_seconds();
+    struct fhs_t *fhs = fhs_preprocess_elements(&types[t].elements, n, 1);
+    double build_seconds = now_seconds() - start;
+
+    size_t checksum = 0;
+    start = now_seconds();
+    for (size_t k = 0; k < num_queries; ++k) {
+      checksum += fhs_query(fhs, is[k], js[k]);
+    }
+    double query_seconds = now_seconds() - start;
+
+    printf("%-8s build %8.2f ns/element, fhs_query %8.1f ns/query, checksum %zx\n", types[t].name,
+           build_seconds * 1e9 / n, query_seconds * 1e9 / num_queries, checksum);
+    fhs_free(fhs);
+  }
+
+  free(js);
+  free(is);
+  free(double_arr);
+  free(float_arr);
+  free(int64_arr);
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? strtoull(argv[1], 0, 10) : 10000000;
+  size_t num_queries = argc > 2 ? strtoull(argv[2], 0, 10) : 10000000;
+  size_t num_threads = argc > 3 ? strtoull(argv[3], 0, 10) : 4;
+  const char *index_path = argc > 4 ? argv[4] : "fhs_bench.index";
+
+  int *arr = malloc(sizeof(int) * n);
+  size_t state = 0x2545f4914f6cdd1dULL;
+  for (size_t k = 0; k < n; ++k) {
+    arr[k] = (int) bench_random(&state);
+  }
+
+  printf("===> summary lookup latency\n");
+  bench_summary(num_queries);
+
+  printf("===> n = %zu, memory\n", n);
+  bench_memory(arr, n);
+
+  printf("===> n = %zu, build\n", n);
+  bench_build(arr, n, num_threads);
+
+  printf("===> n = %zu, save and load\n", n);
+  bench_load(arr, n, index_path);
+
+  printf("===> n = %zu, %zu queries, table mode and scan mode\n", n, num_queries);
+  bench_scan(arr, n, num_queries);
+
+  printf("===> n = %zu, append\n", n);
+  bench_append(arr, n);
+
+  printf("===> n = %zu, %zu random queries per element type\n", n, num_queries);
+  bench_types(arr, n, num_queries);
+
+  printf("===> n = %zu, %zu random queries\n", n, num_queries);
+  struct fhs_t *fhs = fhs_preprocess(arr, n);
+  bench_batch(fhs, num_queries);
+  fhs_free(fhs);
+
+  free(arr);
+  return 0;
+}
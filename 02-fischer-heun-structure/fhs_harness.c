@@ -0,0 +1,203 @@
+// Benchmark and correctness harness for the Fischer-Heun structure.
+//
+// Usage: fhs_harness [queries per workload] [array sizes...], build with -DCMAKE_BUILD_TYPE=Release for meaningful
+// numbers. Every array is generated and every workload drawn from fixed seeds, and every answer of every mode is
+// checked against a brute-force scan, the harness exits with 1 on the first mismatch.
+
+#define FHS_NO_MAIN
+#include "fhs.c"
+
+#include "../bench.h"
+
+enum harness_distribution {
+    HARNESS_RANDOM,
+    HARNESS_SORTED,
+    HARNESS_REVERSE,
+    HARNESS_SAWTOOTH,
+    HARNESS_FEW_DISTINCT,
+    HARNESS_NUM_DISTRIBUTIONS
+};
+
+const char *harness_distribution_names[] = {"random", "sorted", "reverse", "sawtooth", "few-distinct"};
+
+void harness_generate(int *arr, size_t n, enum harness_distribution distribution) {
+  size_t state = 0x2545f4914f6cdd1dULL + distribution;
+  for (size_t k = 0; k < n; ++k) {
+    switch (distribution) {
+      case HARNESS_RANDOM:
+        arr[k] = (int) bench_random(&state);
+        break;
+      case HARNESS_SORTED:
+        arr[k] = (int) k;
+        break;
+      case HARNESS_REVERSE:
+        arr[k] = (int) (n - k);
+        break;
+      case HARNESS_SAWTOOTH:
+        // teeth of 1000 elements, each lower than the one before, so minimums sit at the ends of the teeth
+        arr[k] = (int) (k % 1000) - (int) (k / 1000);
+        break;
+      default:
+        // lots of ties, which exercises the leftmost minimum
+        arr[k] = (int) (bench_random(&state) % 8);
+        break;
+    }
+  }
+}
+
+enum harness_workload {
+    HARNESS_SHORT,
+    HARNESS_LONG,
+    HARNESS_MIXED,
+    HARNESS_NUM_WORKLOADS
+};
+
+const char *harness_workload_names[] = {"short", "long", "mixed"};
+
+// Short ranges have up to 16 elements, long ranges at least half of the array, mixed ranges are short or have
+// uniformly random ends with even odds.
+void harness_queries(size_t n, enum harness_workload workload, size_t *is, size_t *js, size_t num_queries) {
+  size_t state = 0x9e3779b97f4a7c15ULL + workload;
+  for (size_t k = 0; k < num_queries; ++k) {
+    size_t length;
+    if (workload == HARNESS_SHORT || (workload == HARNESS_MIXED && bench_random(&state) % 2 == 0)) {
+      length = 1 + bench_random(&state) % (n < 16 ? n : 16);
+    } else if (workload == HARNESS_LONG) {
+      length = (n + 1) / 2 + bench_random(&state) % (n - (n + 1) / 2 + 1);
+    } else {
+      size_t i = bench_random(&state) % n;
+      length = 1 + bench_random(&state) % (n - i);
+      is[k] = i;
+      js[k] = i + length;
+      continue;
+    }
+    is[k] = bench_random(&state) % (n - length + 1);
+    js[k] = is[k] + length;
+  }
+}
+
+// Leftmost minimum by scanning, independent of every part of fhs.c.
+size_t harness_oracle(const int *arr, size_t i, size_t j) {
+  size_t minimum = i;
+  for (size_t k = i + 1; k < j; ++k) {
+    if (arr[k] < arr[minimum]) {
+      minimum = k;
+    }
+  }
+  return minimum;
+}
+
+int harness_compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+// Cost of reading the clock, taken off each query latency.
+double harness_clock_overhead() {
+  double samples[1001];
+  for (size_t k = 0; k < 1001; ++k) {
+    double start = now_seconds();
+    samples[k] = now_seconds() - start;
+  }
+  qsort(samples, 1001, sizeof(double), harness_compare_doubles);
+  return samples[500];
+}
+
+enum harness_mode {
+    HARNESS_TABLES,
+    HARNESS_SCAN,
+    HARNESS_NUM_MODES
+};
+
+const char *harness_mode_names[] = {"tables", "scan"};
+
+struct fhs_t *harness_build(enum harness_mode mode, int *arr, size_t n) {
+  if (mode == HARNESS_TABLES) {
+    return fhs_preprocess(arr, n);
+  }
+  return fhs_preprocess_scan(arr, n, 0, 1);
+}
+
+// Times each query on its own, checks it against the oracle and prints the latency percentiles.
+void harness_run(struct fhs_t *fhs, const char *label, const size_t *is, const size_t *js, const size_t *expect,
+                 size_t num_queries, double *latencies, double clock_overhead) {
+  double total = 0;
+  for (size_t k = 0; k < num_queries; ++k) {
+    double start = now_seconds();
+    size_t actual = fhs_query(fhs, is[k], js[k]);
+    double latency = now_seconds() - start - clock_overhead;
+    if (actual != expect[k]) {
+      printf("%s: RMQ[%zu, %zu) = %zu, expected %zu\n", label, is[k], js[k], actual, expect[k]);
+      exit(1);
+    }
+    latencies[k] = latency < 0 ? 0 : latency;
+    total += latencies[k];
+  }
+
+  qsort(latencies, num_queries, sizeof(double), harness_compare_doubles);
+  printf("%-44s %10.1f %10.1f %10.1f\n", label, latencies[num_queries / 2] * 1e9,
+         latencies[num_queries * 99 / 100] * 1e9, total * 1e9 / num_queries);
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_queries = argc > 1 ? strtoull(argv[1], 0, 10) : 5000;
+  size_t default_sizes[] = {1000, 100000, 1000000};
+  size_t num_sizes = argc > 2 ? (size_t) argc - 2 : 3;
+
+  size_t *is = malloc(sizeof(size_t) * num_queries);
+  size_t *js = malloc(sizeof(size_t) * num_queries);
+  size_t *expect = malloc(sizeof(size_t) * num_queries * HARNESS_NUM_WORKLOADS);
+  double *latencies = malloc(sizeof(double) * num_queries);
+  double clock_overhead = harness_clock_overhead();
+  size_t checked = 0;
+
+  for (size_t s = 0; s < num_sizes; ++s) {
+    size_t n = argc > 2 ? strtoull(argv[s + 2], 0, 10) : default_sizes[s];
+    if (n == 0) {
+      continue;
+    }
+    int *arr = malloc(sizeof(int) * n);
+
+    for (size_t d = 0; d < HARNESS_NUM_DISTRIBUTIONS; ++d) {
+      harness_generate(arr, n, d);
+      printf("===> %s, n = %zu\n", harness_distribution_names[d], n);
+
+      for (size_t m = 0; m < HARNESS_NUM_MODES; ++m) {
+        double start = now_seconds();
+        struct fhs_t *fhs = harness_build(m, arr, n);
+        double build_seconds = now_seconds() - start;
+        printf("%-8s build %8.2f ns/element, %8.2f bytes/element\n", harness_mode_names[m],
+               build_seconds * 1e9 / n, (double) (fhs_memory(fhs) - sizeof(struct fhs_t)) / n);
+        fhs_free(fhs);
+      }
+      printf("%-44s %10s %10s %10s\n", "ns/query", "p50", "p99", "mean");
+
+      for (size_t w = 0; w < HARNESS_NUM_WORKLOADS; ++w) {
+        harness_queries(n, w, is, js, num_queries);
+        size_t *workload_expect = expect + w * num_queries;
+        for (size_t k = 0; k < num_queries; ++k) {
+          workload_expect[k] = harness_oracle(arr, is[k], js[k]);
+        }
+
+        for (size_t m = 0; m < HARNESS_NUM_MODES; ++m) {
+          struct fhs_t *fhs = harness_build(m, arr, n);
+          char label[64];
+          snprintf(label, sizeof(label), "%s, %s", harness_mode_names[m], harness_workload_names[w]);
+          harness_run(fhs, label, is, js, workload_expect, num_queries, latencies, clock_overhead);
+          checked += num_queries;
+          fhs_free(fhs);
+        }
+      }
+    }
+
+    free(arr);
+  }
+
+  printf("%zu answers match the brute-force oracle\n", checked);
+  free(latencies);
+  free(expect);
+  free(js);
+  free(is);
+  return 0;
+}
@@ -2,6 +2,19 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "../parallel.h"
+
+// Entries of the low-memory suffix array, build with -DSAIS_INDEX_32 to halve it for texts shorter than 2^32 - 1.
+#ifdef SAIS_INDEX_32
+typedef uint32_t sais_index_t;
+#define SAIS_EMPTY UINT32_MAX
+#else
+typedef size_t sais_index_t;
+#define SAIS_EMPTY SIZE_MAX
+#endif
 
 void print_sa(const size_t *sa, size_t len) {
   for (size_t i = 0; i < len + 1; ++i) {
@@ -10,71 +23,30 @@ void print_sa(const size_t *sa, size_t len) {
   printf(" ]\n");
 }
 
-/// Searches pattern in text with assistant of suffix array.
-///
-/// \param pattern NULL-terminated string to search in the text.
-/// \param text NULL-terminated string to search the all occurrences of the pattern.
-/// \param sa Suffix array for text
-/// \param positions if this is not NULL, it will point to an element in sa, such that starting from poistions, all the consecutive suffixes are starting with the pattern.
-/// \return number of occurrences of pattern in text.
-size_t sais_search_for(const char *pattern, const char *text, const size_t *sa, const size_t **positions) {
-  if (positions != 0 && *positions != 0) {
-    free((void *) *positions);
-    *positions = 0;
-  }
-
-  size_t pattern_len = strlen(pattern);
-  size_t sa_len = sa[0] + 1;
-  size_t lower = 0;
-  size_t upper = sa_len;
-
-  while (lower < upper) {
-    size_t middle = (lower + upper) / 2;
-    int cmp = strncmp(pattern, text + sa[middle], pattern_len);
-    if (cmp < 0) {
-      upper = middle;
-    } else if (cmp > 0) {
-      lower = middle + 1;
-    } else {
-      lower = middle;
-      upper = middle + 1;
-      // found one, look around
-      while (lower > 0 && strncmp(pattern, text + sa[lower - 1], pattern_len) == 0) {
-        --lower;
-      }
-      while (upper < sa_len && strncmp(pattern, text + sa[upper], pattern_len) == 0) {
-        ++upper;
-      }
-      if (positions != 0) {
-        *positions = sa + lower;
-      }
-      return upper - lower;
-    }
+// Symbol at position i of a text of symbol_size bytes wide symbols, shifted up by one so that 0 is left for the
+// sentinel at position len, which is smaller than any symbol.
+size_t sais_symbol(const void *text, size_t symbol_size, size_t len, size_t i) {
+  if (i == len) {
+    return 0;
   }
-
-  return 0;
-}
-
-void test_search_for() {
-  const char *text = "ABANANABANDANA";
-  size_t sa[] = {14, 13, 0, 6, 11, 4, 2, 8, 1, 7, 10, 12, 5, 3, 9};
-
-  const size_t *positions = 0;
-  size_t occurrences = sais_search_for("ANA", text, sa, &positions);
-
-  assert(occurrences == 3);
-  for (size_t i = 0; i < occurrences; ++i) {
-    assert(strncmp("ANA", text + positions[i], 3) == 0);
+  switch (symbol_size) {
+    case 1:
+      return (size_t) ((const unsigned char *) text)[i] + 1;
+    case 4:
+      return (size_t) ((const uint32_t *) text)[i] + 1;
+    default:
+      return ((const size_t *) text)[i] + 1;
   }
 }
 
-size_t *build_initial_buckets(const char *text, size_t len) {
-  size_t *buckets = calloc(256, sizeof(size_t));
+// Buckets are indexed by the shifted symbols, bucket 0 only holds the sentinel.
+size_t *build_initial_buckets(const void *text, size_t symbol_size, size_t len, size_t num_buckets) {
+  size_t *buckets = calloc(num_buckets, sizeof(size_t));
   buckets[0] = 1;
   for (size_t i = 0; i < len; ++i) {
-    ++buckets[(size_t) text[i]];
+    ++buckets[sais_symbol(text, symbol_size, len, i)];
   }
-  for (size_t i = 1; i < 256; ++i) {
+  for (size_t i = 1; i < num_buckets; ++i) {
     buckets[i] += buckets[i - 1];
   }
 
@@ -82,14 +54,15 @@ size_t *build_initial_buckets(const char *text, size_t len) {
 }
 
 // It is assumed that lms's are already filled in sa.
-void induced_sort(const char *text, size_t len, size_t *sa, const char *types, const size_t *initial_buckets) {
-  size_t *filled = calloc(256, sizeof(size_t));
+void induced_sort(const void *text, size_t symbol_size, size_t len, size_t *sa, const char *types,
+                  const size_t *initial_buckets, size_t num_buckets) {
+  size_t *filled = calloc(num_buckets, sizeof(size_t));
 
   // Fill L preceding the existing suffixes in sa
   for (size_t i = 0; i < len + 1; ++i) {
     if (sa[i] > 0 && types[sa[i] - 1] == 'l') {
       size_t l = sa[i] - 1;
-      size_t initial = text[l];
+      size_t initial = sais_symbol(text, symbol_size, len, l);
       size_t pos = initial_buckets[initial - 1] + filled[initial];
       ++filled[initial];
 
@@ -98,19 +71,19 @@ void induced_sort(const char *text, size_t len, size_t *sa, const char *types, c
   }
 
   // Reset lms at the end of the sa
-  for (size_t i = 1; i < 256; ++i) {
+  for (size_t i = 1; i < num_buckets; ++i) {
     for (size_t j = initial_buckets[i - 1] + filled[i]; j < initial_buckets[i]; ++j) {
       sa[j] = 0;
     }
   }
 
-  bzero(filled, 256 * sizeof(size_t));
+  bzero(filled, num_buckets * sizeof(size_t));
 
   // Fill S preceding the existing suffixes in sa, in reverse order
   for (size_t i = len + 1; i > 0; --i) {
     if (sa[i - 1] > 0 && types[sa[i - 1] - 1] != 'l') {
       size_t s = sa[i - 1] - 1;
-      size_t initial = text[s];
+      size_t initial = sais_symbol(text, symbol_size, len, s);
       size_t pos = initial_buckets[initial] - 1 - filled[initial];
       ++filled[initial];
 
@@ -121,10 +94,25 @@ void induced_sort(const char *text, size_t len, size_t *sa, const char *types, c
   free(filled);
 }
 
-/// Builds the suffix array using SA-IS.
-size_t *sais_build(const char *text) {
-  size_t len = strlen(text);
+// Whether the LMS substrings of the same length starting at a and b are equal.
+int sais_same_substring(const void *text, size_t symbol_size, size_t len, size_t a, size_t b, size_t substring_len) {
+  for (size_t k = 0; k < substring_len; ++k) {
+    if (sais_symbol(text, symbol_size, len, a + k) != sais_symbol(text, symbol_size, len, b + k)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/// Builds the suffix array of a text over an integer alphabet using SA-IS.
+///
+/// \param text Symbols, symbol_size bytes each: 1 (unsigned char), 4 (uint32_t) or 8 (size_t).
+/// \param len Number of symbols in text, the text does not need a terminator.
+/// \param alphabet_size Every symbol is less than alphabet_size, the bucket arrays have that many entries.
+/// \return Suffix array of len + 1 entries, sa[0] = len is the empty suffix.
+size_t *sais_build_symbols(const void *text, size_t symbol_size, size_t len, size_t alphabet_size) {
   size_t *sa = calloc(len + 1, sizeof(size_t));
+  size_t num_buckets = alphabet_size + 1;
 
   // Step One: Annotate each character and find the LMS characters.
   char *types = calloc(len + 1, sizeof(char));
@@ -132,9 +120,11 @@ size_t *sais_build(const char *text) {
   types[len] = 'S';
 
   for (size_t i = len; i > 0; --i) {
-    if (text[i - 1] < text[i]) {
+    size_t current = sais_symbol(text, symbol_size, len, i - 1);
+    size_t next = sais_symbol(text, symbol_size, len, i);
+    if (current < next) {
       types[i - 1] = 's';
-    } else if (text[i - 1] > text[i]) {
+    } else if (current > next) {
       types[i - 1] = 'l';
     } else {
       types[i - 1] = types[i];
@@ -146,18 +136,18 @@ size_t *sais_build(const char *text) {
   }
 
   // Step Two: Implement Induced Sorting
-  size_t *initial_buckets = build_initial_buckets(text, len);
-  size_t *end_filled = calloc(256, sizeof(size_t));
+  size_t *initial_buckets = build_initial_buckets(text, symbol_size, len, num_buckets);
+  size_t *end_filled = calloc(num_buckets, sizeof(size_t));
   for (size_t i = len + 1; i > 0; --i) {
     if (types[i - 1] == 'S') {
-      size_t initial = text[i - 1];
+      size_t initial = sais_symbol(text, symbol_size, len, i - 1);
       size_t pos = initial_buckets[initial] - 1 - end_filled[initial];
       ++end_filled[initial];
 
       sa[pos] = i - 1;
     }
   }
-  induced_sort(text, len, sa, types, initial_buckets);
+  induced_sort(text, symbol_size, len, sa, types, initial_buckets, num_buckets);
 
   size_t block_pos = 0;
   size_t *lms_to_block_pos = calloc(len + 1, sizeof(size_t));
@@ -170,10 +160,12 @@ size_t *sais_build(const char *text) {
     }
   }
 
-  char *blocks = calloc(num_lms, sizeof(char));
-  blocks[num_lms - 1] = 0;
+  // Names of the LMS substrings but the sentinel, from 0 in sorted order, they are the symbols of the reduced text.
+  // There are fewer than len / 2 of them, 32 bits are enough up to 8G symbols.
+  size_t blocks_symbol_size = num_lms <= UINT32_MAX ? sizeof(uint32_t) : sizeof(size_t);
+  void *blocks = malloc(blocks_symbol_size * num_lms);
 
-  size_t block_char = 0;
+  size_t num_names = 0;
   size_t has_duplidate = 0;
   size_t prev_len = 0;
   size_t prev_pos = len;
@@ -181,44 +173,48 @@ size_t *sais_build(const char *text) {
     if (types[sa[i]] == 'S') {
       block_pos = lms_to_block_pos[sa[i]];
       assert(block_pos < num_lms);
-      size_t len = block_pos_to_lms[block_pos + 1] - sa[i] + 1;
-      if (len == prev_len && strncmp(text + prev_pos, text + sa[i], len) == 0) {
+      size_t substring_len = block_pos_to_lms[block_pos + 1] - sa[i] + 1;
+      if (substring_len == prev_len && sais_same_substring(text, symbol_size, len, prev_pos, sa[i], substring_len)) {
         // Duplicate
         has_duplidate = 1;
       } else {
-        ++block_char;
-        assert(block_char < 256);
+        ++num_names;
       }
 
-      blocks[block_pos] = block_char;
+      if (blocks_symbol_size == sizeof(uint32_t)) {
+        ((uint32_t *) blocks)[block_pos] = num_names - 1;
+      } else {
+        ((size_t *) blocks)[block_pos] = num_names - 1;
+      }
 
-      prev_len = len;
+      prev_len = substring_len;
       prev_pos = sa[i];
     }
   }
 
   size_t *blocks_sa;
   if (has_duplidate) {
-    blocks_sa = sais_build(blocks);
+    blocks_sa = sais_build_symbols(blocks, blocks_symbol_size, num_lms - 1, num_names);
   } else {
     blocks_sa = calloc(num_lms, sizeof(size_t));
-    for (size_t i = 0; i < num_lms; ++i) {
-      blocks_sa[blocks[i]] = i;
+    blocks_sa[0] = num_lms - 1;
+    for (size_t i = 0; i + 1 < num_lms; ++i) {
+      blocks_sa[sais_symbol(blocks, blocks_symbol_size, num_lms - 1, i)] = i;
     }
   }
 
   // fill lms in reversed order
-  bzero(end_filled, 256 * sizeof(size_t));
+  bzero(end_filled, num_buckets * sizeof(size_t));
   bzero(sa, (len + 1) * sizeof(size_t));
   for (size_t i = num_lms; i > 0; --i) {
     size_t lms = block_pos_to_lms[blocks_sa[i - 1]];
-    size_t initial = text[lms];
+    size_t initial = sais_symbol(text, symbol_size, len, lms);
     size_t pos = initial_buckets[initial] - 1 - end_filled[initial];
     ++end_filled[initial];
 
     sa[pos] = lms;
   }
-  induced_sort(text, len, sa, types, initial_buckets);
+  induced_sort(text, symbol_size, len, sa, types, initial_buckets, num_buckets);
 
   free(block_pos_to_lms);
   free(lms_to_block_pos);
@@ -232,8 +228,2894 @@ size_t *sais_build(const char *text) {
   return sa;
 }
 
+/// Builds the suffix array of a text of 32 bits symbols, all less than alphabet_size, see sais_build_symbols.
+size_t *sais_build_int(const uint32_t *text, size_t len, size_t alphabet_size) {
+  return sais_build_symbols(text, sizeof(uint32_t), len, alphabet_size);
+}
+
+/// Builds the suffix array using SA-IS.
+size_t *sais_build(const char *text) {
+  return sais_build_symbols(text, 1, strlen(text), 256);
+}
+
+// Types of the low-memory build, one bit per position, set for S.
+int sais_is_s(const uint8_t *types, size_t i) {
+  return (types[i / 8] >> (i % 8)) & 1;
+}
+
+int sais_is_lms(const uint8_t *types, size_t i) {
+  return i > 0 && sais_is_s(types, i) && !sais_is_s(types, i - 1);
+}
+
+// Levels shorter than this run serially, longer ones are classified in blocks of this many positions.
+#define SAIS_PARALLEL_BLOCK ((size_t) 1 << 20)
+
+// A level of the build shared by its parallel steps.
+struct sais_level {
+    const void *text;
+    size_t symbol_size;
+    size_t len;
+    uint8_t *types;
+    size_t num_threads;
+    // per thread bucket counts
+    sais_index_t *counts;
+    size_t num_buckets;
+    // runs of equal symbols at the end of each block of types, which wait for the type after the block
+    size_t *runs;
+    sais_index_t *sa;
+    // induced sort of the suffixes of type s: the next free entry of each bucket, the symbol of the suffix each entry
+    // of a block induces or its target, or SAIS_EMPTY, and where the threads cut the block
+    int s;
+    sais_index_t *buckets;
+    sais_index_t *induced;
+    size_t cut;
+    // sorted LMS substrings, and whether each differs from the one before it
+    size_t num_lms;
+    uint8_t *differ;
+    // positions of the LMS suffixes in text order
+    sais_index_t *blocks;
+};
+
+void sais_count_buckets(void *context, size_t begin, size_t end) {
+  struct sais_level *level = context;
+  for (size_t t = begin; t < end; ++t) {
+    sais_index_t *counts = level->counts + t * level->num_buckets;
+    size_t n = level->len + 1;
+    for (size_t i = n * t / level->num_threads; i < n * (t + 1) / level->num_threads; ++i) {
+      ++counts[sais_symbol(level->text, level->symbol_size, level->len, i)];
+    }
+  }
+}
+
+// Bucket starts, or ends when end is set, of the shifted symbols including the sentinel.
+void sais_buckets(const void *text, size_t symbol_size, size_t len, sais_index_t *buckets, size_t num_buckets,
+                  int end, size_t num_threads) {
+  bzero(buckets, num_buckets * sizeof(sais_index_t));
+  if (num_threads > 1 && len >= SAIS_PARALLEL_BLOCK && num_buckets * num_threads <= len / 4) {
+    struct sais_level level = {.text = text, .symbol_size = symbol_size, .len = len, .num_threads = num_threads,
+                               .num_buckets = num_buckets};
+    level.counts = calloc(num_buckets * num_threads, sizeof(sais_index_t));
+    parallel_for(num_threads, num_threads, sais_count_buckets, &level);
+    for (size_t t = 0; t < num_threads; ++t) {
+      for (size_t c = 0; c < num_buckets; ++c) {
+        buckets[c] += level.counts[t * num_buckets + c];
+      }
+    }
+    free(level.counts);
+  } else {
+    for (size_t i = 0; i < len + 1; ++i) {
+      ++buckets[sais_symbol(text, symbol_size, len, i)];
+    }
+  }
+  sais_index_t sum = 0;
+  for (size_t i = 0; i < num_buckets; ++i) {
+    sum += buckets[i];
+    buckets[i] = end ? sum : sum - buckets[i];
+  }
+}
+
+// Entries of a block of the parallel induced sort for each thread, enough that waiting for each other at the end of
+// the steps of a block does not outweigh them.
+#define SAIS_INDUCE_THREAD_BLOCK ((size_t) 1 << 16)
+
+// Entries the read of a block runs ahead of the one it reads. Unlike the serial scan, the read does not wait on the
+// entries it writes, so it can prefetch their symbols and types.
+#define SAIS_INDUCE_PREFETCH_DISTANCE 16
+
+// Threads inducing a level of n entries, each reading SAIS_INDUCE_THREAD_BLOCK entries of a block with at least four
+// blocks to the level. 1 or less when the level is induced serially.
+size_t sais_induce_threads(size_t n, size_t num_threads) {
+  size_t max_threads = n / (4 * SAIS_INDUCE_THREAD_BLOCK);
+  return n < SAIS_PARALLEL_BLOCK ? 1 : num_threads < max_threads ? num_threads : max_threads;
+}
+
+// Part of [begin, end) for thread t of num_threads.
+void sais_thread_range(size_t begin, size_t end, size_t t, size_t num_threads, size_t *first, size_t *last) {
+  *first = begin + (end - begin) * t / num_threads;
+  *last = begin + (end - begin) * (t + 1) / num_threads;
+}
+
+// Symbol of the suffix induced from entry j of sa, or SAIS_EMPTY when it does not induce one of type s.
+size_t sais_induced_symbol(const struct sais_level *level, size_t j) {
+  if (j == SAIS_EMPTY || j == 0 || sais_is_s(level->types, j - 1) != level->s) {
+    return SAIS_EMPTY;
+  }
+  return sais_symbol(level->text, level->symbol_size, level->len, j - 1);
+}
+
+// Reads the symbols of the suffixes induced from [first, last), counted into the buckets of thread t if it has any.
+void sais_induce_read(struct sais_level *level, sais_index_t *induced, size_t first, size_t last, size_t t) {
+  sais_index_t *counts = level->counts == 0 ? 0 : level->counts + t * level->num_buckets;
+  if (counts != 0) {
+    bzero(counts, level->num_buckets * sizeof(sais_index_t));
+  }
+  for (size_t i = first; i < last; ++i) {
+    size_t ahead = i + SAIS_INDUCE_PREFETCH_DISTANCE < last ? level->sa[i + SAIS_INDUCE_PREFETCH_DISTANCE] : 0;
+    if (ahead != SAIS_EMPTY && ahead > 0) {
+      __builtin_prefetch(level->types + (ahead - 1) / 8);
+      __builtin_prefetch((const char *) level->text + (ahead - 1) * level->symbol_size);
+    }
+    induced[i] = sais_induced_symbol(level, level->sa[i]);
+    if (counts != 0 && induced[i] != SAIS_EMPTY) {
+      ++counts[induced[i]];
+    }
+  }
+}
+
+// Counts the symbols read in [first, last) again, into the buckets of thread t.
+void sais_induce_recount(struct sais_level *level, const sais_index_t *induced, size_t first, size_t last, size_t t) {
+  sais_index_t *counts = level->counts + t * level->num_buckets;
+  bzero(counts, level->num_buckets * sizeof(sais_index_t));
+  for (size_t i = first; i < last; ++i) {
+    if (induced[i] != SAIS_EMPTY) {
+      ++counts[induced[i]];
+    }
+  }
+}
+
+// Turns the counts of the threads into their offsets in each bucket, in the order of the scan.
+void sais_induce_offsets(struct sais_level *level, size_t num_threads) {
+  for (size_t c = 0; c < level->num_buckets; ++c) {
+    for (size_t k = 0; k < num_threads; ++k) {
+      size_t t = level->s ? num_threads - 1 - k : k;
+      sais_index_t count = level->counts[t * level->num_buckets + c];
+      level->counts[t * level->num_buckets + c] = level->buckets[c];
+      level->buckets[c] = level->s ? level->buckets[c] - count : level->buckets[c] + count;
+    }
+  }
+}
+
+// Cut of the block [begin, end) before the next free entry of the first bucket it induces into, and the offsets of
+// the threads when it is not cut short. Without per thread buckets the cut leaves the whole block to the serial
+// pass.
+void sais_induce_cut(struct sais_level *level, size_t begin, size_t end, size_t num_threads) {
+  if (level->counts == 0) {
+    level->cut = level->s ? end : begin;
+    return;
+  }
+  level->cut = level->s ? begin : end;
+  for (size_t c = 0; c < level->num_buckets; ++c) {
+    sais_index_t total = 0;
+    for (size_t t = 0; t < num_threads; ++t) {
+      total += level->counts[t * level->num_buckets + c];
+    }
+    if (total > 0 && !level->s && level->buckets[c] < level->cut) {
+      level->cut = level->buckets[c];
+    } else if (total > 0 && level->s && level->buckets[c] > level->cut) {
+      level->cut = level->buckets[c] < end ? level->buckets[c] : end;
+    }
+  }
+  if (level->cut == (level->s ? begin : end)) {
+    sais_induce_offsets(level, num_threads);
+  }
+}
+
+// Writes the suffixes induced from [first, last) from the offsets of thread t in the order of the scan. Suffixes
+// landing in [block_first, block_last), the part of the block left to the serial pass, get their symbols read.
+void sais_induce_write(struct sais_level *level, sais_index_t *induced, size_t first, size_t last, size_t t,
+                       size_t block_first, size_t block_last) {
+  sais_index_t *offsets = level->counts + t * level->num_buckets;
+  for (size_t k = first; k < last; ++k) {
+    size_t i = level->s ? first + last - 1 - k : k;
+    if (induced[i] != SAIS_EMPTY) {
+      size_t target = level->s ? --offsets[induced[i]] : offsets[induced[i]]++;
+      level->sa[target] = level->sa[i] - 1;
+      if (target >= block_first && target < block_last) {
+        induced[target] = sais_induced_symbol(level, level->sa[target]);
+      }
+    }
+  }
+}
+
+// Takes the targets of the suffixes induced from [first, last) from the buckets in the order of the scan. Suffixes
+// landing in [first, last) are written now with their symbols read on the spot, the others are left to the threads.
+void sais_induce_serial(struct sais_level *level, sais_index_t *induced, size_t first, size_t last) {
+  for (size_t k = first; k < last; ++k) {
+    size_t i = level->s ? first + last - 1 - k : k;
+    if (induced[i] != SAIS_EMPTY) {
+      size_t target = level->s ? --level->buckets[induced[i]] : level->buckets[induced[i]]++;
+      induced[i] = target;
+      if (target >= first && target < last) {
+        level->sa[target] = level->sa[i] - 1;
+        induced[target] = sais_induced_symbol(level, level->sa[target]);
+        induced[i] = SAIS_EMPTY;
+      }
+    }
+  }
+}
+
+// Writes the suffixes induced from [first, last) to the targets the serial pass left in their place.
+void sais_induce_targets(struct sais_level *level, const sais_index_t *induced, size_t first, size_t last) {
+  for (size_t i = first; i < last; ++i) {
+    if (induced[i] != SAIS_EMPTY) {
+      level->sa[induced[i]] = level->sa[i] - 1;
+    }
+  }
+}
+
+// Induces the suffixes of type s on a team of threads in blocks of sa, in the manner of pSAIS. A suffix induced from
+// an entry lands further on in the scan, at the next free entry of its bucket.
+//
+// The threads first read the symbols of the suffixes the block induces, the random accesses of the scan. With per
+// thread buckets, the block is cut before the next free entry of the first bucket it induces into, so that the
+// entries before the cut were final when they were read, and the threads write them to consecutive ranges of each
+// bucket. Entries not written yet are empty, or LMS suffixes the S scan overwrites, which only cut the block shorter.
+// The rest of the block takes its targets from the buckets in a serial pass, which writes the suffixes that land in
+// the block itself and reads their symbols on the spot, and the threads write the others.
+void sais_induce_scan(void *context, struct parallel_team *team, size_t thread) {
+  struct sais_level *level = context;
+  size_t n = level->len + 1;
+  size_t num_threads = team->num_threads;
+  size_t block = num_threads * SAIS_INDUCE_THREAD_BLOCK;
+  for (size_t done = 0; done < n; done += block) {
+    size_t begin = !level->s ? done : n - done > block ? n - done - block : 0;
+    size_t end = level->s ? n - done : n - done > block ? done + block : n;
+    sais_index_t *induced = level->induced - begin;
+    size_t first, last;
+    sais_thread_range(begin, end, thread, num_threads, &first, &last);
+    sais_induce_read(level, induced, first, last, thread);
+    parallel_team_wait(team);
+    if (thread == 0) {
+      sais_induce_cut(level, begin, end, num_threads);
+    }
+    parallel_team_wait(team);
+
+    // Entries before the cut, or from it on for S, go to the per thread buckets, the others to the serial pass
+    size_t cut = level->cut;
+    size_t parallel_begin = level->s ? cut : begin;
+    size_t parallel_end = level->s ? end : cut;
+    size_t serial_begin = level->s ? begin : cut;
+    size_t serial_end = level->s ? cut : end;
+    if (parallel_begin < parallel_end) {
+      sais_thread_range(parallel_begin, parallel_end, thread, num_threads, &first, &last);
+      if (cut != (level->s ? begin : end)) {
+        sais_induce_recount(level, induced, first, last, thread);
+        parallel_team_wait(team);
+        if (thread == 0) {
+          sais_induce_offsets(level, num_threads);
+        }
+        parallel_team_wait(team);
+      }
+      sais_induce_write(level, induced, first, last, thread, serial_begin, serial_end);
+      parallel_team_wait(team);
+    }
+    if (serial_begin < serial_end) {
+      if (thread == 0) {
+        sais_induce_serial(level, induced, serial_begin, serial_end);
+      }
+      parallel_team_wait(team);
+      sais_thread_range(serial_begin, serial_end, thread, num_threads, &first, &last);
+      sais_induce_targets(level, induced, first, last);
+      parallel_team_wait(team);
+    }
+  }
+}
+
+// Induces L from the left, then S from the right, starting from the LMS suffixes placed at their bucket ends. Each
+// entry depends on the ones before it, large levels are scanned in blocks, see sais_induce_scan.
+void sais_induce(const void *text, size_t symbol_size, size_t len, sais_index_t *sa, const uint8_t *types,
+                 sais_index_t *buckets, size_t num_buckets, size_t num_threads) {
+  size_t n = len + 1;
+  size_t induce_threads = sais_induce_threads(n, num_threads);
+  if (induce_threads > 1) {
+    struct sais_level level = {.text = text, .symbol_size = symbol_size, .len = len, .types = (uint8_t *) types,
+                               .num_buckets = num_buckets, .sa = sa, .buckets = buckets};
+    // Per thread buckets pay off for small alphabets, whose offsets take little time next to a block
+    if (64 * num_buckets <= SAIS_INDUCE_THREAD_BLOCK) {
+      level.counts = malloc(num_buckets * induce_threads * sizeof(sais_index_t));
+    }
+    level.induced = malloc(induce_threads * SAIS_INDUCE_THREAD_BLOCK * sizeof(sais_index_t));
+    sais_buckets(text, symbol_size, len, buckets, num_buckets, 0, num_threads);
+    parallel_team_run(induce_threads, sais_induce_scan, &level);
+    sais_buckets(text, symbol_size, len, buckets, num_buckets, 1, num_threads);
+    level.s = 1;
+    parallel_team_run(induce_threads, sais_induce_scan, &level);
+    free(level.induced);
+    free(level.counts);
+    return;
+  }
+
+  sais_buckets(text, symbol_size, len, buckets, num_buckets, 0, num_threads);
+  for (size_t i = 0; i < len + 1; ++i) {
+    size_t j = sa[i];
+    if (j != SAIS_EMPTY && j > 0 && !sais_is_s(types, j - 1)) {
+      sa[buckets[sais_symbol(text, symbol_size, len, j - 1)]++] = j - 1;
+    }
+  }
+
+  sais_buckets(text, symbol_size, len, buckets, num_buckets, 1, num_threads);
+  for (size_t i = len + 1; i > 0; --i) {
+    size_t j = sa[i - 1];
+    if (j != SAIS_EMPTY && j > 0 && sais_is_s(types, j - 1)) {
+      sa[--buckets[sais_symbol(text, symbol_size, len, j - 1)]] = j - 1;
+    }
+  }
+}
+
+// Types of the positions in blocks [begin, end) of SAIS_PARALLEL_BLOCK positions, a multiple of 8 so no two blocks
+// share a byte. The run of equal symbols at the end of a block takes the type after the block, it is left to
+// sais_classify.
+void sais_classify_blocks(void *context, size_t begin, size_t end) {
+  struct sais_level *level = context;
+  for (size_t b = begin; b < end; ++b) {
+    size_t first = b * SAIS_PARALLEL_BLOCK;
+    size_t last = first + SAIS_PARALLEL_BLOCK < level->len ? first + SAIS_PARALLEL_BLOCK : level->len;
+    size_t run = last;
+    for (size_t i = last; i > first; --i) {
+      size_t current = sais_symbol(level->text, level->symbol_size, level->len, i - 1);
+      size_t next = sais_symbol(level->text, level->symbol_size, level->len, i);
+      if (current == next && run == i) {
+        run = i - 1;
+      } else if (current < next || (current == next && sais_is_s(level->types, i))) {
+        level->types[(i - 1) / 8] |= 1 << ((i - 1) % 8);
+      }
+    }
+    level->runs[b] = run;
+  }
+}
+
+// Types of the positions of text, one bit per position, set for S.
+uint8_t *sais_classify(const void *text, size_t symbol_size, size_t len, size_t num_threads) {
+  uint8_t *types = calloc((len + 1) / 8 + 1, 1);
+  types[len / 8] |= 1 << (len % 8);
+  if (num_threads > 1 && len > SAIS_PARALLEL_BLOCK) {
+    size_t num_blocks = (len + SAIS_PARALLEL_BLOCK - 1) / SAIS_PARALLEL_BLOCK;
+    struct sais_level level = {.text = text, .symbol_size = symbol_size, .len = len, .types = types};
+    level.runs = malloc(num_blocks * sizeof(size_t));
+    parallel_for(num_threads, num_blocks, sais_classify_blocks, &level);
+    for (size_t b = num_blocks; b > 0; --b) {
+      size_t last = b * SAIS_PARALLEL_BLOCK < len ? b * SAIS_PARALLEL_BLOCK : len;
+      if (sais_is_s(types, last)) {
+        for (size_t i = level.runs[b - 1]; i < last; ++i) {
+          types[i / 8] |= 1 << (i % 8);
+        }
+      }
+    }
+    free(level.runs);
+    return types;
+  }
+
+  for (size_t i = len; i > 0; --i) {
+    size_t current = sais_symbol(text, symbol_size, len, i - 1);
+    size_t next = sais_symbol(text, symbol_size, len, i);
+    if (current < next || (current == next && sais_is_s(types, i))) {
+      types[(i - 1) / 8] |= 1 << ((i - 1) % 8);
+    }
+  }
+  return types;
+}
+
+// Whether the LMS substrings at pos and prev differ in a symbol or a type.
+int sais_lms_differ(const void *text, size_t symbol_size, size_t len, const uint8_t *types, size_t pos, size_t prev) {
+  for (size_t d = 0; ; ++d) {
+    if (sais_symbol(text, symbol_size, len, pos + d) != sais_symbol(text, symbol_size, len, prev + d) ||
+        sais_is_s(types, pos + d) != sais_is_s(types, prev + d)) {
+      return 1;
+    } else if (d > 0 && (sais_is_lms(types, pos + d) || sais_is_lms(types, prev + d))) {
+      return 0;
+    }
+  }
+}
+
+// Marks the sorted LMS substrings that differ from the one before them, counted per thread.
+void sais_compare_lms(void *context, size_t begin, size_t end) {
+  struct sais_level *level = context;
+  for (size_t t = begin; t < end; ++t) {
+    level->counts[t] = 0;
+    for (size_t i = level->num_lms * t / level->num_threads; i < level->num_lms * (t + 1) / level->num_threads; ++i) {
+      level->differ[i] = i == 0 || sais_lms_differ(level->text, level->symbol_size, level->len, level->types,
+                                                   level->sa[i], level->sa[i - 1]);
+      level->counts[t] += level->differ[i];
+    }
+  }
+}
+
+// Turns the marks into names, each thread counting on from the names of the threads before it.
+void sais_count_names(void *context, size_t begin, size_t end) {
+  struct sais_level *level = context;
+  for (size_t t = begin; t < end; ++t) {
+    size_t num_names = level->counts[t];
+    for (size_t i = level->num_lms * t / level->num_threads; i < level->num_lms * (t + 1) / level->num_threads; ++i) {
+      num_names += level->differ[i];
+      level->sa[level->num_lms + level->sa[i] / 2] = num_names - 1;
+    }
+  }
+}
+
+// Names the sorted LMS substrings at the front of sa, equal substrings get equal names in their order. The name of
+// position pos goes to num_lms + pos / 2. Comparing neighbours is independent, so large levels compare on the
+// threads, marking the substrings that start a name in a byte each, and add the names up after. Returns the number
+// of names.
+size_t sais_name_lms(const void *text, size_t symbol_size, size_t len, sais_index_t *sa, const uint8_t *types,
+                     size_t num_lms, size_t num_threads) {
+  if (num_threads > 1 && num_lms >= SAIS_PARALLEL_BLOCK) {
+    struct sais_level level = {.text = text, .symbol_size = symbol_size, .len = len, .types = (uint8_t *) types,
+                               .num_threads = num_threads, .sa = sa, .num_lms = num_lms};
+    level.counts = malloc(num_threads * sizeof(sais_index_t));
+    level.differ = malloc(num_lms);
+    parallel_for(num_threads, num_threads, sais_compare_lms, &level);
+    size_t num_names = 0;
+    for (size_t t = 0; t < num_threads; ++t) {
+      sais_index_t count = level.counts[t];
+      level.counts[t] = num_names;
+      num_names += count;
+    }
+    parallel_for(num_threads, num_threads, sais_count_names, &level);
+    free(level.differ);
+    free(level.counts);
+    return num_names;
+  }
+
+  size_t num_names = 0;
+  for (size_t i = 0; i < num_lms; ++i) {
+    size_t pos = sa[i];
+    num_names += i == 0 || sais_lms_differ(text, symbol_size, len, types, pos, sa[i - 1]);
+    sa[num_lms + pos / 2] = num_names - 1;
+  }
+  return num_names;
+}
+
+// Whether a level of n entries is long enough for its linear passes to go on the threads.
+size_t sais_level_threads(size_t n, size_t num_threads) {
+  return n > SAIS_PARALLEL_BLOCK ? num_threads : 1;
+}
+
+void sais_clear_range(void *context, size_t begin, size_t end) {
+  struct sais_level *level = context;
+  for (size_t i = begin; i < end; ++i) {
+    level->sa[i] = SAIS_EMPTY;
+  }
+}
+
+// Empties sa[begin, end).
+void sais_clear(sais_index_t *sa, size_t begin, size_t end, size_t num_threads) {
+  struct sais_level level = {.sa = sa + begin};
+  parallel_for(sais_level_threads(end - begin, num_threads), end - begin, sais_clear_range, &level);
+}
+
+// LMS suffixes in each thread's part of the text, per symbol.
+void sais_count_lms(void *context, size_t begin, size_t end) {
+  struct sais_level *level = context;
+  for (size_t t = begin; t < end; ++t) {
+    sais_index_t *counts = level->counts + t * level->num_buckets;
+    bzero(counts, level->num_buckets * sizeof(sais_index_t));
+    size_t n = level->len + 1;
+    for (size_t i = n * t / level->num_threads; i < n * (t + 1) / level->num_threads; ++i) {
+      if (sais_is_lms(level->types, i)) {
+        ++counts[sais_symbol(level->text, level->symbol_size, level->len, i)];
+      }
+    }
+  }
+}
+
+// Places the LMS suffixes in each thread's part of the text below its offsets.
+void sais_place_lms_range(void *context, size_t begin, size_t end) {
+  struct sais_level *level = context;
+  for (size_t t = begin; t < end; ++t) {
+    sais_index_t *offsets = level->counts + t * level->num_buckets;
+    size_t n = level->len + 1;
+    for (size_t i = n * t / level->num_threads; i < n * (t + 1) / level->num_threads; ++i) {
+      if (sais_is_lms(level->types, i)) {
+        level->sa[--offsets[sais_symbol(level->text, level->symbol_size, level->len, i)]] = i;
+      }
+    }
+  }
+}
+
+// Empties sa and places the LMS suffixes at the ends of their buckets in text order, the first one last. The threads
+// take consecutive parts of the text and of each bucket when the level has room for per thread buckets.
+void sais_place_lms(const void *text, size_t symbol_size, size_t len, sais_index_t *sa, const uint8_t *types,
+                    sais_index_t *buckets, size_t num_buckets, size_t num_threads) {
+  size_t n = len + 1;
+  sais_buckets(text, symbol_size, len, buckets, num_buckets, 1, num_threads);
+  sais_clear(sa, 0, n, num_threads);
+  if (sais_level_threads(n, num_threads) > 1 && num_buckets * num_threads <= len / 4) {
+    struct sais_level level = {.text = text, .symbol_size = symbol_size, .len = len, .types = (uint8_t *) types,
+                               .num_threads = num_threads, .num_buckets = num_buckets, .sa = sa};
+    level.counts = malloc(num_buckets * num_threads * sizeof(sais_index_t));
+    parallel_for(num_threads, num_threads, sais_count_lms, &level);
+    for (size_t c = 0; c < num_buckets; ++c) {
+      for (size_t t = 0; t < num_threads; ++t) {
+        sais_index_t count = level.counts[t * num_buckets + c];
+        level.counts[t * num_buckets + c] = buckets[c];
+        buckets[c] -= count;
+      }
+    }
+    parallel_for(num_threads, num_threads, sais_place_lms_range, &level);
+    free(level.counts);
+    return;
+  }
+
+  for (size_t i = 1; i < n; ++i) {
+    if (sais_is_lms(types, i)) {
+      sa[--buckets[sais_symbol(text, symbol_size, len, i)]] = i;
+    }
+  }
+}
+
+// Moves the LMS suffixes in each thread's part of sa to the front of the part, counting them.
+void sais_gather_range(void *context, size_t begin, size_t end) {
+  struct sais_level *level = context;
+  for (size_t t = begin; t < end; ++t) {
+    size_t n = level->len + 1;
+    size_t first = n * t / level->num_threads;
+    size_t j = first;
+    for (size_t i = first; i < n * (t + 1) / level->num_threads; ++i) {
+      if (sais_is_lms(level->types, level->sa[i])) {
+        level->sa[j++] = level->sa[i];
+      }
+    }
+    level->counts[t] = j - first;
+  }
+}
+
+// Moves the LMS suffixes of a full sa to its front in their order, empties the rest and returns how many there are.
+size_t sais_gather_lms(size_t len, sais_index_t *sa, const uint8_t *types, size_t num_threads) {
+  size_t n = len + 1;
+  size_t num_lms = 0;
+  if (sais_level_threads(n, num_threads) > 1) {
+    struct sais_level level = {.len = len, .types = (uint8_t *) types, .num_threads = num_threads, .sa = sa};
+    level.counts = malloc(num_threads * sizeof(sais_index_t));
+    parallel_for(num_threads, num_threads, sais_gather_range, &level);
+    for (size_t t = 0; t < num_threads; ++t) {
+      memmove(sa + num_lms, sa + n * t / num_threads, level.counts[t] * sizeof(sais_index_t));
+      num_lms += level.counts[t];
+    }
+    free(level.counts);
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      if (sais_is_lms(types, sa[i])) {
+        sa[num_lms++] = sa[i];
+      }
+    }
+  }
+  sais_clear(sa, num_lms, n, num_threads);
+  return num_lms;
+}
+
+// LMS suffixes in each thread's part of the text.
+void sais_count_blocks(void *context, size_t begin, size_t end) {
+  struct sais_level *level = context;
+  for (size_t t = begin; t < end; ++t) {
+    size_t n = level->len + 1;
+    level->counts[t] = 0;
+    for (size_t i = n * t / level->num_threads; i < n * (t + 1) / level->num_threads; ++i) {
+      level->counts[t] += sais_is_lms(level->types, i);
+    }
+  }
+}
+
+// Lists the LMS suffixes in each thread's part of the text from its offset in blocks.
+void sais_list_blocks(void *context, size_t begin, size_t end) {
+  struct sais_level *level = context;
+  for (size_t t = begin; t < end; ++t) {
+    size_t n = level->len + 1;
+    size_t j = level->counts[t];
+    for (size_t i = n * t / level->num_threads; i < n * (t + 1) / level->num_threads; ++i) {
+      if (sais_is_lms(level->types, i)) {
+        level->blocks[j++] = i;
+      }
+    }
+  }
+}
+
+// Maps the suffix array of the reduced text at the front of sa to the LMS suffixes it sorts.
+void sais_map_blocks(void *context, size_t begin, size_t end) {
+  struct sais_level *level = context;
+  for (size_t i = begin; i < end; ++i) {
+    level->sa[i] = level->blocks[level->sa[i]];
+  }
+}
+
+// First of the sorted LMS suffixes in each bucket, found where the symbol changes.
+void sais_find_runs(void *context, size_t begin, size_t end) {
+  struct sais_level *level = context;
+  size_t prev = begin == 0 ? SAIS_EMPTY : sais_symbol(level->text, level->symbol_size, level->len,
+                                                      level->sa[begin - 1]);
+  for (size_t i = begin; i < end; ++i) {
+    size_t c = sais_symbol(level->text, level->symbol_size, level->len, level->sa[i]);
+    if (c != prev) {
+      level->counts[c] = i;
+    }
+    prev = c;
+  }
+}
+
+// Turns the suffix array of the reduced text at the front of sa into the sorted LMS suffixes, and places them at the
+// ends of their buckets with the rest of sa empty. blocks is the end of sa, where the reduced text was.
+void sais_place_sorted_lms(const void *text, size_t symbol_size, size_t len, sais_index_t *sa, const uint8_t *types,
+                           sais_index_t *blocks, size_t num_lms, sais_index_t *buckets, size_t num_buckets,
+                           size_t num_threads) {
+  size_t n = len + 1;
+  struct sais_level level = {.text = text, .symbol_size = symbol_size, .len = len, .types = (uint8_t *) types,
+                             .num_threads = num_threads, .sa = sa, .blocks = blocks};
+  sais_buckets(text, symbol_size, len, buckets, num_buckets, 1, num_threads);
+  if (sais_level_threads(n, num_threads) == 1) {
+    for (size_t i = 1, j = 0; i < n; ++i) {
+      if (sais_is_lms(types, i)) {
+        blocks[j++] = i;
+      }
+    }
+    for (size_t i = 0; i < num_lms; ++i) {
+      sa[i] = blocks[sa[i]];
+    }
+    for (size_t i = num_lms; i < n; ++i) {
+      sa[i] = SAIS_EMPTY;
+    }
+    for (size_t i = num_lms; i > 0; --i) {
+      size_t j = sa[i - 1];
+      sa[i - 1] = SAIS_EMPTY;
+      sa[--buckets[sais_symbol(text, symbol_size, len, j)]] = j;
+    }
+    return;
+  }
+
+  level.counts = malloc(num_threads * sizeof(sais_index_t));
+  parallel_for(num_threads, num_threads, sais_count_blocks, &level);
+  for (size_t t = 0, j = 0; t < num_threads; ++t) {
+    sais_index_t count = level.counts[t];
+    level.counts[t] = j;
+    j += count;
+  }
+  parallel_for(num_threads, num_threads, sais_list_blocks, &level);
+  free(level.counts);
+  parallel_for(num_threads, num_lms, sais_map_blocks, &level);
+
+  // The sorted LMS suffixes of a bucket are a run, which moves up to the end of the bucket. Runs move from the last
+  // bucket down, each to the right of where it was.
+  level.counts = malloc((num_buckets + 1) * sizeof(sais_index_t));
+  for (size_t c = 0; c < num_buckets; ++c) {
+    level.counts[c] = SAIS_EMPTY;
+  }
+  parallel_for(num_threads, num_lms, sais_find_runs, &level);
+  level.counts[num_buckets] = num_lms;
+  for (size_t c = num_buckets; c > 0; --c) {
+    if (level.counts[c - 1] == SAIS_EMPTY) {
+      level.counts[c - 1] = level.counts[c];
+    }
+    size_t count = level.counts[c] - level.counts[c - 1];
+    size_t start = c > 1 ? buckets[c - 2] : 0;
+    memmove(sa + buckets[c - 1] - count, sa + level.counts[c - 1], count * sizeof(sais_index_t));
+    sais_clear(sa, start, buckets[c - 1] - count, num_threads);
+  }
+  free(level.counts);
+}
+
+// Buckets go to the workspace when they fit, and are allocated otherwise.
+sais_index_t *sais_workspace_buckets(sais_index_t *workspace, size_t workspace_size, size_t num_buckets) {
+  return num_buckets <= workspace_size ? workspace : malloc(num_buckets * sizeof(sais_index_t));
+}
+
+// One level of the low-memory build. sa has len + 1 entries, and workspace is memory not used by this level.
+// Returns the number of levels from this one down, the depth of the recursion.
+size_t sais_build_level(const void *text, size_t symbol_size, size_t len, size_t alphabet_size, sais_index_t *sa,
+                        sais_index_t *workspace, size_t workspace_size, size_t num_threads) {
+  size_t n = len + 1;
+  size_t num_buckets = alphabet_size + 1;
+  uint8_t *types = sais_classify(text, symbol_size, len, num_threads);
+
+  // Sort the LMS substrings
+  sais_index_t *buckets = sais_workspace_buckets(workspace, workspace_size, num_buckets);
+  sais_place_lms(text, symbol_size, len, sa, types, buckets, num_buckets, num_threads);
+  sais_induce(text, symbol_size, len, sa, types, buckets, num_buckets, num_threads);
+  if (buckets != workspace) {
+    free(buckets);
+  }
+
+  // Move the sorted LMS substrings to the front, and name them. LMS positions are at least two apart, so the name
+  // of position pos fits at num_lms + pos / 2.
+  size_t num_lms = sais_gather_lms(len, sa, types, num_threads);
+  size_t num_names = sais_name_lms(text, symbol_size, len, sa, types, num_lms, num_threads);
+  for (size_t i = n, j = n; i > num_lms; --i) {
+    if (sa[i - 1] != SAIS_EMPTY) {
+      sa[--j] = sa[i - 1];
+    }
+  }
+
+  // The reduced text is at the end of sa, its suffix array goes to the front, the sentinel is named 0
+  sais_index_t *blocks = sa + n - num_lms;
+  size_t num_levels = 1;
+  if (num_names < num_lms) {
+    for (size_t i = 0; i + 1 < num_lms; ++i) {
+      --blocks[i];
+    }
+    num_levels += sais_build_level(blocks, sizeof(sais_index_t), num_lms - 1, num_names - 1, sa, sa + num_lms,
+                                   n - 2 * num_lms, num_threads);
+  } else {
+    for (size_t i = 0; i < num_lms; ++i) {
+      sa[blocks[i]] = i;
+    }
+  }
+
+  // Place the sorted LMS suffixes at their bucket ends, and induce the rest
+  buckets = sais_workspace_buckets(workspace, workspace_size, num_buckets);
+  sais_place_sorted_lms(text, symbol_size, len, sa, types, blocks, num_lms, buckets, num_buckets, num_threads);
+  sais_induce(text, symbol_size, len, sa, types, buckets, num_buckets, num_threads);
+
+  if (buckets != workspace) {
+    free(buckets);
+  }
+  free(types);
+  return num_levels;
+}
+
+/// Builds the same suffix array as sais_build_symbols, using the suffix array itself as the workspace: the reduced
+/// text and the names of the LMS substrings live in its unused half, and the recursion works inside it.
+///
+/// Peak memory is (len + 1) * sizeof(sais_index_t) for the result, plus the types at one bit per position summed
+/// over the levels (at most len / 4 bytes), plus the top-level buckets of alphabet_size + 1 entries. Deeper levels
+/// keep their buckets in the unused middle of the suffix array when they fit.
+///
+/// \return Suffix array of len + 1 entries, or NULL when len does not fit in sais_index_t.
+sais_index_t *sais_build_low_memory(const void *text, size_t symbol_size, size_t len, size_t alphabet_size) {
+  if (len >= SAIS_EMPTY) {
+    return NULL;
+  }
+  sais_index_t *sa = malloc((len + 1) * sizeof(sais_index_t));
+  if (len == 0) {
+    sa[0] = 0;
+    return sa;
+  }
+  sais_build_level(text, symbol_size, len, alphabet_size, sa, NULL, 0, 1);
+  return sa;
+}
+
+/// Builds the same suffix array as sais_build_low_memory on num_threads threads. Classifying the types, counting the
+/// buckets, placing and gathering the LMS suffixes, the induced sorts and the naming of the LMS substrings are split
+/// between the threads. The induced sorts scan in blocks of 2^16 entries per thread, see sais_induce_scan, and take
+/// their targets serially for large alphabets or where a bucket fills up just ahead of the scan. Levels shorter than
+/// a million positions are built serially.
+///
+/// On top of sais_build_low_memory, the induced sorts take a block of entries and, for alphabets of up to 1024
+/// symbols, alphabet_size + 1 entries per thread.
+sais_index_t *sais_build_parallel(const void *text, size_t symbol_size, size_t len, size_t alphabet_size,
+                                  size_t num_threads) {
+  if (len >= SAIS_EMPTY) {
+    return NULL;
+  }
+  sais_index_t *sa = malloc((len + 1) * sizeof(sais_index_t));
+  if (len == 0) {
+    sa[0] = 0;
+    return sa;
+  }
+  sais_build_level(text, symbol_size, len, alphabet_size, sa, NULL, 0, num_threads);
+  return sa;
+}
+
+// Character of a byte text at i shifted up by one, 0 past the end.
+size_t sais_byte_at(const unsigned char *text, size_t len, size_t i) {
+  return i < len ? (size_t) text[i] + 1 : 0;
+}
+
+// Sorts suffixes sharing their first depth characters with the multikey quicksort of Bentley and Sedgewick.
+void sais_multikey_sort(const unsigned char *text, size_t len, size_t *positions, size_t count, size_t depth) {
+  while (count > 1) {
+    size_t pivot = sais_byte_at(text, len, positions[count / 2] + depth);
+    size_t lt = 0;
+    size_t gt = count;
+    for (size_t i = 0; i < gt;) {
+      size_t c = sais_byte_at(text, len, positions[i] + depth);
+      if (c < pivot) {
+        size_t t = positions[i];
+        positions[i++] = positions[lt];
+        positions[lt++] = t;
+      } else if (c > pivot) {
+        size_t t = positions[i];
+        positions[i] = positions[--gt];
+        positions[gt] = t;
+      } else {
+        ++i;
+      }
+    }
+    sais_multikey_sort(text, len, positions, lt, depth);
+    sais_multikey_sort(text, len, positions + gt, count - gt, depth);
+    if (pivot == 0) {
+      // only one suffix ends here
+      return;
+    }
+    positions += lt;
+    count = gt - lt;
+    ++depth;
+  }
+}
+
+// Two characters at depth as one key, from 0 for the end of the text to 257 * 257 - 1.
+#define SAIS_NUM_KEYS (257 * 257)
+
+size_t sais_key_at(const unsigned char *text, size_t len, size_t i) {
+  return sais_byte_at(text, len, i) * 257 + sais_byte_at(text, len, i + 1);
+}
+
+// Positions of suffixes, count of them from the offset-th in a temporary file, or the positions of the text from
+// offset on when fd is -1.
+struct sais_run {
+    int fd;
+    size_t offset;
+    size_t count;
+};
+
+// State of an external build.
+struct sais_external {
+    const unsigned char *text;
+    size_t len;
+    const char *temp_dir;
+    int sa_fd;
+    /// Bytes of the budget left once out is allocated.
+    size_t available;
+    size_t *out;
+    size_t num_out;
+};
+
+int sais_temp_file(const char *temp_dir) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/sais-XXXXXX", temp_dir);
+  int fd = mkstemp(path);
+  if (fd >= 0) {
+    unlink(path);
+  }
+  return fd;
+}
+
+int sais_write_all(int fd, const void *data, size_t size) {
+  for (const char *p = data; size > 0;) {
+    ssize_t written = write(fd, p, size);
+    if (written <= 0) {
+      return -1;
+    }
+    p += written;
+    size -= written;
+  }
+  return 0;
+}
+
+int sais_pwrite_all(int fd, const void *data, size_t size, size_t offset) {
+  for (const char *p = data; size > 0;) {
+    ssize_t written = pwrite(fd, p, size, offset);
+    if (written <= 0) {
+      return -1;
+    }
+    p += written;
+    size -= written;
+    offset += written;
+  }
+  return 0;
+}
+
+int sais_pread_all(int fd, void *data, size_t size, size_t offset) {
+  for (char *p = data; size > 0;) {
+    ssize_t got = pread(fd, p, size, offset);
+    if (got <= 0) {
+      return -1;
+    }
+    p += got;
+    size -= got;
+    offset += got;
+  }
+  return 0;
+}
+
+// Reads count positions of a run starting from the k-th, into positions.
+int sais_read_run(const struct sais_run *run, size_t k, size_t *positions, size_t count) {
+  if (run->fd < 0) {
+    for (size_t i = 0; i < count; ++i) {
+      positions[i] = run->offset + k + i;
+    }
+    return 0;
+  }
+  return sais_pread_all(run->fd, positions, count * sizeof(size_t), (run->offset + k) * sizeof(size_t));
+}
+
+#define SAIS_EXTERNAL_OUT 4096
+// Smallest memory budget for the external path, which spreads a run with the key counts, a chunk and the buffers
+// of every partition next to the output buffer
+#define SAIS_EXTERNAL_MIN_BUDGET (1 << 20)
+
+int sais_emit(struct sais_external *external, const size_t *positions, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    external->out[external->num_out++] = positions[i];
+    if (external->num_out == SAIS_EXTERNAL_OUT) {
+      if (sais_write_all(external->sa_fd, external->out, SAIS_EXTERNAL_OUT * sizeof(size_t)) != 0) {
+        return -1;
+      }
+      external->num_out = 0;
+    }
+  }
+  return 0;
+}
+
+// Partitions a run is spread into, or sorted runs merged, at once, and the fewest positions buffered per partition.
+#define SAIS_EXTERNAL_FANOUT 16
+#define SAIS_EXTERNAL_BUFFER 512
+
+// Positions sharing their first depth characters, out of the origin positions of the run refined to that depth.
+struct sais_partition {
+    struct sais_run run;
+    size_t depth;
+    size_t origin;
+};
+
+// Sorts the suffixes of a run, which share their first depth characters with the origin suffixes of the run refined
+// to that depth, and appends them to the suffix array, in available bytes of memory. A run that fits is sorted in
+// memory, a larger one is spread over a temporary file by the two characters after depth, into partitions of
+// consecutive keys that fit, and a key too large for one partition is refined the same way two characters deeper.
+// Past SAIS_EXTERNAL_FANOUT partitions, consecutive ones are spread together and spread again on their own, so the
+// file of each level is the only one open and its buffers stay large.
+//
+// Returns 1 when the run does not split: almost every origin suffix shares the next two characters, like in a long
+// run of one byte, where refining would take a pass over the run per two characters, or the memory left by the
+// partitions above is too small to spread it. Origins shrink by at least an eighth per refinement otherwise.
+int sais_sort_run(struct sais_external *external, const struct sais_run *run, size_t depth, size_t origin,
+                  size_t available) {
+  if (run->count * sizeof(size_t) <= available) {
+    size_t *positions = malloc(run->count * sizeof(size_t) + 1);
+    int result = sais_read_run(run, 0, positions, run->count);
+    if (result == 0) {
+      sais_multikey_sort(external->text, external->len, positions, run->count, depth);
+      result = sais_emit(external, positions, run->count);
+    }
+    free(positions);
+    return result;
+  }
+
+  // The partitions stay allocated while they are sorted, the key counts, a chunk and the buffers only while spreading
+  size_t table_size = SAIS_EXTERNAL_FANOUT * sizeof(struct sais_partition);
+  size_t spread_size = table_size + (SAIS_NUM_KEYS + SAIS_EXTERNAL_OUT) * sizeof(size_t);
+  if (available < spread_size + SAIS_EXTERNAL_FANOUT * SAIS_EXTERNAL_BUFFER * sizeof(size_t)) {
+    return 1;
+  }
+  size_t capacity = (available - table_size) / sizeof(size_t);
+
+  size_t *key_slots = calloc(SAIS_NUM_KEYS, sizeof(size_t));
+  size_t *chunk = malloc(SAIS_EXTERNAL_OUT * sizeof(size_t));
+  int result = 0;
+  for (size_t k = 0; k < run->count && result == 0; k += SAIS_EXTERNAL_OUT) {
+    size_t count = run->count - k < SAIS_EXTERNAL_OUT ? run->count - k : SAIS_EXTERNAL_OUT;
+    result = sais_read_run(run, k, chunk, count);
+    for (size_t i = 0; i < count && result == 0; ++i) {
+      ++key_slots[sais_key_at(external->text, external->len, chunk[i] + depth)];
+    }
+  }
+
+  // A first pass counts the partitions, a second one groups them into slots and puts the slot of each key in place of
+  // its count. The run is larger than capacity, so there are at least two partitions when it splits.
+  struct sais_partition *slots = calloc(SAIS_EXTERNAL_FANOUT, sizeof(struct sais_partition));
+  size_t num_partitions = 0;
+  size_t num_slots = 0;
+  for (size_t pass = 0; pass < 2 && result == 0; ++pass) {
+    size_t partition = 0;
+    size_t partition_count = 0;
+    int partition_deeper = 0;
+    for (size_t key = 0; key < SAIS_NUM_KEYS; ++key) {
+      size_t count = key_slots[key];
+      if (count == 0) {
+        continue;
+      }
+      if (count > capacity && count > origin - origin / 8) {
+        result = 1;
+        break;
+      }
+      int starts = partition == 0 || count > capacity || partition_deeper || partition_count + count > capacity;
+      if (starts) {
+        partition_count = 0;
+        partition_deeper = count > capacity;
+        ++partition;
+      }
+      partition_count += count;
+      if (pass == 1) {
+        size_t slot = (partition - 1) * num_slots / num_partitions;
+        if (starts) {
+          // A slot of several partitions is spread again at this depth
+          int alone = slots[slot].run.count == 0 && partition_deeper;
+          slots[slot].depth = alone ? depth + 2 : depth;
+          slots[slot].origin = alone ? count : origin;
+        }
+        slots[slot].run.count += count;
+        key_slots[key] = slot;
+      }
+    }
+    num_partitions = partition;
+    num_slots = num_partitions < SAIS_EXTERNAL_FANOUT ? num_partitions : SAIS_EXTERNAL_FANOUT;
+  }
+
+  // Spread the positions into the slots of one file, through a buffer per slot sharing the memory left
+  int fd = result == 0 ? sais_temp_file(external->temp_dir) : -1;
+  result = result == 0 && fd < 0 ? -1 : result;
+  size_t buffer_size = result == 0 ? (available - spread_size) / sizeof(size_t) / num_slots : 0;
+  size_t *buffers = malloc(num_slots * buffer_size * sizeof(size_t) + 1);
+  size_t buffered[SAIS_EXTERNAL_FANOUT] = {0};
+  size_t written[SAIS_EXTERNAL_FANOUT] = {0};
+  for (size_t s = 0, offset = 0; s < num_slots; offset += slots[s++].run.count) {
+    slots[s].run.fd = fd;
+    slots[s].run.offset = offset;
+  }
+  for (size_t k = 0; k < run->count && result == 0; k += SAIS_EXTERNAL_OUT) {
+    size_t count = run->count - k < SAIS_EXTERNAL_OUT ? run->count - k : SAIS_EXTERNAL_OUT;
+    result = sais_read_run(run, k, chunk, count);
+    for (size_t i = 0; i < count && result == 0; ++i) {
+      size_t s = key_slots[sais_key_at(external->text, external->len, chunk[i] + depth)];
+      buffers[s * buffer_size + buffered[s]++] = chunk[i];
+      if (buffered[s] == buffer_size) {
+        result = sais_pwrite_all(fd, buffers + s * buffer_size, buffer_size * sizeof(size_t),
+                                 (slots[s].run.offset + written[s]) * sizeof(size_t));
+        written[s] += buffer_size;
+        buffered[s] = 0;
+      }
+    }
+  }
+  for (size_t s = 0; s < num_slots && result == 0; ++s) {
+    result = sais_pwrite_all(fd, buffers + s * buffer_size, buffered[s] * sizeof(size_t),
+                             (slots[s].run.offset + written[s]) * sizeof(size_t));
+  }
+  free(buffers);
+  free(chunk);
+  free(key_slots);
+
+  for (size_t s = 0; s < num_slots && result == 0; ++s) {
+    result = sais_sort_run(external, &slots[s].run, slots[s].depth, slots[s].origin, available - table_size);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(slots);
+  return result;
+}
+
+// Reads records of width words from the begin-th to the end-th of a file, through a buffer of capacity records.
+struct sais_reader {
+    int fd;
+    size_t width;
+    size_t next;
+    size_t end;
+    size_t *buffer;
+    size_t capacity;
+    size_t used;
+    size_t position;
+};
+
+void sais_reader_init(struct sais_reader *reader, int fd, size_t width, size_t begin, size_t end, size_t *buffer,
+                      size_t capacity) {
+  *reader = (struct sais_reader) {.fd = fd, .width = width, .next = begin, .end = end, .buffer = buffer,
+                                  .capacity = capacity};
+}
+
+// Current record, or NULL past the end or when the file cannot be read, which sets *result to -1.
+const size_t *sais_reader_peek(struct sais_reader *reader, int *result) {
+  if (reader->position == reader->used) {
+    size_t count = reader->end - reader->next < reader->capacity ? reader->end - reader->next : reader->capacity;
+    if (count == 0 || *result != 0) {
+      return 0;
+    }
+    size_t record_size = reader->width * sizeof(size_t);
+    if (sais_pread_all(reader->fd, reader->buffer, count * record_size, reader->next * record_size) != 0) {
+      *result = -1;
+      return 0;
+    }
+    reader->next += count;
+    reader->used = count;
+    reader->position = 0;
+  }
+  return reader->buffer + reader->position * reader->width;
+}
+
+// Writes records of width words to a file from the offset-th on, through a buffer of capacity records.
+struct sais_writer {
+    int fd;
+    size_t width;
+    size_t *buffer;
+    size_t capacity;
+    size_t used;
+    size_t offset;
+};
+
+void sais_writer_flush(struct sais_writer *writer, int *result) {
+  size_t record_size = writer->width * sizeof(size_t);
+  if (*result == 0) {
+    *result = sais_pwrite_all(writer->fd, writer->buffer, writer->used * record_size, writer->offset * record_size);
+  }
+  writer->offset += writer->used;
+  writer->used = 0;
+}
+
+void sais_writer_put(struct sais_writer *writer, const size_t *record, int *result) {
+  memcpy(writer->buffer + writer->used * writer->width, record, writer->width * sizeof(size_t));
+  if (++writer->used == writer->capacity) {
+    sais_writer_flush(writer, result);
+  }
+}
+
+int sais_compare_positions(const void *a, const void *b) {
+  size_t x = *(const size_t *) a;
+  size_t y = *(const size_t *) b;
+  return (x > y) - (x < y);
+}
+
+// Records ordered by their first two words.
+int sais_compare_name_pairs(const void *a, const void *b) {
+  const size_t *x = a;
+  const size_t *y = b;
+  if (x[0] != y[0]) {
+    return x[0] < y[0] ? -1 : 1;
+  }
+  return (x[1] > y[1]) - (x[1] < y[1]);
+}
+
+// Sorts count records of width words in fd with compare, using memory_size bytes of memory. Runs that fill the memory
+// are sorted by qsort, then merged SAIS_EXTERNAL_FANOUT at a time, each pass writing to the other of two files.
+// Returns the file holding the sorted records and closes the other one, or -1 and closes both.
+int sais_external_sort(const struct sais_external *external, int fd, size_t count, size_t width,
+                       int (*compare)(const void *, const void *), size_t *memory, size_t memory_size) {
+  size_t record_size = width * sizeof(size_t);
+  int other = sais_temp_file(external->temp_dir);
+  int result = other < 0 ? -1 : 0;
+
+  size_t run_length = memory_size / record_size;
+  for (size_t k = 0; k < count && result == 0; k += run_length) {
+    size_t n = count - k < run_length ? count - k : run_length;
+    result = sais_pread_all(fd, memory, n * record_size, k * record_size);
+    if (result == 0) {
+      qsort(memory, n, record_size, compare);
+      result = sais_pwrite_all(other, memory, n * record_size, k * record_size);
+    }
+  }
+
+  // The sorted runs are in other, each pass merges them into fd and swaps the two
+  size_t capacity = memory_size / (SAIS_EXTERNAL_FANOUT + 1) / record_size;
+  for (; result == 0; run_length *= SAIS_EXTERNAL_FANOUT) {
+    int swap = fd;
+    fd = other;
+    other = swap;
+    if (run_length >= count) {
+      break;
+    }
+    for (size_t begin = 0; begin < count && result == 0; begin += run_length * SAIS_EXTERNAL_FANOUT) {
+      struct sais_reader readers[SAIS_EXTERNAL_FANOUT];
+      size_t num_readers = 0;
+      for (size_t b = begin; b < count && num_readers < SAIS_EXTERNAL_FANOUT; b += run_length) {
+        sais_reader_init(readers + num_readers, fd, width, b, count - b < run_length ? count : b + run_length,
+                         memory + num_readers * capacity * width, capacity);
+        ++num_readers;
+      }
+      struct sais_writer writer = {.fd = other, .width = width, .capacity = capacity, .offset = begin,
+                                   .buffer = memory + SAIS_EXTERNAL_FANOUT * capacity * width};
+      for (;;) {
+        const size_t *smallest = 0;
+        size_t which = 0;
+        for (size_t r = 0; r < num_readers; ++r) {
+          const size_t *record = sais_reader_peek(readers + r, &result);
+          if (record != 0 && (smallest == 0 || compare(record, smallest) < 0)) {
+            smallest = record;
+            which = r;
+          }
+        }
+        if (smallest == 0) {
+          break;
+        }
+        sais_writer_put(&writer, smallest, &result);
+        ++readers[which].position;
+      }
+      sais_writer_flush(&writer, &result);
+    }
+  }
+
+  if (other >= 0) {
+    close(other);
+  }
+  if (result != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Sorts every suffix by prefix doubling, when sais_sort_run cannot split a run. The first round names each suffix by
+// its first character plus one, and 0 stands for the empty suffix past the end. Each round sorts the records (name
+// of i, name of i + h, i) of every suffix i, names the suffixes by where their group of equal names starts in that
+// order, plus one, which tells apart their first 2h characters, and sorts the (i, name) pairs back into text order
+// for the next round, until the names all differ. It takes up to the log of the longest repeat rounds, each sorting
+// the positions twice through temporary files, so it is much slower than the partitioning sort.
+int sais_sort_doubling(struct sais_external *external) {
+  size_t len = external->len;
+  size_t *memory = malloc(external->available);
+  // Two readers and a writer share the memory while the records are made or named
+  size_t area = external->available / 3 / sizeof(size_t);
+  int names = -1;
+  int result = 0;
+  for (size_t h = 1; result == 0; h *= 2) {
+    int records = sais_temp_file(external->temp_dir);
+    result = records < 0 ? -1 : 0;
+    struct sais_reader at;
+    struct sais_reader after;
+    if (names >= 0) {
+      sais_reader_init(&at, names, 2, 0, len, memory, area / 2);
+      sais_reader_init(&after, names, 2, h < len ? h : len, len, memory + area, area / 2);
+    }
+    struct sais_writer writer = {.fd = records, .width = 3, .buffer = memory + 2 * area, .capacity = area / 3};
+    for (size_t i = 0; i < len && result == 0; ++i) {
+      size_t record[3] = {0, 0, i};
+      if (names < 0) {
+        record[0] = external->text[i] + 1;
+        record[1] = i + h < len ? external->text[i + h] + 1 : 0;
+      } else {
+        const size_t *name = sais_reader_peek(&at, &result);
+        const size_t *next = i + h < len ? sais_reader_peek(&after, &result) : 0;
+        if (name == 0 || (i + h < len && next == 0)) {
+          result = -1;
+          break;
+        }
+        record[0] = name[1];
+        record[1] = next == 0 ? 0 : next[1];
+        ++at.position;
+        after.position += next != 0;
+      }
+      sais_writer_put(&writer, record, &result);
+    }
+    sais_writer_flush(&writer, &result);
+    if (names >= 0) {
+      close(names);
+      names = -1;
+    }
+    if (result != 0) {
+      if (records >= 0) {
+        close(records);
+      }
+      break;
+    }
+    records = sais_external_sort(external, records, len, 3, sais_compare_name_pairs, memory, external->available);
+    result = records < 0 ? -1 : 0;
+
+    // Name the suffixes in sorted order
+    int pairs = result == 0 ? sais_temp_file(external->temp_dir) : -1;
+    result = result == 0 && pairs < 0 ? -1 : result;
+    struct sais_reader sorted;
+    sais_reader_init(&sorted, records, 3, 0, len, memory, area / 3);
+    writer = (struct sais_writer) {.fd = pairs, .width = 2, .buffer = memory + 2 * area, .capacity = area / 2};
+    size_t previous[2] = {0, 0};
+    size_t name = 0;
+    int distinct = 1;
+    for (size_t k = 0; k < len && result == 0; ++k) {
+      const size_t *record = sais_reader_peek(&sorted, &result);
+      if (record == 0) {
+        result = -1;
+        break;
+      }
+      if (k == 0 || record[0] != previous[0] || record[1] != previous[1]) {
+        name = k + 1;
+      } else {
+        distinct = 0;
+      }
+      previous[0] = record[0];
+      previous[1] = record[1];
+      size_t pair[2] = {record[2], name};
+      sais_writer_put(&writer, pair, &result);
+      ++sorted.position;
+    }
+    sais_writer_flush(&writer, &result);
+
+    if (result == 0 && distinct) {
+      // The records are in suffix array order
+      sais_reader_init(&sorted, records, 3, 0, len, memory, area / 3);
+      for (size_t k = 0; k < len && result == 0; ++k) {
+        const size_t *record = sais_reader_peek(&sorted, &result);
+        result = record == 0 ? -1 : sais_emit(external, record + 2, 1);
+        ++sorted.position;
+      }
+      close(pairs);
+      close(records);
+      break;
+    }
+    if (records >= 0) {
+      close(records);
+    }
+    if (result != 0) {
+      if (pairs >= 0) {
+        close(pairs);
+      }
+      break;
+    }
+    names = sais_external_sort(external, pairs, len, 2, sais_compare_positions, memory, external->available);
+    result = names < 0 ? -1 : 0;
+  }
+  free(memory);
+  return result;
+}
+
+/// Builds the suffix array of len bytes of text_fd, which may hold NUL bytes, and writes its len + 1 entries to sa_fd
+/// as size_t, starting with len for the empty suffix.
+///
+/// When the low-memory build fits in memory_budget, it runs on the mapped text. Otherwise the positions of the
+/// suffixes are spread over temporary files in temp_dir by their first characters, in sequential runs, and each run
+/// small enough for the budget is sorted in memory and appended to sa_fd. Sorting a run costs its distinguishing
+/// prefixes, so highly repetitive text is slow, and when a run too large for the budget does not split, like a long
+/// run of one byte, sa_fd is rewound and the whole text is sorted by prefix doubling with external merge sorts
+/// instead. The text is mapped read-only and is read through the page cache, allocations stay within the budget and
+/// a few temporary files are open at a time.
+///
+/// This is a partitioning sort with a prefix doubling fallback, not an external SA-IS that spills its buckets and
+/// LMS substrings. Text that is too repetitive to split within the budget always falls back to doubling, which
+/// makes O(log n) passes over the text, each with external merge sorts of len records.
+///
+/// \param sa_fd File to write at its current offset, which must be seekable.
+/// \param memory_budget Bytes of memory, at least SAIS_EXTERNAL_MIN_BUDGET (1 MB) unless the text fits in memory.
+/// \return 0, or -1 when the budget is too small, len does not fit in sais_index_t for the in-memory build, the
+/// text cannot be mapped or a file cannot be written.
+int sais_build_external(int text_fd, size_t len, int sa_fd, size_t memory_budget, const char *temp_dir) {
+  int in_memory = (len + 1) * sizeof(sais_index_t) + len / 4 + 257 * sizeof(sais_index_t) <= memory_budget;
+  if (!in_memory && memory_budget < SAIS_EXTERNAL_MIN_BUDGET) {
+    return -1;
+  }
+  const unsigned char *text = 0;
+  if (len > 0) {
+    text = mmap(0, len, PROT_READ, MAP_SHARED, text_fd, 0);
+    if (text == MAP_FAILED) {
+      return -1;
+    }
+  }
+
+  int result;
+  size_t empty = len;
+  if (in_memory) {
+    sais_index_t *sa = sais_build_low_memory(text, 1, len, 256);
+    size_t *out = malloc(SAIS_EXTERNAL_OUT * sizeof(size_t));
+    result = sa == 0 ? -1 : 0;
+    for (size_t k = 0; k < len + 1 && result == 0; k += SAIS_EXTERNAL_OUT) {
+      size_t count = len + 1 - k < SAIS_EXTERNAL_OUT ? len + 1 - k : SAIS_EXTERNAL_OUT;
+      for (size_t i = 0; i < count; ++i) {
+        out[i] = sa[k + i];
+      }
+      result = sais_write_all(sa_fd, out, count * sizeof(size_t));
+    }
+    free(out);
+    free(sa);
+  } else {
+    off_t start = lseek(sa_fd, 0, SEEK_CUR);
+    struct sais_external external = {.text = text, .len = len, .temp_dir = temp_dir, .sa_fd = sa_fd,
+                                     .available = memory_budget - SAIS_EXTERNAL_OUT * sizeof(size_t)};
+    external.out = malloc(SAIS_EXTERNAL_OUT * sizeof(size_t));
+    struct sais_run all = {.fd = -1, .count = len};
+    result = start < 0 ? -1 : sais_emit(&external, &empty, 1);
+    if (result == 0) {
+      result = sais_sort_run(&external, &all, 0, len, external.available);
+    }
+    if (result == 1) {
+      // The entries written so far are written again
+      external.num_out = 0;
+      result = lseek(sa_fd, start, SEEK_SET) == start ? sais_emit(&external, &empty, 1) : -1;
+      if (result == 0) {
+        result = sais_sort_doubling(&external);
+      }
+    }
+    if (result == 0) {
+      result = sais_write_all(sa_fd, external.out, external.num_out * sizeof(size_t));
+    }
+    free(external.out);
+  }
+
+  if (len > 0) {
+    munmap((void *) text, len);
+  }
+  return result;
+}
+
+/// LCP array, entry i is the length of the longest common prefix of the suffixes sa[i - 1] and sa[i], and entry 0
+/// is 0. Entries are width bytes each, 1 or 4, and values that do not fit are escaped with the largest entry and
+/// kept in a table sorted by position.
+struct sais_lcp {
+    size_t len;
+    size_t width;
+    void *entries;
+    size_t num_overflows;
+    size_t overflow_capacity;
+    size_t *overflow_positions;
+    size_t *overflow_values;
+};
+
+struct sais_lcp *sais_lcp_new(size_t len, size_t width) {
+  struct sais_lcp *lcp = calloc(1, sizeof(struct sais_lcp));
+  lcp->len = len;
+  lcp->width = width;
+  lcp->entries = malloc((len + 1) * width);
+  return lcp;
+}
+
+size_t sais_lcp_escape(const struct sais_lcp *lcp) {
+  return lcp->width == 1 ? UINT8_MAX : UINT32_MAX;
+}
+
+void sais_lcp_set(struct sais_lcp *lcp, size_t i, size_t value) {
+  size_t escape = sais_lcp_escape(lcp);
+  if (value >= escape) {
+    if (lcp->num_overflows == lcp->overflow_capacity) {
+      lcp->overflow_capacity = lcp->overflow_capacity == 0 ? 16 : lcp->overflow_capacity * 2;
+      lcp->overflow_positions = realloc(lcp->overflow_positions, lcp->overflow_capacity * sizeof(size_t));
+      lcp->overflow_values = realloc(lcp->overflow_values, lcp->overflow_capacity * sizeof(size_t));
+    }
+    lcp->overflow_positions[lcp->num_overflows] = i;
+    lcp->overflow_values[lcp->num_overflows] = value;
+    ++lcp->num_overflows;
+    value = escape;
+  }
+  if (lcp->width == 1) {
+    ((uint8_t *) lcp->entries)[i] = value;
+  } else {
+    ((uint32_t *) lcp->entries)[i] = value;
+  }
+}
+
+/// LCP of the suffixes sa[i - 1] and sa[i].
+size_t sais_lcp_at(const struct sais_lcp *lcp, size_t i) {
+  size_t value = lcp->width == 1 ? ((const uint8_t *) lcp->entries)[i] : ((const uint32_t *) lcp->entries)[i];
+  if (value != sais_lcp_escape(lcp)) {
+    return value;
+  }
+  size_t lower = 0;
+  size_t upper = lcp->num_overflows;
+  while (upper - lower > 1) {
+    size_t middle = (lower + upper) / 2;
+    if (lcp->overflow_positions[middle] <= i) {
+      lower = middle;
+    } else {
+      upper = middle;
+    }
+  }
+  return lcp->overflow_values[lower];
+}
+
+size_t sais_lcp_memory(const struct sais_lcp *lcp) {
+  return sizeof(struct sais_lcp) + (lcp->len + 1) * lcp->width + lcp->overflow_capacity * 2 * sizeof(size_t);
+}
+
+void sais_lcp_free(struct sais_lcp *lcp) {
+  free(lcp->overflow_values);
+  free(lcp->overflow_positions);
+  free(lcp->entries);
+  free(lcp);
+}
+
+// Extends a common prefix of length h of the suffixes at i and j.
+size_t sais_extend_lcp(const void *text, size_t symbol_size, size_t len, size_t i, size_t j, size_t h) {
+  while (i + h < len && j + h < len &&
+         sais_symbol(text, symbol_size, len, i + h) == sais_symbol(text, symbol_size, len, j + h)) {
+    ++h;
+  }
+  return h;
+}
+
+void sais_lcp_sort_overflows(struct sais_lcp *lcp) {
+  size_t *pairs = malloc(lcp->num_overflows * 2 * sizeof(size_t));
+  for (size_t k = 0; k < lcp->num_overflows; ++k) {
+    pairs[2 * k] = lcp->overflow_positions[k];
+    pairs[2 * k + 1] = lcp->overflow_values[k];
+  }
+  qsort(pairs, lcp->num_overflows, 2 * sizeof(size_t), sais_compare_positions);
+  for (size_t k = 0; k < lcp->num_overflows; ++k) {
+    lcp->overflow_positions[k] = pairs[2 * k];
+    lcp->overflow_values[k] = pairs[2 * k + 1];
+  }
+  free(pairs);
+}
+
+/// Builds the LCP array with Kasai's algorithm, visiting the suffixes in text order through the inverse suffix
+/// array. Needs len + 1 extra entries of sais_index_t for the ranks.
+///
+/// \param text, symbol_size, len Same as sais_build_symbols.
+/// \param sa Suffix array of len + 1 entries, as sais_build_low_memory returns it.
+/// \param width Bytes per LCP entry, 1 or 4.
+struct sais_lcp *sais_lcp_kasai(const void *text, size_t symbol_size, size_t len, const sais_index_t *sa,
+                                size_t width) {
+  struct sais_lcp *lcp = sais_lcp_new(len, width);
+  sais_index_t *rank = malloc((len + 1) * sizeof(sais_index_t));
+  for (size_t i = 0; i < len + 1; ++i) {
+    rank[sa[i]] = i;
+  }
+
+  sais_lcp_set(lcp, 0, 0);
+  size_t h = 0;
+  for (size_t i = 0; i < len; ++i) {
+    // only the sentinel has rank 0
+    size_t r = rank[i];
+    h = sais_extend_lcp(text, symbol_size, len, i, sa[r - 1], h);
+    sais_lcp_set(lcp, r, h);
+    if (h > 0) {
+      --h;
+    }
+  }
+  free(rank);
+
+  // Ranks are visited in text order, not in position order
+  sais_lcp_sort_overflows(lcp);
+
+  return lcp;
+}
+
+/// Builds the LCP array with the Phi algorithm of Karkkainen, Manzini and Puglisi. Phi maps each suffix to the one
+/// before it in sa, the permuted LCP is computed over it in text order and then gathered in sa order, so unlike
+/// Kasai's algorithm the text scan never follows a rank into random memory. Needs len + 1 extra entries of
+/// sais_index_t, same arguments as sais_lcp_kasai.
+struct sais_lcp *sais_lcp_phi(const void *text, size_t symbol_size, size_t len, const sais_index_t *sa,
+                              size_t width) {
+  struct sais_lcp *lcp = sais_lcp_new(len, width);
+  sais_index_t *phi = malloc((len + 1) * sizeof(sais_index_t));
+  for (size_t i = 1; i < len + 1; ++i) {
+    phi[sa[i]] = sa[i - 1];
+  }
+
+  // Permuted LCP over phi in place
+  size_t h = 0;
+  for (size_t i = 0; i < len; ++i) {
+    h = sais_extend_lcp(text, symbol_size, len, i, phi[i], h);
+    phi[i] = h;
+    if (h > 0) {
+      --h;
+    }
+  }
+  phi[len] = 0;
+
+  for (size_t i = 0; i < len + 1; ++i) {
+    sais_lcp_set(lcp, i, phi[sa[i]]);
+  }
+  free(phi);
+
+  return lcp;
+}
+
+/// LCP-LR arrays of the binary search over a suffix array of len + 1 entries. The search narrows (L, R) from
+/// (0, len + 1) to its midpoint M, and every M has a single (L, R): left holds the LCP of sa[L] and sa[M] at M, right
+/// the LCP of sa[M] and sa[R], which is 0 for R = len + 1.
+struct sais_lcp_lr {
+    struct sais_lcp *left;
+    struct sais_lcp *right;
+};
+
+// LCP of sa[lower] and sa[upper], filling the arrays of the midpoints in between.
+size_t sais_lcp_lr_fill(struct sais_lcp_lr *lcp_lr, const struct sais_lcp *lcp, size_t lower, size_t upper) {
+  if (upper - lower == 1) {
+    return upper == lcp->len + 1 ? 0 : sais_lcp_at(lcp, upper);
+  }
+  size_t middle = (lower + upper) / 2;
+  size_t left = sais_lcp_lr_fill(lcp_lr, lcp, lower, middle);
+  size_t right = sais_lcp_lr_fill(lcp_lr, lcp, middle, upper);
+  sais_lcp_set(lcp_lr->left, middle, left);
+  sais_lcp_set(lcp_lr->right, middle, right);
+  return left < right ? left : right;
+}
+
+/// Builds the LCP-LR arrays from an LCP array, with entries of the same width.
+struct sais_lcp_lr *sais_lcp_lr_build(const struct sais_lcp *lcp) {
+  struct sais_lcp_lr *lcp_lr = malloc(sizeof(struct sais_lcp_lr));
+  lcp_lr->left = sais_lcp_new(lcp->len, lcp->width);
+  lcp_lr->right = sais_lcp_new(lcp->len, lcp->width);
+  sais_lcp_set(lcp_lr->left, 0, 0);
+  sais_lcp_set(lcp_lr->right, 0, 0);
+  sais_lcp_lr_fill(lcp_lr, lcp, 0, lcp->len + 1);
+  sais_lcp_sort_overflows(lcp_lr->left);
+  sais_lcp_sort_overflows(lcp_lr->right);
+  return lcp_lr;
+}
+
+void sais_lcp_lr_free(struct sais_lcp_lr *lcp_lr) {
+  sais_lcp_free(lcp_lr->right);
+  sais_lcp_free(lcp_lr->left);
+  free(lcp_lr);
+}
+
+// Extends the common prefix h of pattern and the suffix at i, the NUL ending text stops it at the end.
+size_t sais_extend_pattern(const char *pattern, size_t pattern_len, const char *text, size_t i, size_t h) {
+  while (h < pattern_len && pattern[h] == text[i + h]) {
+    ++h;
+  }
+  return h;
+}
+
+// Binary search state: sa[lower] is before the bound, sa[upper] is not, l and r are their LCPs with the pattern.
+struct sais_search_state {
+    size_t lower;
+    size_t upper;
+    size_t l;
+    size_t r;
+};
+
+// States of a search without LCP-LR arrays before each probe, with the number of characters the probed suffix
+// shares with the pattern, then the state it ended in with h = SIZE_MAX. The search for another pattern that shares
+// more than h characters with this one from the same start takes the same steps up to the probe.
+struct sais_search_path {
+    size_t num_steps;
+    struct sais_search_step {
+        struct sais_search_state state;
+        size_t h;
+    } steps[66];
+};
+
+// First index of sa whose suffix is not less than pattern, or with after set, whose suffix is greater than pattern
+// and does not start with it. Without lcp_lr the comparison at the midpoint starts from min(l, r) (the mlr trick of
+// Manber and Myers), with it a character of the pattern is compared again at most once per step, which makes the
+// search O(m + log n). Both searches take the same steps until a midpoint starts with pattern, that state is saved to
+// split so the search after the pattern can go on from there, split->upper stays 0 when the pattern does not occur.
+// The steps are appended to path when it is not NULL, which requires no lcp_lr.
+// Inlined into sais_narrow, GCC -O3 turns the bound updates into conditional moves, which keeps the next probe from
+// being loaded before the current one and makes batches 1.5x slower.
+__attribute__((noinline)) size_t sais_search_bound(const char *pattern, size_t pattern_len, const char *text,
+                                                   const sais_index_t *sa, const struct sais_lcp_lr *lcp_lr, int after,
+                                                   struct sais_search_state state, struct sais_search_state *split,
+                                                   struct sais_search_path *path) {
+  size_t lower = state.lower;
+  size_t upper = state.upper;
+  size_t l = state.l;
+  size_t r = state.r;
+
+  while (upper - lower > 1) {
+    size_t middle = (lower + upper) / 2;
+    size_t h;
+    if (lcp_lr == 0) {
+      h = sais_extend_pattern(pattern, pattern_len, text, sa[middle], l < r ? l : r);
+    } else if (l >= r) {
+      size_t left = sais_lcp_at(lcp_lr->left, middle);
+      if (left > l) {
+        lower = middle;
+        continue;
+      } else if (left < l) {
+        upper = middle;
+        r = left;
+        continue;
+      }
+      h = sais_extend_pattern(pattern, pattern_len, text, sa[middle], l);
+    } else {
+      size_t right = sais_lcp_at(lcp_lr->right, middle);
+      if (right > r) {
+        upper = middle;
+        continue;
+      } else if (right < r) {
+        lower = middle;
+        l = right;
+        continue;
+      }
+      h = sais_extend_pattern(pattern, pattern_len, text, sa[middle], r);
+    }
+    if (path != 0) {
+      path->steps[path->num_steps++] = (struct sais_search_step){{lower, upper, l, r}, h};
+    }
+
+    if (h == pattern_len && split != 0 && split->upper == 0) {
+      split->lower = middle;
+      split->upper = upper;
+      split->l = h;
+      split->r = r;
+    }
+    int middle_is_less = h == pattern_len ? after : (unsigned char) text[sa[middle] + h] < (unsigned char) pattern[h];
+    if (middle_is_less) {
+      lower = middle;
+      l = h;
+    } else {
+      upper = middle;
+      r = h;
+    }
+  }
+
+  if (path != 0) {
+    path->steps[path->num_steps] = (struct sais_search_step){{lower, upper, l, r}, SIZE_MAX};
+  }
+  return upper;
+}
+
+/// Finds the range [lo, hi) of sa whose suffixes start with pattern, with two binary searches and no work per
+/// occurrence.
+///
+/// \param pattern NUL-terminated string to search in the text.
+/// \param text NUL-terminated string of sa.
+/// \param sa Suffix array for text, sa[0] is the length of text.
+/// \param lcp_lr LCP-LR arrays for sa, which make the search O(m + log n), or NULL to search in O(m log n) worst case.
+/// \return hi - lo, the number of occurrences of pattern in text.
+size_t sais_search_range(const char *pattern, const char *text, const sais_index_t *sa,
+                         const struct sais_lcp_lr *lcp_lr, size_t *lo, size_t *hi) {
+  size_t pattern_len = strlen(pattern);
+  if (pattern_len == 0) {
+    *lo = 0;
+    *hi = sa[0] + 1;
+    return *hi;
+  }
+
+  // sa[0] is the empty suffix, before any pattern, and len + 1 is past every suffix
+  struct sais_search_state start = {0, sa[0] + 1, 0, 0};
+  struct sais_search_state split = {0, 0, 0, 0};
+  *lo = sais_search_bound(pattern, pattern_len, text, sa, lcp_lr, 0, start, &split, 0);
+  *hi = split.upper == 0 ? *lo : sais_search_bound(pattern, pattern_len, text, sa, lcp_lr, 1, split, 0, 0);
+  return *hi - *lo;
+}
+
+/// Start of every k-mer in a suffix array of a NUL-terminated text: the suffixes starting with the k bytes of code
+/// c, most significant first, are [start[c], start[c + 1]). Suffixes shorter than k are padded with NUL.
+struct sais_kmer_table {
+    size_t k;
+    size_t *start;
+};
+
+size_t sais_kmer_code(const char *text, size_t i, size_t k) {
+  size_t code = 0;
+  for (size_t d = 0; d < k; ++d) {
+    code = code << 8 | (unsigned char) text[i];
+    if (text[i] != 0) {
+      ++i;
+    }
+  }
+  return code;
+}
+
+/// Builds the table of k-mers for k from 1 to 3, it has 256^k + 1 entries.
+struct sais_kmer_table *sais_kmer_table_build(const char *text, const sais_index_t *sa, size_t k) {
+  assert(k >= 1 && k <= 3);
+  size_t num_codes = (size_t) 1 << (8 * k);
+  struct sais_kmer_table *table = malloc(sizeof(struct sais_kmer_table));
+  table->k = k;
+  table->start = malloc((num_codes + 1) * sizeof(size_t));
+
+  size_t code = 0;
+  for (size_t i = 0; i < sa[0] + 1; ++i) {
+    size_t suffix_code = sais_kmer_code(text, sa[i], k);
+    while (code <= suffix_code) {
+      table->start[code++] = i;
+    }
+  }
+  while (code <= num_codes) {
+    table->start[code++] = sa[0] + 1;
+  }
+
+  return table;
+}
+
+void sais_kmer_table_free(struct sais_kmer_table *table) {
+  free(table->start);
+  free(table);
+}
+
+// Narrows [*lo, *hi), whose suffixes start with the first depth characters of pattern, to those starting with its
+// first target characters. The mlr search only needs the suffixes strictly between its bounds to share min(l, r)
+// characters with the pattern, so it can start from the bounds around the range with l = r = depth.
+void sais_narrow(const char *pattern, size_t depth, size_t target, const char *text, const sais_index_t *sa,
+                 size_t *lo, size_t *hi) {
+  if (*lo == *hi || depth == target) {
+    return;
+  }
+  struct sais_search_state start = {*lo == 0 ? 0 : *lo - 1, *hi, depth, depth};
+  struct sais_search_state split = {0, 0, 0, 0};
+  *lo = sais_search_bound(pattern, target, text, sa, 0, 0, start, &split, 0);
+  *hi = split.upper == 0 ? *lo : sais_search_bound(pattern, target, text, sa, 0, 1, split, 0, 0);
+}
+
+// The first 8 characters are kept as a big-endian key padded with NUL, so sorting rarely reads the pattern.
+struct sais_batch_pattern {
+    uint64_t prefix;
+    const char *pattern;
+    size_t index;
+};
+
+int sais_compare_batch_patterns(const void *a, const void *b) {
+  const struct sais_batch_pattern *x = a;
+  const struct sais_batch_pattern *y = b;
+  if (x->prefix != y->prefix) {
+    return x->prefix < y->prefix ? -1 : 1;
+  }
+  return (x->prefix & 0xff) == 0 ? 0 : strcmp(x->pattern + 8, y->pattern + 8);
+}
+
+/// Finds the range [lo[k], hi[k]) of sa whose suffixes start with patterns[k], for every pattern, like
+/// sais_search_range. The patterns are searched in sorted order, so patterns with a common prefix come one after
+/// another and probe the same midpoints of sa down to the range of that prefix. Each search resumes the search for
+/// the previous pattern at its first probe that compared more characters than the two patterns share, the probes
+/// before it are not taken again, and the ones after it are still in cache. A k-mer table skips the first probes,
+/// every pattern with the same first k characters starts from the same range.
+///
+/// \param table k-mer table of sa that gives the ranges of the first k characters, or NULL.
+void sais_search_batch(const char *const *patterns, size_t num_patterns, const char *text, const sais_index_t *sa,
+                       const struct sais_kmer_table *table, size_t *lo, size_t *hi) {
+  struct sais_batch_pattern *sorted = malloc(num_patterns * sizeof(struct sais_batch_pattern));
+  for (size_t k = 0; k < num_patterns; ++k) {
+    sorted[k].prefix = 0;
+    for (size_t d = 0, ended = 0; d < 8; ++d) {
+      ended = ended || patterns[k][d] == 0;
+      sorted[k].prefix = sorted[k].prefix << 8 | (ended ? 0 : (unsigned char) patterns[k][d]);
+    }
+    sorted[k].pattern = patterns[k];
+    sorted[k].index = k;
+  }
+  qsort(sorted, num_patterns, sizeof(struct sais_batch_pattern), sais_compare_batch_patterns);
+
+  // Path of the search for the lower bound of the previous pattern, which started at depth
+  struct sais_search_path path = {.num_steps = 0};
+  size_t path_depth = SIZE_MAX;
+  const char *previous = "";
+  for (size_t k = 0; k < num_patterns; ++k) {
+    const char *pattern = sorted[k].pattern;
+    size_t index = sorted[k].index;
+    if (k > 0 && sais_compare_batch_patterns(sorted + k, sorted + k - 1) == 0) {
+      lo[index] = lo[sorted[k - 1].index];
+      hi[index] = hi[sorted[k - 1].index];
+      continue;
+    }
+
+    size_t depth = 0;
+    lo[index] = 0;
+    hi[index] = sa[0] + 1;
+    if (table != 0) {
+      size_t code = 0;
+      for (; depth < table->k && pattern[depth] != 0; ++depth) {
+        code |= (size_t) (unsigned char) pattern[depth] << (8 * (table->k - 1 - depth));
+      }
+      if (depth > 0) {
+        lo[index] = table->start[code];
+        hi[index] = table->start[code + ((size_t) 1 << (8 * (table->k - depth)))];
+      }
+    }
+    size_t pattern_len = depth + strlen(pattern + depth);
+    if (lo[index] == hi[index] || depth == pattern_len) {
+      continue;
+    }
+
+    // Patterns sharing more than depth characters start from the same range, and a probe that shares fewer
+    // characters with the previous pattern than the two share compares the same for both, and does not start with
+    // pattern, so the split is not among them
+    size_t common = 0;
+    while (pattern[common] != 0 && pattern[common] == previous[common]) {
+      ++common;
+    }
+    size_t step = 0;
+    if (common > depth && path_depth == depth) {
+      while (path.steps[step].h < common) {
+        ++step;
+      }
+    }
+    struct sais_search_state start = {lo[index] == 0 ? 0 : lo[index] - 1, hi[index], depth, depth};
+    if (step > 0) {
+      start = path.steps[step].state;
+    }
+    struct sais_search_state split = {0, 0, 0, 0};
+    path.num_steps = step;
+    lo[index] = sais_search_bound(pattern, pattern_len, text, sa, 0, 0, start, &split, &path);
+    hi[index] = split.upper == 0 ? lo[index] : sais_search_bound(pattern, pattern_len, text, sa, 0, 1, split, 0, 0);
+    path_depth = depth;
+    previous = pattern;
+  }
+
+  free(sorted);
+}
+
+/// Searches pattern in text with assistant of suffix array.
+///
+/// \param pattern NULL-terminated string to search in the text.
+/// \param text NULL-terminated string to search the all occurrences of the pattern.
+/// \param sa Suffix array for text
+/// \param positions if this is not NULL, it will point to an element in sa, such that starting from poistions, all the consecutive suffixes are starting with the pattern.
+/// \return number of occurrences of pattern in text.
+size_t sais_search_for(const char *pattern, const char *text, const sais_index_t *sa, const sais_index_t **positions) {
+  size_t lo, hi;
+  size_t occurrences = sais_search_range(pattern, text, sa, 0, &lo, &hi);
+  if (positions != 0 && occurrences > 0) {
+    *positions = sa + lo;
+  }
+  return occurrences;
+}
+
+/// Header of an index file, in the byte order of the machine that wrote it. The text follows, with a NUL after it,
+/// then the suffix array at sa_width bytes per entry, 4, 5 or 8, little-endian for 5, then the LCP entries and the
+/// overflow positions and values when lcp_width is not 0. Every section starts at a multiple of 8 bytes, so when
+/// sa_width is sizeof(sais_index_t) the mapped suffix array is a sais_index_t array for the search functions above.
+struct sais_index_header {
+    char magic[8];
+    uint64_t len;
+    uint64_t alphabet_size;
+    uint64_t sa_width;
+    uint64_t lcp_width;
+    uint64_t num_lcp_overflows;
+    uint64_t text_offset;
+    uint64_t sa_offset;
+    uint64_t lcp_offset;
+    uint64_t overflow_offset;
+    uint64_t file_size;
+    uint64_t checksum;
+};
+
+#define SAIS_INDEX_MAGIC "SAISIDX1"
+
+// 64-bit words mixed one by one, fast enough to check a corpus at close to memory bandwidth. size is a multiple of 8.
+uint64_t sais_checksum(uint64_t checksum, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+  for (size_t k = 0; k < size; k += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + k, 8);
+    checksum ^= word;
+    checksum = (checksum << 29 | checksum >> 35) * 0x9e3779b97f4a7c15ULL;
+  }
+  return checksum;
+}
+
+size_t sais_align8(size_t size) {
+  return (size + 7) & ~(size_t) 7;
+}
+
+#define SAIS_INDEX_BUFFER 8192
+
+// Writes sections through a buffer, checksumming what it writes after the header.
+struct sais_index_writer {
+    int fd;
+    unsigned char buffer[SAIS_INDEX_BUFFER];
+    size_t used;
+    uint64_t checksum;
+    int result;
+};
+
+void sais_index_flush(struct sais_index_writer *writer) {
+  writer->checksum = sais_checksum(writer->checksum, writer->buffer, writer->used);
+  if (writer->result == 0) {
+    writer->result = sais_write_all(writer->fd, writer->buffer, writer->used);
+  }
+  writer->used = 0;
+}
+
+void sais_index_put(struct sais_index_writer *writer, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+  while (size > 0) {
+    size_t count = SAIS_INDEX_BUFFER - writer->used < size ? SAIS_INDEX_BUFFER - writer->used : size;
+    memcpy(writer->buffer + writer->used, bytes, count);
+    writer->used += count;
+    bytes += count;
+    size -= count;
+    if (writer->used == SAIS_INDEX_BUFFER) {
+      sais_index_flush(writer);
+    }
+  }
+}
+
+// Pads the section with zeros to a multiple of 8 bytes.
+void sais_index_pad(struct sais_index_writer *writer, size_t size) {
+  uint64_t zero = 0;
+  sais_index_put(writer, &zero, sais_align8(size) - size);
+}
+
+/// Writes an index of text and its suffix array to fd, which must be empty.
+///
+/// \param sa_width Bytes per suffix array entry: 4 for texts shorter than 2^32, 5 for texts shorter than 2^40, or 8.
+/// \param lcp LCP array of sa to keep in the index, or NULL.
+/// \return 0, or -1 when the text is too long for sa_width or the file cannot be written.
+int sais_index_write(int fd, const char *text, size_t len, const sais_index_t *sa, size_t sa_width,
+                     const struct sais_lcp *lcp) {
+  if ((sa_width != 4 && sa_width != 5 && sa_width != 8) || (sa_width < 8 && len >> (8 * sa_width) != 0)) {
+    return -1;
+  }
+
+  struct sais_index_header header = {.magic = SAIS_INDEX_MAGIC, .len = len, .sa_width = sa_width};
+  for (size_t i = 0; i < len; ++i) {
+    size_t c = (unsigned char) text[i];
+    header.alphabet_size = c + 1 > header.alphabet_size ? c + 1 : header.alphabet_size;
+  }
+  header.text_offset = sizeof(struct sais_index_header);
+  header.sa_offset = header.text_offset + sais_align8(len + 1);
+  header.lcp_offset = header.sa_offset + sais_align8((len + 1) * sa_width);
+  header.overflow_offset = header.lcp_offset;
+  if (lcp != 0) {
+    header.lcp_width = lcp->width;
+    header.num_lcp_overflows = lcp->num_overflows;
+    header.overflow_offset += sais_align8((len + 1) * lcp->width);
+  }
+  header.file_size = header.overflow_offset + 2 * header.num_lcp_overflows * sizeof(uint64_t);
+
+  // The header goes first with no checksum, and again at the end with it
+  struct sais_index_writer *writer = calloc(1, sizeof(struct sais_index_writer));
+  writer->fd = fd;
+  writer->result = sais_write_all(fd, &header, sizeof(header));
+  sais_index_put(writer, text, len);
+  sais_index_put(writer, "", 1);
+  sais_index_pad(writer, len + 1);
+  for (size_t i = 0; i < len + 1; ++i) {
+    uint64_t entry = sa[i];
+    if (sa_width == 5) {
+      unsigned char bytes[5] = {entry, entry >> 8, entry >> 16, entry >> 24, entry >> 32};
+      sais_index_put(writer, bytes, 5);
+    } else if (sa_width == 4) {
+      uint32_t narrow = entry;
+      sais_index_put(writer, &narrow, 4);
+    } else {
+      sais_index_put(writer, &entry, 8);
+    }
+  }
+  sais_index_pad(writer, (len + 1) * sa_width);
+  if (lcp != 0) {
+    sais_index_put(writer, lcp->entries, (len + 1) * lcp->width);
+    sais_index_pad(writer, (len + 1) * lcp->width);
+    for (size_t k = 0; k < lcp->num_overflows; ++k) {
+      uint64_t position = lcp->overflow_positions[k];
+      sais_index_put(writer, &position, 8);
+    }
+    for (size_t k = 0; k < lcp->num_overflows; ++k) {
+      uint64_t value = lcp->overflow_values[k];
+      sais_index_put(writer, &value, 8);
+    }
+  }
+  sais_index_flush(writer);
+
+  header.checksum = writer->checksum;
+  int result = writer->result;
+  if (result == 0 && pwrite(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+    result = -1;
+  }
+  free(writer);
+  return result;
+}
+
+/// Index file mapped read-only. Opening it costs a few system calls, and processes mapping the same file share its
+/// pages through the page cache.
+struct sais_index {
+    const struct sais_index_header *header;
+    size_t len;
+    /// NUL-terminated text.
+    const char *text;
+    size_t sa_width;
+    /// Suffix array entries, a sais_index_t array when sa_width is its size, read with sais_index_sa otherwise.
+    const void *sa;
+    /// LCP array in the mapping when lcp.width is not 0, for sais_lcp_at and sais_lcp_lr_build, never freed.
+    struct sais_lcp lcp;
+};
+
+/// Maps an index file written by sais_index_write.
+///
+/// \param verify Whether to check the checksum, which reads the whole file, otherwise only the header is checked.
+/// \return The index, or NULL when the file cannot be mapped, is not an index, is truncated or fails the checksum.
+struct sais_index *sais_index_open(int fd, int verify) {
+  struct sais_index_header header;
+  if (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+      memcmp(header.magic, SAIS_INDEX_MAGIC, 8) != 0 || lseek(fd, 0, SEEK_END) != (off_t) header.file_size) {
+    return 0;
+  }
+  // Sections as sais_index_write lays them out, which also keeps a corrupt header from pointing outside the file
+  size_t lcp_size = header.lcp_width == 0 ? 0 : sais_align8((header.len + 1) * header.lcp_width);
+  if ((header.sa_width != 4 && header.sa_width != 5 && header.sa_width != 8) ||
+      (header.lcp_width != 0 && header.lcp_width != 1 && header.lcp_width != 4) ||
+      header.text_offset != sizeof(header) || header.sa_offset != header.text_offset + sais_align8(header.len + 1) ||
+      header.lcp_offset != header.sa_offset + sais_align8((header.len + 1) * header.sa_width) ||
+      header.overflow_offset != header.lcp_offset + lcp_size ||
+      header.file_size != header.overflow_offset + 2 * header.num_lcp_overflows * sizeof(uint64_t)) {
+    return 0;
+  }
+
+  const unsigned char *map = mmap(0, header.file_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return 0;
+  }
+  if (verify && sais_checksum(0, map + sizeof(header), header.file_size - sizeof(header)) != header.checksum) {
+    munmap((void *) map, header.file_size);
+    return 0;
+  }
+
+  struct sais_index *index = calloc(1, sizeof(struct sais_index));
+  index->header = (const struct sais_index_header *) map;
+  index->len = header.len;
+  index->text = (const char *) map + header.text_offset;
+  index->sa_width = header.sa_width;
+  index->sa = map + header.sa_offset;
+  if (header.lcp_width != 0) {
+    index->lcp.len = header.len;
+    index->lcp.width = header.lcp_width;
+    index->lcp.entries = (void *) (map + header.lcp_offset);
+    index->lcp.num_overflows = header.num_lcp_overflows;
+    index->lcp.overflow_positions = (size_t *) (map + header.overflow_offset);
+    index->lcp.overflow_values = index->lcp.overflow_positions + header.num_lcp_overflows;
+  }
+  return index;
+}
+
+void sais_index_close(struct sais_index *index) {
+  munmap((void *) index->header, index->header->file_size);
+  free(index);
+}
+
+/// Entry i of the suffix array of the index.
+size_t sais_index_sa(const struct sais_index *index, size_t i) {
+  if (index->sa_width == 8) {
+    return ((const size_t *) index->sa)[i];
+  } else if (index->sa_width == 4) {
+    return ((const uint32_t *) index->sa)[i];
+  }
+  const unsigned char *bytes = (const unsigned char *) index->sa + 5 * i;
+  return (size_t) bytes[0] | (size_t) bytes[1] << 8 | (size_t) bytes[2] << 16 | (size_t) bytes[3] << 24 |
+         (size_t) bytes[4] << 32;
+}
+
+// sais_search_bound without LCP-LR, for entries of any width.
+size_t sais_index_bound(const struct sais_index *index, const char *pattern, size_t pattern_len, int after) {
+  size_t lower = 0;
+  size_t upper = index->len + 1;
+  size_t l = 0;
+  size_t r = 0;
+  while (upper - lower > 1) {
+    size_t middle = (lower + upper) / 2;
+    size_t position = sais_index_sa(index, middle);
+    size_t h = sais_extend_pattern(pattern, pattern_len, index->text, position, l < r ? l : r);
+    int middle_is_less = h == pattern_len ? after
+                                          : (unsigned char) index->text[position + h] < (unsigned char) pattern[h];
+    if (middle_is_less) {
+      lower = middle;
+      l = h;
+    } else {
+      upper = middle;
+      r = h;
+    }
+  }
+  return upper;
+}
+
+/// sais_search_range on a mapped index, the positions of the occurrences are sais_index_sa(index, lo .. hi - 1).
+size_t sais_index_search_range(const struct sais_index *index, const char *pattern, size_t *lo, size_t *hi) {
+  if (index->sa_width == sizeof(sais_index_t)) {
+    return sais_search_range(pattern, index->text, index->sa, 0, lo, hi);
+  }
+  size_t pattern_len = strlen(pattern);
+  *lo = pattern_len == 0 ? 0 : sais_index_bound(index, pattern, pattern_len, 0);
+  *hi = pattern_len == 0 ? index->len + 1 : sais_index_bound(index, pattern, pattern_len, 1);
+  return *hi - *lo;
+}
+
+// Helpers of the FM-index queries are forced inline, so that the queries can be compiled with and without popcnt.
+#define SAIS_INLINE static inline __attribute__((always_inline))
+
+/// Cache line of a rank bitvector: the ones before it, then 448 bits, so a rank reads one line and up to 7 popcounts.
+struct sais_rank_block {
+    uint64_t rank;
+    uint64_t bits[7];
+};
+
+#define SAIS_RANK_BITS 448
+
+struct sais_bitvector {
+    size_t len;
+    struct sais_rank_block *blocks;
+};
+
+void sais_bitvector_init(struct sais_bitvector *bitvector, size_t len) {
+  size_t num_blocks = len / SAIS_RANK_BITS + 1;
+  bitvector->len = len;
+  bitvector->blocks = aligned_alloc(64, num_blocks * sizeof(struct sais_rank_block));
+  memset(bitvector->blocks, 0, num_blocks * sizeof(struct sais_rank_block));
+}
+
+void sais_bitvector_set(struct sais_bitvector *bitvector, size_t i) {
+  bitvector->blocks[i / SAIS_RANK_BITS].bits[i % SAIS_RANK_BITS / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+SAIS_INLINE int sais_bitvector_get(const struct sais_bitvector *bitvector, size_t i) {
+  return bitvector->blocks[i / SAIS_RANK_BITS].bits[i % SAIS_RANK_BITS / 64] >> (i % 64) & 1;
+}
+
+// Fills in the ranks of the blocks once every bit is set.
+void sais_bitvector_rank_blocks(struct sais_bitvector *bitvector) {
+  uint64_t rank = 0;
+  for (size_t b = 0; b < bitvector->len / SAIS_RANK_BITS + 1; ++b) {
+    bitvector->blocks[b].rank = rank;
+    for (size_t w = 0; w < 7; ++w) {
+      rank += __builtin_popcountll(bitvector->blocks[b].bits[w]);
+    }
+  }
+}
+
+/// Ones in the first i bits.
+SAIS_INLINE size_t sais_bitvector_rank(const struct sais_bitvector *bitvector, size_t i) {
+  const struct sais_rank_block *block = bitvector->blocks + i / SAIS_RANK_BITS;
+  size_t offset = i % SAIS_RANK_BITS;
+  size_t rank = block->rank;
+  for (size_t w = 0; w < offset / 64; ++w) {
+    rank += __builtin_popcountll(block->bits[w]);
+  }
+  if (offset % 64 != 0) {
+    rank += __builtin_popcountll(block->bits[offset / 64] << (64 - offset % 64));
+  }
+  return rank;
+}
+
+size_t sais_bitvector_memory(const struct sais_bitvector *bitvector) {
+  return (bitvector->len / SAIS_RANK_BITS + 1) * sizeof(struct sais_rank_block);
+}
+
+#define SAIS_FM_MAX_LEVELS 8
+
+/// FM-index: the Burrows-Wheeler transform in a wavelet matrix, and the suffix array sampled at every text position
+/// that is a multiple of sample_rate. Row i of the BWT is the character before the suffix sa[i], the row of the
+/// whole text, which has none, holds code 0 and is corrected for when counting. The symbols that occur in the text
+/// are coded 0 to alphabet_size - 1, so the matrix has a level per bit of the largest code, each a bitvector of
+/// len + 1 bits, and its size is about 1.14 bits per level and character, 2.3 bits for DNA, 8 bits for 128 symbols.
+struct sais_fm_index {
+    size_t len;
+    size_t sample_rate;
+    size_t primary;
+    size_t alphabet_size;
+    size_t num_levels;
+    /// Code of each byte, alphabet_size for bytes not in the text.
+    uint16_t codes[256];
+    /// First row whose suffix starts with each code.
+    size_t first_row[257];
+    /// Where the rows of each code start in the ordering after the last level of the matrix.
+    size_t bottom_start[256];
+    size_t zeros[SAIS_FM_MAX_LEVELS];
+    struct sais_bitvector levels[SAIS_FM_MAX_LEVELS];
+    /// Rows whose suffix is sampled, and their text positions divided by sample_rate, by rank in marked.
+    struct sais_bitvector marked;
+    uint32_t *samples;
+    /// Whether the CPU has a popcount instruction.
+    int popcnt;
+};
+
+/// Builds the FM-index of text from its suffix array, the text and sa are not needed afterwards.
+///
+/// \param sample_rate Text positions between suffix array samples, a locate walks the BWT up to sample_rate - 1
+/// steps per occurrence and the samples take 4 / sample_rate bytes per character, len / sample_rate must fit them.
+struct sais_fm_index *sais_fm_build(const char *text, size_t len, const sais_index_t *sa, size_t sample_rate) {
+  struct sais_fm_index *fm = calloc(1, sizeof(struct sais_fm_index));
+  fm->len = len;
+  fm->sample_rate = sample_rate;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  fm->popcnt = __builtin_cpu_supports("popcnt");
+#endif
+
+  size_t counts[256] = {0};
+  for (size_t i = 0; i < len; ++i) {
+    ++counts[(unsigned char) text[i]];
+  }
+  fm->first_row[0] = 1;
+  for (size_t c = 0; c < 256; ++c) {
+    if (counts[c] > 0) {
+      fm->codes[c] = fm->alphabet_size++;
+      fm->first_row[fm->alphabet_size] = fm->first_row[fm->alphabet_size - 1] + counts[c];
+    }
+  }
+  for (size_t c = 0; c < 256; ++c) {
+    fm->codes[c] = counts[c] > 0 ? fm->codes[c] : fm->alphabet_size;
+  }
+  fm->num_levels = 1;
+  while (fm->alphabet_size > ((size_t) 1 << fm->num_levels)) {
+    ++fm->num_levels;
+  }
+
+  // Codes of the BWT, stably partitioned by each bit from the highest, which is the order of the next level
+  uint8_t *bwt = malloc(len + 1);
+  uint8_t *next = malloc(len + 1);
+  for (size_t i = 0; i < len + 1; ++i) {
+    fm->primary = sa[i] == 0 ? i : fm->primary;
+    bwt[i] = sa[i] == 0 ? 0 : fm->codes[(unsigned char) text[sa[i] - 1]];
+  }
+  for (size_t l = 0; l < fm->num_levels; ++l) {
+    size_t shift = fm->num_levels - 1 - l;
+    sais_bitvector_init(fm->levels + l, len + 1);
+    for (size_t i = 0; i < len + 1; ++i) {
+      fm->zeros[l] += (bwt[i] >> shift & 1) == 0;
+    }
+    size_t zero = 0;
+    size_t one = fm->zeros[l];
+    for (size_t i = 0; i < len + 1; ++i) {
+      if (bwt[i] >> shift & 1) {
+        sais_bitvector_set(fm->levels + l, i);
+        next[one++] = bwt[i];
+      } else {
+        next[zero++] = bwt[i];
+      }
+    }
+    sais_bitvector_rank_blocks(fm->levels + l);
+    uint8_t *swap = bwt;
+    bwt = next;
+    next = swap;
+  }
+  for (size_t i = len + 1; i-- > 0;) {
+    fm->bottom_start[bwt[i]] = i;
+  }
+  free(next);
+  free(bwt);
+
+  sais_bitvector_init(&fm->marked, len + 1);
+  size_t num_samples = 0;
+  for (size_t i = 0; i < len + 1; ++i) {
+    if (sa[i] % sample_rate == 0) {
+      sais_bitvector_set(&fm->marked, i);
+      ++num_samples;
+    }
+  }
+  sais_bitvector_rank_blocks(&fm->marked);
+  fm->samples = malloc(num_samples * sizeof(uint32_t));
+  for (size_t i = 0, k = 0; i < len + 1; ++i) {
+    if (sa[i] % sample_rate == 0) {
+      fm->samples[k++] = sa[i] / sample_rate;
+    }
+  }
+  return fm;
+}
+
+// Row of the suffix one position before the suffix of row i, which must not be the primary row. The code of row i
+// is read on the way down the levels, and its occurrences in the first i rows are the position of row i after the
+// last level minus where the rows of the code start there.
+SAIS_INLINE size_t sais_fm_lf(const struct sais_fm_index *fm, size_t i) {
+  size_t row = i;
+  size_t code = 0;
+  for (size_t l = 0; l < fm->num_levels; ++l) {
+    size_t ones = sais_bitvector_rank(fm->levels + l, row);
+    size_t bit = sais_bitvector_get(fm->levels + l, row);
+    code = code << 1 | bit;
+    row = bit ? fm->zeros[l] + ones : row - ones;
+  }
+  return fm->first_row[code] + row - fm->bottom_start[code] - (code == 0 && i > fm->primary);
+}
+
+SAIS_INLINE size_t sais_fm_backward_search(const struct sais_fm_index *fm, const char *pattern, size_t *lo,
+                                           size_t *hi) {
+  *lo = 0;
+  *hi = fm->len + 1;
+  for (size_t k = strlen(pattern); k-- > 0 && *lo < *hi;) {
+    size_t code = fm->codes[(unsigned char) pattern[k]];
+    if (code == fm->alphabet_size) {
+      *hi = *lo;
+      break;
+    }
+    // Both ends go down the levels together, so their cache misses overlap
+    size_t lo_row = *lo;
+    size_t hi_row = *hi;
+    for (size_t l = 0; l < fm->num_levels; ++l) {
+      size_t lo_ones = sais_bitvector_rank(fm->levels + l, lo_row);
+      size_t hi_ones = sais_bitvector_rank(fm->levels + l, hi_row);
+      int bit = code >> (fm->num_levels - 1 - l) & 1;
+      lo_row = bit ? fm->zeros[l] + lo_ones : lo_row - lo_ones;
+      hi_row = bit ? fm->zeros[l] + hi_ones : hi_row - hi_ones;
+    }
+    size_t base = fm->first_row[code] - fm->bottom_start[code];
+    *lo = base + lo_row - (code == 0 && *lo > fm->primary);
+    *hi = base + hi_row - (code == 0 && *hi > fm->primary);
+  }
+  return *hi - *lo;
+}
+
+SAIS_INLINE size_t sais_fm_walk_to_sample(const struct sais_fm_index *fm, size_t i) {
+  size_t steps = 0;
+  while (!sais_bitvector_get(&fm->marked, i)) {
+    i = sais_fm_lf(fm, i);
+    ++steps;
+  }
+  return fm->samples[sais_bitvector_rank(&fm->marked, i)] * fm->sample_rate + steps;
+}
+
+// The queries are compiled twice, the popcount of a plain x86-64 build is a library call.
+size_t sais_fm_count_generic(const struct sais_fm_index *fm, const char *pattern, size_t *lo, size_t *hi) {
+  return sais_fm_backward_search(fm, pattern, lo, hi);
+}
+
+size_t sais_fm_locate_row_generic(const struct sais_fm_index *fm, size_t i) {
+  return sais_fm_walk_to_sample(fm, i);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("popcnt"))) size_t sais_fm_count_popcnt(const struct sais_fm_index *fm, const char *pattern,
+                                                               size_t *lo, size_t *hi) {
+  return sais_fm_backward_search(fm, pattern, lo, hi);
+}
+
+__attribute__((target("popcnt"))) size_t sais_fm_locate_row_popcnt(const struct sais_fm_index *fm, size_t i) {
+  return sais_fm_walk_to_sample(fm, i);
+}
+#endif
+
+/// Finds the rows [lo, hi) of the suffixes that start with pattern, the same range as sais_search_range, by backward
+/// search in O(m) ranks of log(alphabet_size) cache lines each.
+///
+/// \return hi - lo, the number of occurrences of pattern in the text.
+size_t sais_fm_count(const struct sais_fm_index *fm, const char *pattern, size_t *lo, size_t *hi) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (fm->popcnt) {
+    return sais_fm_count_popcnt(fm, pattern, lo, hi);
+  }
+#endif
+  return sais_fm_count_generic(fm, pattern, lo, hi);
+}
+
+/// Text position of the suffix of row i, sa[i], walking the BWT to the closest sample before it.
+size_t sais_fm_locate_row(const struct sais_fm_index *fm, size_t i) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (fm->popcnt) {
+    return sais_fm_locate_row_popcnt(fm, i);
+  }
+#endif
+  return sais_fm_locate_row_generic(fm, i);
+}
+
+/// Searches pattern like sais_search_for, and stores the positions of its occurrences in suffix array order.
+///
+/// \param positions if this is not NULL, it will point to a new array of the positions, to be freed by the caller.
+/// \return number of occurrences of pattern in the text.
+size_t sais_fm_locate(const struct sais_fm_index *fm, const char *pattern, size_t **positions) {
+  size_t lo, hi;
+  size_t occurrences = sais_fm_count(fm, pattern, &lo, &hi);
+  if (positions != 0 && occurrences > 0) {
+    *positions = malloc(occurrences * sizeof(size_t));
+    for (size_t i = lo; i < hi; ++i) {
+      (*positions)[i - lo] = sais_fm_locate_row(fm, i);
+    }
+  }
+  return occurrences;
+}
+
+size_t sais_fm_memory(const struct sais_fm_index *fm) {
+  size_t memory = sizeof(struct sais_fm_index) + sais_bitvector_memory(&fm->marked);
+  for (size_t l = 0; l < fm->num_levels; ++l) {
+    memory += sais_bitvector_memory(fm->levels + l);
+  }
+  return memory + sais_bitvector_rank(&fm->marked, fm->len + 1) * sizeof(uint32_t);
+}
+
+void sais_fm_free(struct sais_fm_index *fm) {
+  for (size_t l = 0; l < fm->num_levels; ++l) {
+    free(fm->levels[l].blocks);
+  }
+  free(fm->marked.blocks);
+  free(fm->samples);
+  free(fm);
+}
+
+#ifndef SAIS_NO_MAIN
+void test_search_for() {
+  const char *text = "ABANANABANDANA";
+  sais_index_t sa[] = {14, 13, 0, 6, 11, 4, 2, 8, 1, 7, 10, 12, 5, 3, 9};
+
+  const sais_index_t *positions = 0;
+  size_t occurrences = sais_search_for("ANA", text, sa, &positions);
+
+  assert(occurrences == 3);
+  for (size_t i = 0; i < occurrences; ++i) {
+    assert(strncmp("ANA", text + positions[i], 3) == 0);
+  }
+}
+
+// Compares the suffixes of an uint32_t text starting at a and b, a proper prefix is smaller.
+int compare_int_suffixes(const uint32_t *text, size_t len, size_t a, size_t b) {
+  while (a < len && b < len && text[a] == text[b]) {
+    ++a;
+    ++b;
+  }
+  if (a == len || b == len) {
+    return a == len ? (b == len ? 0 : -1) : 1;
+  }
+  return text[a] < text[b] ? -1 : 1;
+}
+
+void test_build_int() {
+  for (size_t pass = 0; pass < 32; ++pass) {
+    size_t len = rand() % 3000;
+    size_t alphabet_size = pass % 2 == 0 ? 1000 : 3;
+    uint32_t *text = malloc(sizeof(uint32_t) * (len + 1));
+    for (size_t i = 0; i < len; ++i) {
+      text[i] = rand() % alphabet_size;
+    }
+
+    size_t *sa = sais_build_int(text, len, alphabet_size);
+    assert(sa[0] == len);
+    for (size_t i = 0; i < len; ++i) {
+      assert(compare_int_suffixes(text, len, sa[i], sa[i + 1]) < 0);
+    }
+
+    free(sa);
+    free(text);
+  }
+}
+
+void test_many_lms_substrings() {
+  // Far more than 255 distinct LMS substrings, and bytes above 127.
+  size_t len = 20000;
+  char *text = malloc(len + 1);
+  text[len] = 0;
+  for (size_t i = 0; i < len; ++i) {
+    text[i] = (char) (1 + rand() % 255);
+  }
+
+  size_t *sa = sais_build(text);
+  for (size_t i = 0; i < len; ++i) {
+    // strcmp compares as unsigned char
+    assert(strcmp(text + sa[i], text + sa[i + 1]) < 0);
+  }
+
+  free(sa);
+  free(text);
+}
+
+void test_build_low_memory() {
+  const char *texts[] = {"", "a", "ACGTGCCTAGCCTACCGTGCC", "mississippi", "aaaaaaaaaaaaaaaa", "abababababababab"};
+  for (size_t t = 0; t < sizeof(texts) / sizeof(texts[0]); ++t) {
+    size_t len = strlen(texts[t]);
+    size_t *expect = sais_build(texts[t]);
+    sais_index_t *sa = sais_build_low_memory(texts[t], 1, len, 256);
+    for (size_t i = 0; i < len + 1; ++i) {
+      assert(sa[i] == expect[i]);
+    }
+    free(sa);
+    free(expect);
+  }
+
+  for (size_t pass = 0; pass < 64; ++pass) {
+    size_t len = rand() % 5000;
+    size_t alphabet_size = (size_t[]) {2, 4, 1000}[pass % 3];
+    uint32_t *text = malloc(sizeof(uint32_t) * (len + 1));
+    for (size_t i = 0; i < len; ++i) {
+      // every fourth pass repeats a short period, which recurses deeply
+      text[i] = pass % 4 == 3 ? i % 7 % alphabet_size : rand() % alphabet_size;
+    }
+
+    size_t *expect = sais_build_int(text, len, alphabet_size);
+    sais_index_t *sa = sais_build_low_memory(text, sizeof(uint32_t), len, alphabet_size);
+    for (size_t i = 0; i < len + 1; ++i) {
+      assert(sa[i] == expect[i]);
+    }
+
+    free(sa);
+    free(expect);
+    free(text);
+  }
+}
+
+void test_lcp() {
+  const char *texts[] = {"", "a", "ACGTGCCTAGCCTACCGTGCC", "mississippi", "aaaaaaaaaaaaaaaa", "abababababababab"};
+  for (size_t t = 0; t < sizeof(texts) / sizeof(texts[0]); ++t) {
+    size_t len = strlen(texts[t]);
+    sais_index_t *sa = sais_build_low_memory(texts[t], 1, len, 256);
+    struct sais_lcp *kasai = sais_lcp_kasai(texts[t], 1, len, sa, 1);
+    struct sais_lcp *phi = sais_lcp_phi(texts[t], 1, len, sa, 4);
+    assert(sais_lcp_at(kasai, 0) == 0);
+    for (size_t i = 1; i < len + 1; ++i) {
+      size_t expect = 0;
+      while (texts[t][sa[i - 1] + expect] != 0 && texts[t][sa[i - 1] + expect] == texts[t][sa[i] + expect]) {
+        ++expect;
+      }
+      assert(sais_lcp_at(kasai, i) == expect);
+      assert(sais_lcp_at(phi, i) == expect);
+    }
+    sais_lcp_free(phi);
+    sais_lcp_free(kasai);
+    free(sa);
+  }
+
+  // Long repeats overflow the byte entries
+  size_t len = 3000;
+  uint32_t *text = malloc(sizeof(uint32_t) * len);
+  for (size_t i = 0; i < len; ++i) {
+    text[i] = i < 1000 ? (uint32_t) (rand() % 3) : text[i % 700];
+  }
+  sais_index_t *sa = sais_build_low_memory(text, sizeof(uint32_t), len, 3);
+  struct sais_lcp *kasai = sais_lcp_kasai(text, sizeof(uint32_t), len, sa, 1);
+  struct sais_lcp *phi = sais_lcp_phi(text, sizeof(uint32_t), len, sa, 1);
+  assert(kasai->num_overflows > 0 && kasai->num_overflows == phi->num_overflows);
+  for (size_t i = 1; i < len + 1; ++i) {
+    size_t expect = sais_extend_lcp(text, sizeof(uint32_t), len, sa[i - 1], sa[i], 0);
+    assert(sais_lcp_at(kasai, i) == expect);
+    assert(sais_lcp_at(phi, i) == expect);
+  }
+  sais_lcp_free(phi);
+  sais_lcp_free(kasai);
+  free(sa);
+  free(text);
+}
+
+// Occurrences of pattern in text by comparing at every position.
+size_t count_occurrences(const char *pattern, const char *text) {
+  size_t count = 0;
+  size_t pattern_len = strlen(pattern);
+  for (const char *p = text; *p != 0; ++p) {
+    count += strncmp(pattern, p, pattern_len) == 0;
+  }
+  return count;
+}
+
+void test_search_range() {
+  for (size_t pass = 0; pass < 16; ++pass) {
+    size_t len = rand() % 2000;
+    char *text = malloc(len + 1);
+    text[len] = 0;
+    for (size_t i = 0; i < len; ++i) {
+      // some passes are all a's, some use bytes above 127
+      text[i] = pass % 4 == 0 ? 'a' : pass % 4 == 1 ? (char) (0xfe + rand() % 2) : 'a' + rand() % 3;
+    }
+    sais_index_t *sa = sais_build_low_memory(text, 1, len, 256);
+    struct sais_lcp *lcp = sais_lcp_phi(text, 1, len, sa, 1);
+    struct sais_lcp_lr *lcp_lr = sais_lcp_lr_build(lcp);
+
+    for (size_t k = 0; k < 64; ++k) {
+      char pattern[400];
+      size_t pattern_len = 1 + rand() % (k % 8 == 0 ? 399 : 6);
+      size_t start = len == 0 ? 0 : rand() % len;
+      for (size_t i = 0; i < pattern_len; ++i) {
+        // patterns from the text, with a few random characters
+        pattern[i] = start + i < len && rand() % 16 != 0 ? text[start + i] : text[rand() % (len + 1)];
+        if (pattern[i] == 0) {
+          pattern[i] = 'b';
+        }
+      }
+      pattern[pattern_len] = 0;
+
+      size_t expect = count_occurrences(pattern, text);
+      size_t lo, hi, lr_lo, lr_hi;
+      assert(sais_search_range(pattern, text, sa, 0, &lo, &hi) == expect);
+      assert(sais_search_range(pattern, text, sa, lcp_lr, &lr_lo, &lr_hi) == expect);
+      assert(lo == lr_lo && hi == lr_hi);
+      for (size_t i = lo; i < hi; ++i) {
+        assert(strncmp(pattern, text + sa[i], pattern_len) == 0);
+      }
+      assert(lo == 0 || strncmp(pattern, text + sa[lo - 1], pattern_len) > 0);
+      assert(hi == len + 1 || strncmp(pattern, text + sa[hi], pattern_len) < 0);
+    }
+
+    sais_lcp_lr_free(lcp_lr);
+    sais_lcp_free(lcp);
+    free(sa);
+    free(text);
+  }
+}
+
+void test_search_batch() {
+  size_t len = 5000;
+  char *text = malloc(len + 1);
+  text[len] = 0;
+  for (size_t i = 0; i < len; ++i) {
+    text[i] = i % 1000 < 500 ? "ab\xff"[rand() % 3] : text[i - 500];
+  }
+  sais_index_t *sa = sais_build_low_memory(text, 1, len, 256);
+  struct sais_kmer_table *tables[] = {0, sais_kmer_table_build(text, sa, 1), sais_kmer_table_build(text, sa, 2)};
+
+  size_t num_patterns = 2000;
+  char **patterns = malloc(num_patterns * sizeof(char *));
+  for (size_t k = 0; k < num_patterns; ++k) {
+    size_t pattern_len = k % 100 == 0 ? 0 : 1 + rand() % 12;
+    size_t start = rand() % len;
+    patterns[k] = malloc(pattern_len + 1);
+    for (size_t i = 0; i < pattern_len; ++i) {
+      patterns[k][i] = start + i < len && rand() % 8 != 0 ? text[start + i] : "abc"[rand() % 3];
+    }
+    patterns[k][pattern_len] = 0;
+  }
+
+  size_t *lo = malloc(num_patterns * sizeof(size_t));
+  size_t *hi = malloc(num_patterns * sizeof(size_t));
+  for (size_t t = 0; t < 3; ++t) {
+    sais_search_batch((const char *const *) patterns, num_patterns, text, sa, tables[t], lo, hi);
+    for (size_t k = 0; k < num_patterns; ++k) {
+      size_t expect_lo, expect_hi;
+      sais_search_range(patterns[k], text, sa, 0, &expect_lo, &expect_hi);
+      assert(hi[k] - lo[k] == expect_hi - expect_lo);
+      assert(lo[k] == hi[k] || lo[k] == expect_lo);
+    }
+  }
+
+  for (size_t k = 0; k < num_patterns; ++k) {
+    free(patterns[k]);
+  }
+  free(patterns);
+  free(hi);
+  free(lo);
+  sais_kmer_table_free(tables[2]);
+  sais_kmer_table_free(tables[1]);
+  free(sa);
+  free(text);
+}
+
+void test_build_parallel() {
+  // Longer than four parallel blocks, so that the LMS substrings are named on the threads too. Random symbols, runs
+  // of equal symbols across the block ends, and an alphabet too large for buckets per thread
+  size_t len = 4 * SAIS_PARALLEL_BLOCK + 1000;
+  uint32_t *text = malloc(sizeof(uint32_t) * len);
+  for (size_t pass = 0; pass < 3; ++pass) {
+    size_t alphabet_size = pass == 2 ? 1 << 16 : 300;
+    for (size_t i = 0; i < len; ++i) {
+      size_t run = (i + SAIS_PARALLEL_BLOCK / 4) / (SAIS_PARALLEL_BLOCK / 2);
+      text[i] = pass == 0 ? (uint32_t) (rand() % 4) : pass == 2 ? (uint32_t) (rand() % alphabet_size)
+                : run % 2 == 0 ? (uint32_t) run : (uint32_t) (rand() % 300);
+    }
+    sais_index_t *expect = sais_build_low_memory(text, sizeof(uint32_t), len, alphabet_size);
+    sais_index_t *sa = sais_build_parallel(text, sizeof(uint32_t), len, alphabet_size, 3);
+    assert(memcmp(sa, expect, (len + 1) * sizeof(sais_index_t)) == 0);
+    free(sa);
+    free(expect);
+  }
+  free(text);
+}
+
+void test_build_external() {
+  // 4 MB of text with NUL bytes for a 1 MB budget, DNA with repeats copied from earlier
+  size_t len = 4 << 20;
+  unsigned char *text = malloc(len);
+  for (size_t i = 0; i < len; ++i) {
+    text[i] = i > 100000 && rand() % 4 == 0 ? text[i - 100000 + rand() % 3] : rand() % 64 == 0 ? 0 : "ACGT"[rand() % 4];
+  }
+  FILE *text_file = tmpfile();
+  FILE *sa_file = tmpfile();
+  fwrite(text, 1, len, text_file);
+  fflush(text_file);
+
+  size_t sizes[] = {len, 1000};
+  for (size_t k = 0; k < 2; ++k) {
+    lseek(fileno(sa_file), 0, SEEK_SET);
+    int result = sais_build_external(fileno(text_file), sizes[k], fileno(sa_file), 1 << 20, "/tmp");
+    assert(result == 0);
+
+    sais_index_t *expect = sais_build_low_memory(text, 1, sizes[k], 256);
+    size_t *sa = malloc((sizes[k] + 1) * sizeof(size_t));
+    ssize_t got = pread(fileno(sa_file), sa, (sizes[k] + 1) * sizeof(size_t), 0);
+    assert(got == (ssize_t) ((sizes[k] + 1) * sizeof(size_t)));
+    for (size_t i = 0; i < sizes[k] + 1; ++i) {
+      assert(sa[i] == expect[i]);
+    }
+    free(sa);
+    free(expect);
+  }
+  // Budgets below the minimum are refused rather than exceeded, unless the text fits in them
+  assert(sais_build_external(fileno(text_file), len, fileno(sa_file), 16 << 10, "/tmp") == -1);
+  lseek(fileno(sa_file), 0, SEEK_SET);
+  assert(sais_build_external(fileno(text_file), 1000, fileno(sa_file), 16 << 10, "/tmp") == 0);
+
+  // Long runs of one byte do not split, a run of T's is found once the suffixes before it are written, and a text of
+  // NUL bytes at once. Both are sorted again by prefix doubling.
+  for (size_t k = 0; k < 2; ++k) {
+    size_t run_len = 140000;
+    for (size_t i = 0; i < run_len; ++i) {
+      text[i] = k == 0 ? "ACGT"[rand() % 4] : 0;
+      text[run_len + i] = k == 0 ? 'T' : 0;
+    }
+    rewind(text_file);
+    fwrite(text, 1, 2 * run_len, text_file);
+    fflush(text_file);
+    lseek(fileno(sa_file), 0, SEEK_SET);
+    int result = sais_build_external(fileno(text_file), 2 * run_len, fileno(sa_file), 1 << 20, "/tmp");
+    assert(result == 0);
+
+    sais_index_t *expect = sais_build_low_memory(text, 1, 2 * run_len, 256);
+    size_t *sa = malloc((2 * run_len + 1) * sizeof(size_t));
+    ssize_t got = pread(fileno(sa_file), sa, (2 * run_len + 1) * sizeof(size_t), 0);
+    assert(got == (ssize_t) ((2 * run_len + 1) * sizeof(size_t)));
+    for (size_t i = 0; i < 2 * run_len + 1; ++i) {
+      assert(sa[i] == expect[i]);
+    }
+    free(sa);
+    free(expect);
+  }
+
+  fclose(sa_file);
+  fclose(text_file);
+  free(text);
+}
+
+void test_index() {
+  // Random text with a repeat long enough to overflow byte LCP entries
+  size_t len = 20000;
+  char *text = malloc(len + 1);
+  for (size_t i = 0; i < len; ++i) {
+    text[i] = i >= 10000 && i < 11000 ? text[i - 5000] : "ACGT"[rand() % 4];
+  }
+  text[len] = 0;
+  sais_index_t *sa = sais_build_low_memory(text, 1, len, 256);
+  struct sais_lcp *lcp = sais_lcp_phi(text, 1, len, sa, 1);
+  assert(lcp->num_overflows > 0);
+
+  size_t widths[] = {4, 5, 8};
+  for (size_t w = 0; w < 3; ++w) {
+    FILE *file = tmpfile();
+    int result = sais_index_write(fileno(file), text, len, sa, widths[w], w == 1 ? lcp : 0);
+    assert(result == 0);
+    struct sais_index *index = sais_index_open(fileno(file), 1);
+    assert(index != 0 && index->len == len && index->header->alphabet_size == 'T' + 1);
+    assert(strcmp(index->text, text) == 0);
+    for (size_t i = 0; i < len + 1; ++i) {
+      assert(sais_index_sa(index, i) == sa[i]);
+    }
+    assert(index->lcp.width == (w == 1 ? 1 : 0));
+    for (size_t i = 0; i < len + 1 && w == 1; ++i) {
+      assert(sais_lcp_at(&index->lcp, i) == sais_lcp_at(lcp, i));
+    }
+    for (size_t k = 0; k < 1000; ++k) {
+      char pattern[8] = {0};
+      size_t start = rand() % len;
+      strncpy(pattern, text + start, k % 7);
+      size_t lo, hi, expect_lo, expect_hi;
+      size_t expect = sais_search_range(pattern, text, sa, 0, &expect_lo, &expect_hi);
+      assert(sais_index_search_range(index, pattern, &lo, &hi) == expect);
+      assert(lo == expect_lo && hi == expect_hi);
+    }
+    sais_index_close(index);
+
+    // A flipped byte fails the checksum, and is only found when verifying
+    char byte;
+    pread(fileno(file), &byte, 1, sizeof(struct sais_index_header) + 100);
+    byte ^= 1;
+    pwrite(fileno(file), &byte, 1, sizeof(struct sais_index_header) + 100);
+    assert(sais_index_open(fileno(file), 1) == 0);
+    index = sais_index_open(fileno(file), 0);
+    assert(index != 0);
+    sais_index_close(index);
+    // So is a truncated file, without reading it
+    result = ftruncate(fileno(file), sizeof(struct sais_index_header) + 8);
+    assert(result == 0 && sais_index_open(fileno(file), 0) == 0);
+    fclose(file);
+  }
+
+  // Too long for 4-byte entries, checked before reading sa
+  assert(sais_index_write(-1, text, (size_t) 1 << 32, sa, 4, 0) == -1);
+  sais_lcp_free(lcp);
+  free(sa);
+  free(text);
+}
+
+void test_fm_index() {
+  const char *texts[] = {"", "a", "ABANANABANDANA", "mississippi", "aaaaaaaaaaaaaaaa", "abababababababab"};
+  const char *patterns[] = {"", "a", "A", "ANA", "ssi", "aaa", "abab", "x", "ippi"};
+  for (size_t t = 0; t < sizeof(texts) / sizeof(texts[0]); ++t) {
+    size_t len = strlen(texts[t]);
+    sais_index_t *sa = sais_build_low_memory(texts[t], 1, len, 256);
+    struct sais_fm_index *fm = sais_fm_build(texts[t], len, sa, 3);
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); ++p) {
+      size_t lo, hi, expect_lo, expect_hi;
+      size_t expect = sais_search_range(patterns[p], texts[t], sa, 0, &expect_lo, &expect_hi);
+      assert(sais_fm_count(fm, patterns[p], &lo, &hi) == expect);
+      assert(expect == 0 || (lo == expect_lo && hi == expect_hi));
+    }
+    for (size_t i = 0; i < len + 1; ++i) {
+      assert(sais_fm_locate_row(fm, i) == sa[i]);
+    }
+    sais_fm_free(fm);
+    free(sa);
+  }
+
+  // Every byte value, so codes and levels are full, and random patterns from the text
+  size_t len = 100000;
+  char *text = malloc(len + 1);
+  for (size_t i = 0; i < len; ++i) {
+    text[i] = (char) (i < 255 ? i + 1 : i % 1000 < 500 ? (size_t) "ACGT"[rand() % 4] : (size_t) (1 + rand() % 255));
+  }
+  text[len] = 0;
+  sais_index_t *sa = sais_build_low_memory(text, 1, len, 256);
+  struct sais_fm_index *fm = sais_fm_build(text, len, sa, 32);
+  assert(fm->alphabet_size == 255 && fm->num_levels == 8);
+  for (size_t k = 0; k < 1000; ++k) {
+    char pattern[8] = {0};
+    strncpy(pattern, text + rand() % len, 1 + k % 7);
+    const sais_index_t *expect_positions = 0;
+    size_t *positions = 0;
+    size_t expect = sais_search_for(pattern, text, sa, &expect_positions);
+    assert(sais_fm_locate(fm, pattern, &positions) == expect);
+    for (size_t i = 0; i < expect; ++i) {
+      assert(positions[i] == expect_positions[i]);
+    }
+    free(positions);
+  }
+  sais_fm_free(fm);
+  free(sa);
+  free(text);
+}
+
 int main() {
   test_search_for();
+  test_fm_index();
+  test_index();
+  test_build_external();
+  test_build_parallel();
+  test_search_batch();
+  test_search_range();
+  test_lcp();
+  test_build_low_memory();
+  test_build_int();
+  test_many_lms_substrings();
   const char *text = "ACGTGCCTAGCCTACCGTGCC";
   size_t *sa = sais_build(text);
   print_sa(sa, strlen(text));
@@ -264,7 +3146,9 @@ int main() {
       assert(strcmp(text + sa[i], text + sa[i + 1]) < 0);
     }
     
+    free(seen);
     free(sa);
     free(text);
   }
 }
+#endif
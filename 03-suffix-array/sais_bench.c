@@ -0,0 +1,223 @@
+// Benchmarks for the suffix array and its LCP array.
+//
+// Usage: sais_bench [text sizes in MB...], build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers. Each LCP
+// construction runs in a child process, so the peak RSS it reports is its own: the text, the suffix array and
+// everything the construction allocates.
+
+#define SAIS_NO_MAIN
+#include "sais.c"
+
+#include "../bench.h"
+#include <unistd.h>
+#include <sys/wait.h>
+
+enum bench_text {
+    BENCH_DNA,
+    BENCH_REPEATS,
+    BENCH_NUM_TEXTS
+};
+
+const char *bench_text_names[] = {"dna", "repeats"};
+
+// Random ACGT, or 64 KB chunks that each copy an earlier chunk with 1% of the characters changed, whose long
+// common prefixes overflow the byte LCP entries.
+void bench_generate(char *text, size_t len, enum bench_text kind) {
+  size_t state = 0x2545f4914f6cdd1dULL + kind;
+  size_t chunk = 1 << 16;
+  for (size_t i = 0; i < len; ++i) {
+    if (kind == BENCH_REPEATS && i >= chunk) {
+      if (i % chunk == 0) {
+        state ^= i;
+      }
+      size_t source = (bench_random(&state) % (i / chunk)) * chunk + i % chunk;
+      text[i] = bench_random(&state) % 100 == 0 ? "ACGT"[bench_random(&state) % 4] : text[source];
+    } else {
+      text[i] = "ACGT"[bench_random(&state) % 4];
+    }
+  }
+  text[len] = 0;
+}
+
+typedef struct sais_lcp *(*bench_lcp_t)(const void *, size_t, size_t, const sais_index_t *, size_t);
+
+void bench_lcp(const char *name, bench_lcp_t build, const char *text, size_t len, const sais_index_t *sa,
+               size_t width) {
+  fflush(stdout);
+  if (fork() == 0) {
+    double start = now_seconds();
+    struct sais_lcp *lcp = build(text, 1, len, sa, width);
+    double seconds = now_seconds() - start;
+    printf("%-6s %zu-byte %10.2f s %10.1f MB/s %10.0f MB peak %10zu overflows\n", name, width, seconds,
+           len / 1e6 / seconds, peak_rss_mb(), lcp->num_overflows);
+    sais_lcp_free(lcp);
+    exit(0);
+  }
+  wait(0);
+}
+
+// Parallel builds from 1 to 64 threads, each checked against the serial suffix array.
+void bench_threads(const char *text, size_t len, const sais_index_t *sa) {
+  double serial = 0;
+  for (size_t num_threads = 1; num_threads <= 64; num_threads *= 2) {
+    double start = now_seconds();
+    sais_index_t *parallel = sais_build_parallel(text, 1, len, 256, num_threads);
+    double seconds = now_seconds() - start;
+    serial = num_threads == 1 ? seconds : serial;
+    if (memcmp(parallel, sa, (len + 1) * sizeof(sais_index_t)) != 0) {
+      printf("%zu threads: suffix array differs from the serial build\n", num_threads);
+      exit(1);
+    }
+    printf("%2zu threads %10.2f s %10.1f MB/s %8.2fx\n", num_threads, seconds, len / 1e6 / seconds,
+           serial / seconds);
+    free(parallel);
+  }
+}
+
+// 10^5 patterns of 8 to 32 characters from the text, searched one by one and as a batch.
+void bench_search(const char *text, size_t len, const sais_index_t *sa) {
+  size_t num_patterns = 100000;
+  char **patterns = malloc(num_patterns * sizeof(char *));
+  size_t state = 0x9e3779b97f4a7c15ULL;
+  for (size_t k = 0; k < num_patterns; ++k) {
+    size_t pattern_len = 8 + bench_random(&state) % 25;
+    patterns[k] = malloc(pattern_len + 1);
+    memcpy(patterns[k], text + bench_random(&state) % (len - pattern_len), pattern_len);
+    patterns[k][pattern_len] = 0;
+  }
+  size_t *lo = malloc(num_patterns * sizeof(size_t));
+  size_t *hi = malloc(num_patterns * sizeof(size_t));
+
+  double start = now_seconds();
+  size_t occurrences = 0;
+  for (size_t k = 0; k < num_patterns; ++k) {
+    occurrences += sais_search_range(patterns[k], text, sa, 0, lo + k, hi + k);
+  }
+  printf("search one by one   %10.0f ns/pattern %10zu occurrences\n",
+         (now_seconds() - start) * 1e9 / num_patterns, occurrences);
+
+  for (size_t k = 0; k <= 2; ++k) {
+    struct sais_kmer_table *table = k == 0 ? 0 : sais_kmer_table_build(text, sa, k);
+    start = now_seconds();
+    sais_search_batch((const char *const *) patterns, num_patterns, text, sa, table, lo, hi);
+    double seconds = now_seconds() - start;
+    occurrences = 0;
+    for (size_t i = 0; i < num_patterns; ++i) {
+      occurrences += hi[i] - lo[i];
+    }
+    printf("search batch, k = %zu %10.0f ns/pattern %10zu occurrences\n", k, seconds * 1e9 / num_patterns,
+           occurrences);
+    if (table != 0) {
+      sais_kmer_table_free(table);
+    }
+  }
+
+  for (size_t k = 0; k < num_patterns; ++k) {
+    free(patterns[k]);
+  }
+  free(patterns);
+  free(hi);
+  free(lo);
+}
+
+// Index files at each width, opened with and without the checksum, and searched for the same patterns.
+void bench_index(const char *text, size_t len, const sais_index_t *sa) {
+  size_t widths[] = {4, 5, 8};
+  for (size_t w = 0; w < 3; ++w) {
+    FILE *file = tmpfile();
+    if (sais_index_write(fileno(file), text, len, sa, widths[w], 0) != 0) {
+      printf("index: cannot write %zu-byte entries\n", widths[w]);
+      fclose(file);
+      continue;
+    }
+    double start = now_seconds();
+    struct sais_index *index = sais_index_open(fileno(file), 0);
+    double open_seconds = now_seconds() - start;
+    sais_index_close(index);
+    start = now_seconds();
+    index = sais_index_open(fileno(file), 1);
+    double verify_seconds = now_seconds() - start;
+
+    size_t state = 0x9e3779b97f4a7c15ULL;
+    size_t num_patterns = 100000;
+    size_t occurrences = 0;
+    start = now_seconds();
+    for (size_t k = 0; k < num_patterns; ++k) {
+      char pattern[33];
+      size_t pattern_len = 8 + bench_random(&state) % 25;
+      memcpy(pattern, text + bench_random(&state) % (len - pattern_len), pattern_len);
+      pattern[pattern_len] = 0;
+      size_t lo, hi;
+      occurrences += sais_index_search_range(index, pattern, &lo, &hi);
+    }
+    printf("index %zu-byte %10.3f ms open %10.1f ms verified %10.0f ns/pattern %10zu occurrences\n", widths[w],
+           open_seconds * 1e3, verify_seconds * 1e3, (now_seconds() - start) * 1e9 / num_patterns, occurrences);
+    sais_index_close(index);
+    fclose(file);
+  }
+}
+
+// FM-index with a sample every 32 positions, its size against the text, and counts and locates of the patterns.
+void bench_fm(const char *text, size_t len, const sais_index_t *sa) {
+  double start = now_seconds();
+  struct sais_fm_index *fm = sais_fm_build(text, len, sa, 32);
+  printf("fm-index built in %.2f s, %.3f bytes/character\n", now_seconds() - start, (double) sais_fm_memory(fm) / len);
+
+  size_t num_patterns = 100000;
+  char (*patterns)[33] = malloc(num_patterns * sizeof(char[33]));
+  size_t state = 0x9e3779b97f4a7c15ULL;
+  for (size_t k = 0; k < num_patterns; ++k) {
+    size_t pattern_len = 8 + bench_random(&state) % 25;
+    memcpy(patterns[k], text + bench_random(&state) % (len - pattern_len), pattern_len);
+    patterns[k][pattern_len] = 0;
+  }
+  size_t occurrences = 0;
+  start = now_seconds();
+  for (size_t k = 0; k < num_patterns; ++k) {
+    size_t lo, hi;
+    occurrences += sais_fm_count(fm, patterns[k], &lo, &hi);
+  }
+  printf("fm count     %10.0f ns/pattern %10zu occurrences\n", (now_seconds() - start) * 1e9 / num_patterns,
+         occurrences);
+  start = now_seconds();
+  for (size_t k = 0; k < num_patterns; ++k) {
+    size_t *positions = 0;
+    sais_fm_locate(fm, patterns[k], &positions);
+    free(positions);
+  }
+  printf("fm locate    %10.0f ns/occurrence\n", (now_seconds() - start) * 1e9 / occurrences);
+  free(patterns);
+  sais_fm_free(fm);
+}
+
+int main(int argc, char *argv[]) {
+  size_t default_sizes[] = {10, 100};
+  size_t num_sizes = argc > 1 ? (size_t) argc - 1 : 2;
+
+  for (size_t s = 0; s < num_sizes; ++s) {
+    size_t len = (argc > 1 ? strtoull(argv[s + 1], 0, 10) : default_sizes[s]) * 1000000;
+    for (size_t t = 0; t < BENCH_NUM_TEXTS; ++t) {
+      char *text = malloc(len + 1);
+      bench_generate(text, len, t);
+
+      double start = now_seconds();
+      sais_index_t *sa = sais_build_low_memory(text, 1, len, 256);
+      printf("===> %s, %zu MB, suffix array in %.2f s\n", bench_text_names[t], len / 1000000,
+             now_seconds() - start);
+
+      bench_search(text, len, sa);
+      bench_index(text, len, sa);
+      bench_fm(text, len, sa);
+      if (t == BENCH_DNA) {
+        bench_threads(text, len, sa);
+      }
+      bench_lcp("kasai", sais_lcp_kasai, text, len, sa, 1);
+      bench_lcp("kasai", sais_lcp_kasai, text, len, sa, 4);
+      bench_lcp("phi", sais_lcp_phi, text, len, sa, 1);
+      bench_lcp("phi", sais_lcp_phi, text, len, sa, 4);
+
+      free(sa);
+      free(text);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,204 @@
+// Benchmark and validation harness for the suffix array construction.
+//
+// Usage: sais_harness [text sizes in MB...], 1, 10, 100 and 1000 by default, build with -DCMAKE_BUILD_TYPE=Release
+// for meaningful numbers, and with -DSAIS_INDEX_32=ON for texts of hundreds of MB. A text takes its length, its
+// suffix array and an eighth of its length for the check, 5.1 GB for 1000 MB with 32-bit entries and 9.1 GB without,
+// and sizes that do not fit in physical memory are skipped. Every text is generated from a fixed seed and built in a
+// child process, so the peak RSS it reports is the text and the build alone. Every suffix array is checked in linear
+// time, the harness exits with 1 on the first one that is wrong.
+
+#define SAIS_NO_MAIN
+#include "sais.c"
+
+#include "../bench.h"
+#include <unistd.h>
+#include <sys/wait.h>
+
+enum harness_text {
+    HARNESS_DNA,
+    HARNESS_ENGLISH,
+    HARNESS_RUN,
+    HARNESS_FIBONACCI,
+    HARNESS_BINARY,
+    HARNESS_NUM_TEXTS
+};
+
+const char *harness_text_names[] = {"dna", "english", "aaaa", "fibonacci", "binary"};
+
+const char *harness_words[] = {"the", "of", "and", "to", "a", "in", "is", "that", "for", "it", "as", "was", "with",
+                               "be", "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which",
+                               "but", "have", "an", "they", "you", "were", "her", "all", "she", "there", "would",
+                               "their", "we", "him", "been", "has", "when", "who", "will", "more", "no", "if", "out",
+                               "suffix", "array", "induced", "sorting", "bucket", "structure", "minimum", "query"};
+
+void harness_generate(unsigned char *text, size_t len, enum harness_text kind) {
+  size_t state = 0x2545f4914f6cdd1dULL + kind;
+  size_t num_words = sizeof(harness_words) / sizeof(harness_words[0]);
+  size_t i = 0;
+  switch (kind) {
+    case HARNESS_DNA:
+      for (; i < len; ++i) {
+        text[i] = "ACGT"[bench_random(&state) % 4];
+      }
+      break;
+    case HARNESS_ENGLISH:
+      // Words drawn with roughly Zipf frequencies, the minimum of two draws favours the front of the list
+      for (int sentence_start = 1; i < len;) {
+        size_t a = bench_random(&state) % num_words;
+        size_t b = bench_random(&state) % num_words;
+        const char *word = harness_words[a < b ? a : b];
+        for (size_t k = 0; word[k] != 0 && i < len; ++k) {
+          text[i++] = k == 0 && sentence_start ? word[k] - 'a' + 'A' : word[k];
+        }
+        sentence_start = bench_random(&state) % 16 == 0;
+        if (sentence_start && i < len) {
+          text[i++] = '.';
+        }
+        if (i < len) {
+          text[i++] = ' ';
+        }
+      }
+      break;
+    case HARNESS_RUN:
+      memset(text, 'a', len);
+      break;
+    case HARNESS_FIBONACCI:
+      // Each Fibonacci word is the one before followed by the one before that, which is also its prefix
+      for (size_t prev = 1, end = 2; i < len; ++i) {
+        if (i >= end) {
+          size_t next = end + prev;
+          prev = end;
+          end = next;
+        }
+        text[i] = i == 0 ? 'a' : i == 1 ? 'b' : text[i - prev];
+      }
+      break;
+    default:
+      for (; i < len; ++i) {
+        text[i] = bench_random(&state);
+      }
+      break;
+  }
+}
+
+// Checks that sa is the suffix array of text in O(len) time (Burkhardt and Kärkkäinen) with a bit per suffix: it must
+// be a permutation of 0 to len starting with the empty suffix and ordered by first characters, and the suffixes with
+// the same first character must be in the order of the suffixes one position later. A scan of sa finds the latter in
+// increasing order, so each one moved a position back must be the next suffix of its character, as in induced sorting.
+int harness_check(const unsigned char *text, size_t len, const sais_index_t *sa) {
+  uint64_t *seen = calloc(len / 64 + 1, sizeof(uint64_t));
+  int ok = sa[0] == len;
+  for (size_t i = 0; i < len + 1 && ok; ++i) {
+    ok = sa[i] <= len && (seen[sa[i] / 64] >> sa[i] % 64 & 1) == 0 && (i < 2 || text[sa[i - 1]] <= text[sa[i]]);
+    seen[sa[i] / 64] |= ok ? 1ULL << sa[i] % 64 : 0;
+  }
+  free(seen);
+
+  size_t next[256] = {0};
+  for (size_t i = 0; i < len; ++i) {
+    ++next[text[i]];
+  }
+  for (size_t c = 0, start = 1; c < 256; ++c) {
+    size_t count = next[c];
+    next[c] = start;
+    start += count;
+  }
+  for (size_t i = 0; i < len + 1 && ok; ++i) {
+    if (sa[i] > 0) {
+      ok = sa[next[text[sa[i] - 1]]++] == sa[i] - 1;
+    }
+  }
+  return ok;
+}
+
+// Generates and builds one text in a child process, returns whether its suffix array checked out.
+int harness_run(enum harness_text kind, size_t len) {
+  fflush(stdout);
+  pid_t child = fork();
+  if (child == 0) {
+    unsigned char *text = malloc(len + 1);
+    harness_generate(text, len, kind);
+    text[len] = 0;
+
+    // The low-memory build, with its recursion depth
+    double start = now_seconds();
+    sais_index_t *sa = malloc((len + 1) * sizeof(sais_index_t));
+    size_t num_levels = 0;
+    if (len == 0) {
+      sa[0] = 0;
+    } else {
+      num_levels = sais_build_level(text, 1, len, 256, sa, NULL, 0, 1);
+    }
+    double seconds = now_seconds() - start;
+    double peak = peak_rss_mb();
+
+    start = now_seconds();
+    int ok = harness_check(text, len, sa);
+    printf("%-10s %8zu MB %10.2f s %10.1f MB/s %10.0f MB peak %6zu levels   check %6.2f s %s\n",
+           harness_text_names[kind], len / 1000000, seconds, len / 1e6 / seconds, peak, num_levels,
+           now_seconds() - start, ok ? "ok" : "WRONG");
+    free(sa);
+    free(text);
+    exit(ok ? 0 : 1);
+  }
+  int status;
+  waitpid(child, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Small texts of every kind, whose suffix arrays the checker must accept, and must reject with two entries swapped.
+int harness_self_test() {
+  unsigned char text[1001];
+  for (size_t t = 0; t < HARNESS_NUM_TEXTS; ++t) {
+    for (size_t len = 0; len < 1000; len = len * 3 + 1) {
+      harness_generate(text, len, t);
+      text[len] = 0;
+      sais_index_t *sa = sais_build_low_memory(text, 1, len, 256);
+      if (!harness_check(text, len, sa)) {
+        return 0;
+      }
+      if (len > 2) {
+        sais_index_t swap = sa[1];
+        sa[1] = sa[2];
+        sa[2] = swap;
+        if (harness_check(text, len, sa)) {
+          return 0;
+        }
+      }
+      free(sa);
+    }
+  }
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  size_t default_sizes[] = {1, 10, 100, 1000};
+  size_t num_sizes = argc > 1 ? (size_t) argc - 1 : 4;
+  size_t memory = (size_t) sysconf(_SC_PHYS_PAGES) * (size_t) sysconf(_SC_PAGESIZE);
+
+  if (!harness_self_test()) {
+    printf("the checker disagrees with the build on small texts\n");
+    return 1;
+  }
+
+  for (size_t s = 0; s < num_sizes; ++s) {
+    size_t len = (argc > 1 ? strtoull(argv[s + 1], 0, 10) : default_sizes[s]) * 1000000;
+    if (len >= SAIS_EMPTY) {
+      printf("%zu MB does not fit in the suffix array entries\n", len / 1000000);
+      return 1;
+    }
+    size_t needed = len + (len + 1) * sizeof(sais_index_t) + len / 8;
+    if (needed > memory) {
+      printf("%zu MB skipped, it needs %zu MB of the %zu MB of memory\n", len / 1000000, needed / 1000000,
+             memory / 1000000);
+      continue;
+    }
+    for (size_t t = 0; t < HARNESS_NUM_TEXTS; ++t) {
+      if (!harness_run(t, len)) {
+        return 1;
+      }
+    }
+  }
+  printf("every suffix array checks out\n");
+  return 0;
+}
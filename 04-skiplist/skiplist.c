@@ -5,47 +5,145 @@
 #import <stdlib.h>
 #import <stdio.h>
 #include <assert.h>
+#include <stdint.h>
 
+#define SKIPLIST_INLINE_LINKS 3
+#define SKIPLIST_SLAB_NODES 1024
+// Every layer has at most half of the nodes of the layer below, so a list of less than 2^63 nodes is not taller, and
+// the update vector of insert and remove fits on the stack.
+#define SKIPLIST_MAX_HEIGHT 64
+
+/// The links of a node are followed by their widths, the number of layer 1 links each spans, where the last link of a
+/// layer spans to a virtual node after the last one. A list holds less than 2^32 values.
 struct Skiplist {
-    size_t height;
-    size_t capacity;
-    struct Skiplist **links; // links to the next node
+    struct Skiplist **links; // links to the next node, inline_links or an overflow block for taller nodes
+    uint32_t height;
+    uint32_t capacity;
     int value;
+    struct Skiplist *inline_links[];
+};
+
+// A node with its inline links and widths, a cache line.
+#define SKIPLIST_NODE_SIZE \
+  ((sizeof(struct Skiplist) + SKIPLIST_INLINE_LINKS * (sizeof(struct Skiplist *) + sizeof(uint32_t)) + 63) / 64 * 64)
+
+uint32_t *skiplist_widths(struct Skiplist *node) {
+  return (uint32_t *) (node->links + node->capacity);
+}
+
+/// Nodes are carved from slabs of SKIPLIST_SLAB_NODES, the removed ones are kept in a free list threaded through
+/// their links. The pool of a list is allocated right before its head.
+struct skiplist_pool {
+    unsigned char *slabs; // the newest slab, each slab starts with a pointer to the one before
+    size_t num_used; // nodes handed out from the newest slab
+    struct Skiplist *free_nodes;
 };
 
+struct Skiplist *skiplist_node_new(struct skiplist_pool *pool, int value) {
+  struct Skiplist *node = pool->free_nodes;
+  if (node != 0) {
+    pool->free_nodes = (struct Skiplist *) node->links;
+  } else {
+    if (pool->slabs == 0 || pool->num_used == SKIPLIST_SLAB_NODES) {
+      // The first cache line of a slab links it to the one before
+      unsigned char *slab = aligned_alloc(64, (SKIPLIST_SLAB_NODES + 1) * SKIPLIST_NODE_SIZE);
+      *(unsigned char **) slab = pool->slabs;
+      pool->slabs = slab;
+      pool->num_used = 0;
+    }
+    node = (struct Skiplist *) (pool->slabs + (++pool->num_used) * SKIPLIST_NODE_SIZE);
+  }
+  node->links = node->inline_links;
+  node->height = 1;
+  node->capacity = SKIPLIST_INLINE_LINKS;
+  node->value = value;
+  return node;
+}
+
+void skiplist_node_free(struct skiplist_pool *pool, struct Skiplist *node) {
+  if (node->links != node->inline_links) {
+    free(node->links);
+  }
+  node->links = (struct Skiplist **) pool->free_nodes;
+  pool->free_nodes = node;
+}
+
+struct skiplist_pool *skiplist_pool(struct Skiplist *list) {
+  return (struct skiplist_pool *) list - 1;
+}
+
 struct Skiplist *skiplist_new() {
-  struct Skiplist *head = malloc(sizeof(struct Skiplist));
+  struct skiplist_pool *pool = calloc(1, sizeof(struct skiplist_pool) + SKIPLIST_NODE_SIZE);
+  struct Skiplist *head = (struct Skiplist *) (pool + 1);
+  head->links = head->inline_links;
   head->height = 1;
-  head->capacity = 1;
+  head->capacity = SKIPLIST_INLINE_LINKS;
   head->value = 0;
-  head->links = malloc(head->capacity * sizeof(struct Skiplist *));
+  head->links[0] = 0;
+  skiplist_widths(head)[0] = 1;
 
   return head;
 }
 
+// Moves the links and widths of a node to a block of the given capacity, inline_links when it is the inline capacity.
+void skiplist_move_links(struct Skiplist *list, uint32_t capacity) {
+  struct Skiplist **links = capacity == SKIPLIST_INLINE_LINKS
+                            ? list->inline_links
+                            : malloc(capacity * (sizeof(struct Skiplist *) + sizeof(uint32_t)));
+  uint32_t *widths = (uint32_t *) (links + capacity);
+  uint32_t *old_widths = skiplist_widths(list);
+  for (size_t i = 0; i < list->height; ++i) {
+    links[i] = list->links[i];
+    widths[i] = old_widths[i];
+  }
+  if (list->links != list->inline_links) {
+    free(list->links);
+  }
+  list->links = links;
+  list->capacity = capacity;
+}
+
 void skiplist_increase_height(struct Skiplist *list) {
   if (list->height == list->capacity) {
-    list->capacity *= 2;
-    list->links = realloc(list->links, list->capacity * sizeof(struct Skiplist *));
+    skiplist_move_links(list, list->capacity * 2);
   }
   ++list->height;
 }
 
+// Moves the links of a node back inline once it is short enough, so only nodes taller than the inline links have an
+// overflow block.
+void skiplist_decrease_height(struct Skiplist *list) {
+  --list->height;
+  if (list->height == SKIPLIST_INLINE_LINKS && list->links != list->inline_links) {
+    skiplist_move_links(list, SKIPLIST_INLINE_LINKS);
+  }
+}
+
+/// Frees the list with its slabs, walking only the nodes with overflow blocks, which are the ones in the layer above
+/// the inline links.
 void skiplist_free(struct Skiplist *list) {
-  struct Skiplist *next = 0;
-  // The layer 1 is assumed to have all the nodes
-  while (list != 0) {
-    next = list->links[0];
+  if (list->height > SKIPLIST_INLINE_LINKS) {
+    for (struct Skiplist *node = list->links[SKIPLIST_INLINE_LINKS]; node != 0;) {
+      struct Skiplist *next = node->links[SKIPLIST_INLINE_LINKS];
+      free(node->links);
+      node = next;
+    }
+  }
+  for (unsigned char *slab = skiplist_pool(list)->slabs; slab != 0;) {
+    unsigned char *next = *(unsigned char **) slab;
+    free(slab);
+    slab = next;
+  }
+  if (list->links != list->inline_links) {
     free(list->links);
-    free(list);
-    list = next;
   }
+  free(skiplist_pool(list));
 }
 
-/// Search the skiplist and return the node in each layer which is the last node which value is larger than val.
-struct Skiplist **skiplist_locate(struct Skiplist *list, int val) {
-  struct Skiplist **vec = malloc(sizeof(struct Skiplist *) * list->height);
-
+/// Search the skiplist and fill vec with the node in each layer which is the last node which value is larger than val.
+/// vec needs list->height entries, at most SKIPLIST_MAX_HEIGHT.
+struct Skiplist **skiplist_locate(struct Skiplist *list, int val, struct Skiplist **vec) {
+  assert(list->height <= SKIPLIST_MAX_HEIGHT);
   struct Skiplist *node = list;
   for (size_t i = list->height; i > 0; --i) {
     while (node->links[i - 1] != 0 && node->links[i - 1]->value < val) {
@@ -72,7 +170,121 @@ struct Skiplist *skiplist_search(struct Skiplist *list, int val) {
   return 0;
 }
 
-// Distance from start to end in the specific layer
+// Towers, nodes in layer 2, that a scan prefetches ahead of itself. There are one to four nodes per tower.
+#define SKIPLIST_PREFETCH_TOWERS 8
+
+/// Position of an ordered scan. Nodes of layer 1 can only be found one after another, so the scan follows the links of
+/// layer 2 ahead of itself and prefetches the towers there and the first nodes after them, which overlaps the cache
+/// misses of several groups of nodes. The walk is pipelined: a tower is prefetched when it is reached, and its link
+/// is only followed and its first node prefetched at the next step, once its line has had a node's time to arrive.
+/// Any insert or remove invalidates the cursors of the list.
+struct skiplist_cursor {
+    struct Skiplist *node; // the current node, NULL past the end
+    struct Skiplist *ahead; // a tower at or after node, NULL past the end
+    size_t lead; // towers from node up to but not including ahead
+};
+
+// Gains one tower of lead per node scanned, towers are passed once every two to four nodes so the lead grows up to
+// SKIPLIST_PREFETCH_TOWERS. The tower left behind was prefetched a step earlier, reading its links now is a hit.
+void skiplist_cursor_prefetch(struct skiplist_cursor *cursor) {
+  if (cursor->ahead != 0 && cursor->lead < SKIPLIST_PREFETCH_TOWERS) {
+    struct Skiplist *tower = cursor->ahead;
+    cursor->ahead = tower->links[1];
+    ++cursor->lead;
+    __builtin_prefetch(tower->links[0]);
+    if (cursor->ahead != 0) {
+      __builtin_prefetch(cursor->ahead);
+    }
+  }
+}
+
+/// Points cursor to the first node whose value is not smaller than val.
+void skiplist_seek(struct Skiplist *list, int val, struct skiplist_cursor *cursor) {
+  struct Skiplist *node = list;
+  struct Skiplist *tower = 0;
+  for (size_t i = list->height; i > 0; --i) {
+    while (node->links[i - 1] != 0 && node->links[i - 1]->value < val) {
+      node = node->links[i - 1];
+    }
+    tower = i == 2 ? node : tower;
+  }
+  cursor->node = node->links[0];
+  cursor->ahead = tower != 0 ? tower->links[1] : 0;
+  cursor->lead = 0;
+  if (cursor->ahead != 0) {
+    __builtin_prefetch(cursor->ahead);
+  }
+}
+
+/// Moves cursor to the next node and returns it, or NULL past the end.
+struct Skiplist *skiplist_cursor_next(struct skiplist_cursor *cursor) {
+  if (cursor->node == 0) {
+    return 0;
+  }
+  if (cursor->node->height > 1 && cursor->lead == 0) {
+    // The scan caught up, the next tower is only prefetched on this step
+    cursor->ahead = cursor->node->links[1];
+    if (cursor->ahead != 0) {
+      __builtin_prefetch(cursor->ahead);
+    }
+  } else {
+    cursor->lead -= cursor->node->height > 1;
+    skiplist_cursor_prefetch(cursor);
+  }
+  cursor->node = cursor->node->links[0];
+  return cursor->node;
+}
+
+/// Copies the values from cursor on that are not larger than hi to out, up to cap of them, and moves cursor past them.
+/// hi is inclusive so INT32_MAX reads to the end.
+///
+/// \return number of values copied, less than cap when the scan passed hi or reached the end.
+size_t skiplist_cursor_read(struct skiplist_cursor *cursor, int hi, int *out, size_t cap) {
+  size_t count = 0;
+  while (count < cap && cursor->node != 0 && cursor->node->value <= hi) {
+    out[count++] = cursor->node->value;
+    skiplist_cursor_next(cursor);
+  }
+  return count;
+}
+
+/// Copies the values in [lo, hi] to out in order, up to cap of them, continue with a cursor for more.
+///
+/// \return number of values copied.
+size_t skiplist_range(struct Skiplist *list, int lo, int hi, int *out, size_t cap) {
+  struct skiplist_cursor cursor;
+  skiplist_seek(list, lo, &cursor);
+  return skiplist_cursor_read(&cursor, hi, out, cap);
+}
+
+/// Number of values in the skiplist smaller than val, in O(log n) by adding up the widths of the links passed.
+size_t skiplist_rank(struct Skiplist *list, int val) {
+  struct Skiplist *node = list;
+  size_t rank = 0;
+  for (size_t i = list->height; i > 0; --i) {
+    while (node->links[i - 1] != 0 && node->links[i - 1]->value < val) {
+      rank += skiplist_widths(node)[i - 1];
+      node = node->links[i - 1];
+    }
+  }
+  return rank;
+}
+
+/// The node with the k-th smallest value, counting from 0, or NULL when the skiplist has k values or less.
+struct Skiplist *skiplist_select(struct Skiplist *list, size_t k) {
+  struct Skiplist *node = list;
+  size_t position = 0;
+  for (size_t i = list->height; i > 0; --i) {
+    while (node->links[i - 1] != 0 && position + skiplist_widths(node)[i - 1] <= k + 1) {
+      position += skiplist_widths(node)[i - 1];
+      node = node->links[i - 1];
+    }
+  }
+  return position == k + 1 ? node : 0;
+}
+
+// Distance from start to end in the specific layer. In a 2-3-4 skiplist it is at most 5 hops between the ends of a
+// link of the layer above, and the top layer is kept at 3 nodes or less, so rebalancing walks a few nodes per layer.
 size_t skiplist_distance(struct Skiplist *start, struct Skiplist *end, size_t layer) {
   size_t distance = 0;
   while (start != 0 && start != end) {
@@ -82,38 +294,90 @@ size_t skiplist_distance(struct Skiplist *start, struct Skiplist *end, size_t la
   return distance;
 }
 
+// Upgrades the second node after left in layer, which must be in the middle of a link of left in the layer above, and
+// splits the width of that link.
+void skiplist_upgrade_second(struct Skiplist *left, size_t layer) {
+  struct Skiplist *second = left->links[layer];
+  struct Skiplist *upgraded = second->links[layer];
+  uint32_t width = skiplist_widths(left)[layer] + skiplist_widths(second)[layer];
+  skiplist_increase_height(upgraded);
+  upgraded->links[layer + 1] = left->links[layer + 1];
+  skiplist_widths(upgraded)[layer + 1] = skiplist_widths(left)[layer + 1] - width;
+  left->links[layer + 1] = upgraded;
+  skiplist_widths(left)[layer + 1] = width;
+}
+
 void skiplist_try_upgrade(struct Skiplist *list, struct Skiplist **vec, size_t layer) {
   if (layer + 1 < list->height) {
     struct Skiplist *left = vec[layer + 1];
     struct Skiplist *right = left->links[layer + 1];
     if (skiplist_distance(left, right, layer) > 4) {
-      // upgrade the second
-      struct Skiplist *upgraded = left->links[layer]->links[layer];
-      skiplist_increase_height(upgraded);
-      upgraded->links[layer + 1] = right;
-      left->links[layer + 1] = upgraded;
+      skiplist_upgrade_second(left, layer);
       skiplist_try_upgrade(list, vec, layer + 1);
     }
   } else if (skiplist_distance(list, 0, layer) > 4) {
-    struct Skiplist *upgraded = list->links[layer]->links[layer];
+    // A new top layer with a single link over the whole list first
+    uint32_t width = 0;
+    for (struct Skiplist *node = list; node != 0; node = node->links[layer]) {
+      width += skiplist_widths(node)[layer];
+    }
     skiplist_increase_height(list);
-    skiplist_increase_height(upgraded);
-    upgraded->links[layer + 1] = 0;
-    list->links[layer + 1] = upgraded;
+    list->links[layer + 1] = 0;
+    skiplist_widths(list)[layer + 1] = width;
+    skiplist_upgrade_second(list, layer);
   }
 }
 
-void skiplist_insert(struct Skiplist *list, int val) {
-  struct Skiplist **vec = skiplist_locate(list, val);
+// Inserts val after the nodes in vec, which skiplist_locate filled.
+void skiplist_insert_at(struct Skiplist *list, struct Skiplist **vec, int val) {
   // Insert into layer 1
-  struct Skiplist *node = skiplist_new();
-  node->value = val;
+  struct Skiplist *node = skiplist_node_new(skiplist_pool(list), val);
   node->links[0] = vec[0]->links[0];
+  skiplist_widths(node)[0] = 1;
   vec[0]->links[0] = node;
+  for (size_t i = 1; i < list->height; ++i) {
+    ++skiplist_widths(vec[i])[i];
+  }
 
   skiplist_try_upgrade(list, vec, 0);
+}
 
-  free(vec);
+void skiplist_insert(struct Skiplist *list, int val) {
+  struct Skiplist *vec[SKIPLIST_MAX_HEIGHT];
+  skiplist_locate(list, val, vec);
+  skiplist_insert_at(list, vec, val);
+}
+
+/// Inserts the n values, which must be sorted, in one walk along the list. Each search starts from the nodes where the
+/// one before ended and only goes down from the highest layer it has to move in, which is low for close values.
+void skiplist_insert_sorted_batch(struct Skiplist *list, const int *values, size_t n) {
+  struct Skiplist *vec[SKIPLIST_MAX_HEIGHT];
+  for (size_t i = 0; i < list->height; ++i) {
+    vec[i] = list;
+  }
+  for (size_t k = 0; k < n; ++k) {
+    assert(k == 0 || values[k - 1] <= values[k]);
+    int val = values[k];
+    // Skip the layers whose node is still the last one smaller than val, upgrades of the insert before may have put
+    // nodes after the ones in vec in any layer, and search on from the highest one that is not
+    size_t layer = list->height;
+    while (layer > 0 && (vec[layer - 1]->links[layer - 1] == 0 || vec[layer - 1]->links[layer - 1]->value >= val)) {
+      --layer;
+    }
+    struct Skiplist *node = layer > 0 ? vec[layer - 1] : 0;
+    for (size_t i = layer; i > 0; --i) {
+      while (node->links[i - 1] != 0 && node->links[i - 1]->value < val) {
+        node = node->links[i - 1];
+      }
+      vec[i - 1] = node;
+    }
+
+    size_t height = list->height;
+    skiplist_insert_at(list, vec, val);
+    for (size_t i = height; i < list->height; ++i) {
+      vec[i] = list;
+    }
+  }
 }
 
 void skiplist_downgrade(struct Skiplist *list, struct Skiplist **vec, size_t layer) {
@@ -126,7 +390,8 @@ void skiplist_downgrade(struct Skiplist *list, struct Skiplist **vec, size_t lay
       
       if (right != 0 && right->height == layer + 2) {
         left->links[layer + 1] = right->links[layer + 1];
-        --right->height;
+        skiplist_widths(left)[layer + 1] += skiplist_widths(right)[layer + 1];
+        skiplist_decrease_height(right);
         right = left->links[layer + 1];
         downgraded = 1;
       } else if (left->height == layer + 2) {
@@ -137,42 +402,45 @@ void skiplist_downgrade(struct Skiplist *list, struct Skiplist **vec, size_t lay
         }
         if (prev != 0) {
           prev->links[layer + 1] = right;
-          --left->height;
+          skiplist_widths(prev)[layer + 1] += skiplist_widths(left)[layer + 1];
+          skiplist_decrease_height(left);
           left = prev;
           downgraded = 1;
         }
       }
       
       if (downgraded) {
-        // Check reflow
-        if (skiplist_distance(left, right, layer) == 4) {
-          // upgrade the 2nd
-          struct Skiplist *upgraded = left->links[layer]->links[layer];
-          skiplist_increase_height(upgraded);
-          upgraded->links[layer + 1] = left->links[layer + 1];
-          left->links[layer + 1] = upgraded;
+        // Check reflow, a group of five after the merge is split again
+        if (skiplist_distance(left, right, layer) > 4) {
+          skiplist_upgrade_second(left, layer);
         } else {
           skiplist_downgrade(list, vec, layer + 1);
         }
       }
     }
-  } else if (skiplist_distance(list, 0, layer) == 1) {
-    // No more topmost layer nodes
-    --list->height;
+  } else if (layer > 0 && skiplist_distance(list, 0, layer) == 1) {
+    // No more topmost layer nodes, layer 1 stays even when the list is empty
+    skiplist_decrease_height(list);
   }
 }
 
 void skiplist_remove(struct Skiplist *list, int val) {
-  struct Skiplist **vec = skiplist_locate(list, val);
+  struct Skiplist *vec[SKIPLIST_MAX_HEIGHT];
+  skiplist_locate(list, val, vec);
 
   if (vec[0]->links[0] != 0 && vec[0]->links[0]->value == val) {
     struct Skiplist *prev = vec[0];
     struct Skiplist *remove = prev->links[0];
+    // The links over remove span one less, the ones to it are moved to the next node, which takes its place
+    for (size_t i = 1; i < list->height; ++i) {
+      if (vec[i]->links[i] != remove) {
+        --skiplist_widths(vec[i])[i];
+      }
+    }
 
     if (prev->links[0]->height == 1) {
       prev->links[0] = prev->links[0]->links[0];
-      free(remove->links);
-      free(remove);
+      skiplist_node_free(skiplist_pool(list), remove);
     } else {
       struct Skiplist *next = remove->links[0];
       assert(next != 0 && next->height == 1);
@@ -184,20 +452,80 @@ void skiplist_remove(struct Skiplist *list, int val) {
         vec[i] = next;
       }
 
-      remove->links[0] = next->links[0];
-      free(next->links);
-      next->links = remove->links;
+      // next takes over the links of remove, the overflow block or a copy of the inline links
+      struct Skiplist *after = next->links[0];
+      if (remove->links != remove->inline_links) {
+        next->links = remove->links;
+        next->capacity = remove->capacity;
+        remove->links = remove->inline_links;
+      } else {
+        for (size_t i = 0; i < remove->height; ++i) {
+          next->links[i] = remove->links[i];
+          skiplist_widths(next)[i] = skiplist_widths(remove)[i];
+        }
+      }
+      next->links[0] = after;
       next->height = remove->height;
-      next->capacity = remove->capacity;
+      for (size_t i = 1; i < next->height; ++i) {
+        --skiplist_widths(next)[i];
+      }
 
-      free(remove);
+      skiplist_node_free(skiplist_pool(list), remove);
     }
 
     // now node has been removed, re-balance the tree
     skiplist_downgrade(list, vec, 0);
   }
+}
+
+/// Builds a list of the n values, which must be sorted, in O(n) without searching. Counting the head, the nodes of each
+/// layer are split into groups of three led by a node of the layer above, the last group of two to four, and the top
+/// layer has four nodes or less. Every group can take an insert or a remove before a node moves between layers.
+struct Skiplist *skiplist_bulk_load(const int *values, size_t n) {
+  assert(n < UINT32_MAX);
+  // Nodes in each layer, with the head
+  size_t counts[SKIPLIST_MAX_HEIGHT];
+  size_t height = 1;
+  counts[0] = n + 1;
+  while (counts[height - 1] > 4) {
+    counts[height] = (counts[height - 1] - 2) / 3 + 1;
+    ++height;
+  }
 
-  free(vec);
+  struct Skiplist *list = skiplist_new();
+  while (list->height < height) {
+    skiplist_increase_height(list);
+  }
+  // The last node of each layer so far, and its position in layer 1
+  struct Skiplist *last[SKIPLIST_MAX_HEIGHT];
+  size_t positions[SKIPLIST_MAX_HEIGHT];
+  for (size_t i = 0; i < height; ++i) {
+    last[i] = list;
+    positions[i] = 0;
+  }
+
+  for (size_t k = 0; k < n; ++k) {
+    assert(k == 0 || values[k - 1] <= values[k]);
+    struct Skiplist *node = skiplist_node_new(skiplist_pool(list), values[k]);
+    // The node at index j of a layer starts a group when j is a multiple of 3 and it is not the last of the layer
+    size_t index = k + 1;
+    while (node->height < height && index % 3 == 0 && index + 1 < counts[node->height - 1]) {
+      skiplist_increase_height(node);
+      index /= 3;
+    }
+    for (size_t i = 0; i < node->height; ++i) {
+      last[i]->links[i] = node;
+      skiplist_widths(last[i])[i] = k + 1 - positions[i];
+      last[i] = node;
+      positions[i] = k + 1;
+    }
+  }
+  for (size_t i = 0; i < height; ++i) {
+    last[i]->links[i] = 0;
+    skiplist_widths(last[i])[i] = n + 1 - positions[i];
+  }
+
+  return list;
 }
 
 void skiplist_debug(struct Skiplist *list) {
@@ -208,10 +536,12 @@ void skiplist_debug(struct Skiplist *list) {
       assert(list->links[i]->height > i);
     }
     struct Skiplist *next = list->links[0];
+    uint32_t width = 1;
     while (next != 0 && next->height <= i) {
       next = next->links[0];
+      ++width;
     }
-    assert(next == list->links[i]);
+    assert(next == list->links[i] && width == skiplist_widths(list)[i]);
   }
   printf("\n");
 
@@ -223,10 +553,12 @@ void skiplist_debug(struct Skiplist *list) {
         assert(node->links[i]->height > i);
       }
       struct Skiplist *next = node->links[0];
+      uint32_t width = 1;
       while (next != 0 && next->height <= i) {
         next = next->links[0];
+        ++width;
       }
-      assert(next == node->links[i]);
+      assert(next == node->links[i] && width == skiplist_widths(node)[i]);
     }
     printf("\n");
   }
@@ -238,6 +570,177 @@ void skiplist_debug(struct Skiplist *list) {
   printf("\n");
 }
 
+#ifndef SKIPLIST_NO_MAIN
+// Asserts the widths, that every link spans two to four links of the layer below, and that the top layer has two to
+// four nodes with the head. Returns the number of values.
+size_t skiplist_test_check(struct Skiplist *list) {
+  for (size_t i = 0; i < list->height; ++i) {
+    size_t count = 0;
+    for (struct Skiplist *node = list; node != 0; node = node->links[i]) {
+      uint32_t width = 0;
+      struct Skiplist *next = node;
+      do {
+        width += skiplist_widths(next)[0];
+        next = next->links[0];
+      } while (next != 0 && next->height <= i);
+      assert(next == node->links[i] && width == skiplist_widths(node)[i]);
+      assert(i == 0 || (skiplist_distance(node, next, i - 1) >= 2 && skiplist_distance(node, next, i - 1) <= 4));
+      ++count;
+    }
+    assert(i + 1 < list->height || list->height == 1 || (count >= 2 && count <= 4));
+  }
+  return skiplist_rank(list, INT32_MAX);
+}
+
+// Enough nodes for towers taller than the inline links, inserted and removed in random order.
+void skiplist_test_random() {
+  size_t n = 3000;
+  int *values = malloc(n * sizeof(int));
+  for (size_t i = 0; i < n; ++i) {
+    values[i] = (int) i;
+  }
+  for (size_t i = n - 1; i > 0; --i) {
+    size_t j = rand() % (i + 1);
+    int swap = values[i];
+    values[i] = values[j];
+    values[j] = swap;
+  }
+
+  struct Skiplist *list = skiplist_new();
+  for (size_t i = 0; i < n; ++i) {
+    skiplist_insert(list, values[i]);
+  }
+  assert(list->height > SKIPLIST_INLINE_LINKS + 1 && skiplist_test_check(list) == n);
+  for (size_t i = 0; i < n; ++i) {
+    assert(skiplist_search(list, (int) i)->value == (int) i);
+    assert(skiplist_rank(list, (int) i) == i);
+    assert(skiplist_select(list, i)->value == (int) i);
+  }
+  assert(skiplist_rank(list, (int) n) == n && skiplist_select(list, n) == 0);
+
+  // Ranges, some empty, and a scan of everything in small batches
+  int out[100];
+  for (size_t k = 0; k < 100; ++k) {
+    int lo = rand() % (int) n;
+    int hi = lo - 1 + rand() % 150;
+    size_t count = skiplist_range(list, lo, hi, out, 100);
+    size_t expect = (size_t) (hi + 1 < (int) n ? hi + 1 : (int) n) - lo;
+    assert(count == (expect < 100 ? expect : 100));
+    for (size_t i = 0; i < count; ++i) {
+      assert(out[i] == lo + (int) i);
+    }
+  }
+  struct skiplist_cursor cursor;
+  skiplist_seek(list, -1, &cursor);
+  size_t scanned = 0;
+  for (size_t count; (count = skiplist_cursor_read(&cursor, INT32_MAX, out, 7)) > 0; scanned += count) {
+    for (size_t i = 0; i < count; ++i) {
+      assert(out[i] == (int) (scanned + i));
+    }
+  }
+  assert(scanned == n && cursor.node == 0);
+  skiplist_seek(list, (int) n - 2, &cursor);
+  assert(cursor.node->value == (int) n - 2 && skiplist_cursor_next(&cursor)->value == (int) n - 1);
+  assert(skiplist_cursor_next(&cursor) == 0 && skiplist_cursor_next(&cursor) == 0);
+  skiplist_insert(list, INT32_MAX);
+  assert(skiplist_range(list, (int) n - 1, INT32_MAX, out, 100) == 2 && out[1] == INT32_MAX);
+  skiplist_remove(list, INT32_MAX);
+
+  // Remove all but 10, so the nodes that are left come from the free list
+  for (size_t i = 0; i + 10 < n; ++i) {
+    skiplist_remove(list, values[i]);
+    assert(skiplist_search(list, values[i]) == 0);
+  }
+  assert(skiplist_test_check(list) == 10);
+  for (size_t i = 0; i + 10 < n; i += 2) {
+    skiplist_insert(list, values[i]);
+  }
+  for (size_t i = 0; i + 10 < n; i += 2) {
+    skiplist_remove(list, values[i]);
+  }
+  for (size_t i = n - 10; i < n; ++i) {
+    assert(skiplist_search(list, values[i])->value == values[i]);
+    size_t rank = skiplist_rank(list, values[i]);
+    assert(rank < 10 && skiplist_select(list, rank)->value == values[i]);
+  }
+  assert(skiplist_select(list, 10) == 0);
+  skiplist_debug(list);
+
+  // Empty the list, then insert and remove a few keys at random, emptying it again now and then
+  for (size_t i = n - 10; i < n; ++i) {
+    skiplist_remove(list, values[i]);
+  }
+  assert(list->height == 1 && list->links[0] == 0);
+  char present[64] = {0};
+  size_t size = 0;
+  for (size_t k = 0; k < 20000; ++k) {
+    int x = rand() % 64;
+    if (present[x]) {
+      skiplist_remove(list, x);
+      --size;
+    } else {
+      skiplist_insert(list, x);
+      ++size;
+    }
+    present[x] = !present[x];
+    assert(skiplist_test_check(list) == size);
+  }
+  for (int x = 0; x < 64; ++x) {
+    assert((skiplist_search(list, x) != 0) == present[x]);
+  }
+
+  skiplist_free(list);
+  free(values);
+}
+
+// Bulk loads of every size up to 300, and batches merged into loaded and empty lists.
+void skiplist_test_bulk() {
+  int values[3000];
+  for (size_t n = 0; n <= 300; ++n) {
+    for (size_t i = 0; i < n; ++i) {
+      values[i] = 2 * (int) i;
+    }
+    struct Skiplist *list = skiplist_bulk_load(values, n);
+    assert(skiplist_test_check(list) == n);
+    for (size_t i = 0; i < n; ++i) {
+      assert(skiplist_select(list, i)->value == 2 * (int) i && skiplist_rank(list, 2 * (int) i) == i);
+    }
+    for (size_t i = 0; i < n; ++i) {
+      values[i] = 2 * (int) i + 1;
+    }
+    skiplist_insert_sorted_batch(list, values, n);
+    assert(skiplist_test_check(list) == 2 * n);
+    for (size_t i = 0; i < 2 * n; i += 3) {
+      skiplist_remove(list, (int) i);
+    }
+    assert(skiplist_test_check(list) == 2 * n - (2 * n + 2) / 3);
+    skiplist_free(list);
+  }
+
+  // A sparse batch with duplicates into a large list, and a whole list merged into an empty one
+  for (size_t i = 0; i < 3000; ++i) {
+    values[i] = 10 * (int) i;
+  }
+  struct Skiplist *list = skiplist_bulk_load(values, 3000);
+  int batch[] = {-5, -5, 0, 1, 1, 9999, 10000, 10001, 29991, 40000};
+  skiplist_insert_sorted_batch(list, batch, 10);
+  assert(skiplist_test_check(list) == 3010);
+  assert(skiplist_rank(list, 0) == 2 && skiplist_rank(list, 2) == 6 && skiplist_rank(list, 10001) == 1008);
+  assert(skiplist_select(list, 3009)->value == 40000 && skiplist_select(list, 3008)->value == 29991);
+  struct Skiplist *merged = skiplist_new();
+  skiplist_insert_sorted_batch(merged, values, 3000);
+  assert(skiplist_test_check(merged) == 3000 && merged->height > SKIPLIST_INLINE_LINKS + 1);
+  for (size_t i = 0; i < 3000; ++i) {
+    assert(skiplist_select(merged, i)->value == values[i]);
+  }
+  skiplist_free(merged);
+  skiplist_free(list);
+
+  list = skiplist_bulk_load(values, 20);
+  skiplist_debug(list);
+  skiplist_free(list);
+}
+
 int main() {
   struct Skiplist *list = skiplist_new();
   skiplist_debug(list);
@@ -282,4 +785,8 @@ int main() {
   skiplist_debug(list);
 
   skiplist_free(list);
+
+  skiplist_test_random();
+  skiplist_test_bulk();
 }
+#endif
@@ -0,0 +1,171 @@
+// Benchmarks for the 2-3-4 skiplist.
+//
+// Usage: skiplist_bench [number of keys] [number of operations], build with -DCMAKE_BUILD_TYPE=Release for meaningful
+// numbers. The heap allocations of the skiplist are counted by routing its malloc family through counters, so the
+// steady state of inserts and removes can be checked to allocate nothing but the overflow blocks of tall nodes.
+
+#include <stdlib.h>
+
+size_t bench_allocations = 0;
+
+void *bench_malloc(size_t size) {
+  ++bench_allocations;
+  return malloc(size);
+}
+
+void *bench_calloc(size_t count, size_t size) {
+  ++bench_allocations;
+  return calloc(count, size);
+}
+
+void *bench_realloc(void *p, size_t size) {
+  ++bench_allocations;
+  return realloc(p, size);
+}
+
+void *bench_aligned_alloc(size_t alignment, size_t size) {
+  ++bench_allocations;
+  return aligned_alloc(alignment, size);
+}
+
+#define malloc bench_malloc
+#define calloc bench_calloc
+#define realloc bench_realloc
+#define aligned_alloc bench_aligned_alloc
+#define SKIPLIST_NO_MAIN
+#include "skiplist.c"
+#undef malloc
+#undef calloc
+#undef realloc
+#undef aligned_alloc
+
+#include "../bench.h"
+
+void bench_report(const char *name, double seconds, size_t allocations, size_t num_operations) {
+  printf("%-24s %10.0f ns/op %10.4f allocations/op\n", name, seconds * 1e9 / num_operations,
+         (double) allocations / num_operations);
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? strtoull(argv[1], 0, 10) : 1000000;
+  size_t num_operations = argc > 2 ? strtoull(argv[2], 0, 10) : 1000000;
+  if (n == 0) {
+    printf("need at least one key\n");
+    return 1;
+  }
+
+  // Distinct keys in random order, the even ones are loaded and the odd ones come and go
+  int *keys = malloc(2 * n * sizeof(int));
+  for (size_t i = 0; i < 2 * n; ++i) {
+    keys[i] = (int) i;
+  }
+  size_t state = 0x2545f4914f6cdd1dULL;
+  for (size_t i = 2 * n - 1; i > 0; --i) {
+    size_t j = bench_random(&state) % (i + 1);
+    int swap = keys[i];
+    keys[i] = keys[j];
+    keys[j] = swap;
+  }
+
+  struct Skiplist *list = skiplist_new();
+  size_t allocations = bench_allocations;
+  double start = now_seconds();
+  for (size_t i = 0; i < n; ++i) {
+    skiplist_insert(list, 2 * keys[i]);
+  }
+  bench_report("insert, growing", now_seconds() - start, bench_allocations - allocations, n);
+
+  allocations = bench_allocations;
+  start = now_seconds();
+  size_t found = 0;
+  for (size_t k = 0; k < num_operations; ++k) {
+    found += skiplist_search(list, 2 * keys[bench_random(&state) % n]) != 0;
+  }
+  bench_report("search", now_seconds() - start, bench_allocations - allocations, num_operations);
+
+  start = now_seconds();
+  size_t ranks = 0;
+  for (size_t k = 0; k < num_operations; ++k) {
+    ranks += skiplist_rank(list, 2 * keys[bench_random(&state) % n]);
+  }
+  bench_report("rank", now_seconds() - start, 0, num_operations);
+  start = now_seconds();
+  for (size_t k = 0; k < num_operations; ++k) {
+    found += skiplist_select(list, bench_random(&state) % n) != 0;
+  }
+  bench_report("select", now_seconds() - start, 0, num_operations);
+
+  // The whole list in batches, against following the links one by one
+  start = now_seconds();
+  long sum = 0;
+  for (struct Skiplist *node = list->links[0]; node != 0; node = node->links[0]) {
+    sum += node->value;
+  }
+  bench_report("walk layer 1", now_seconds() - start, 0, n);
+  int *batch = malloc(1024 * sizeof(int));
+  struct skiplist_cursor cursor;
+  start = now_seconds();
+  skiplist_seek(list, -1, &cursor);
+  for (size_t count; (count = skiplist_cursor_read(&cursor, INT32_MAX, batch, 1024)) > 0;) {
+    for (size_t i = 0; i < count; ++i) {
+      sum -= batch[i];
+    }
+  }
+  bench_report("range scan", now_seconds() - start, 0, n);
+  free(batch);
+
+  // Steady state: each insert is followed by removing the key inserted 1000 operations before
+  size_t window = 1000;
+  allocations = bench_allocations;
+  start = now_seconds();
+  for (size_t k = 0; k < num_operations + window; ++k) {
+    if (k < num_operations) {
+      skiplist_insert(list, 2 * keys[k % n] + 1);
+    }
+    if (k >= window) {
+      skiplist_remove(list, 2 * keys[(k - window) % n] + 1);
+    }
+  }
+  bench_report("insert and remove", now_seconds() - start, bench_allocations - allocations, 2 * num_operations);
+
+  allocations = bench_allocations;
+  start = now_seconds();
+  for (size_t i = 0; i < n; ++i) {
+    skiplist_remove(list, 2 * keys[i]);
+  }
+  bench_report("remove, shrinking", now_seconds() - start, bench_allocations - allocations, n);
+
+  // Sorted keys loaded at once, then the keys between them merged in as one batch and one by one
+  int *sorted = malloc(n * sizeof(int));
+  for (size_t i = 0; i < n; ++i) {
+    sorted[i] = 2 * (int) i;
+  }
+  allocations = bench_allocations;
+  start = now_seconds();
+  struct Skiplist *loaded = skiplist_bulk_load(sorted, n);
+  bench_report("bulk load", now_seconds() - start, bench_allocations - allocations, n);
+  struct Skiplist *merged = skiplist_bulk_load(sorted, n);
+  for (size_t i = 0; i < n; ++i) {
+    sorted[i] = 2 * (int) i + 1;
+  }
+  start = now_seconds();
+  skiplist_insert_sorted_batch(merged, sorted, n);
+  bench_report("insert sorted batch", now_seconds() - start, 0, n);
+  start = now_seconds();
+  for (size_t i = 0; i < n; ++i) {
+    skiplist_insert(loaded, sorted[i]);
+  }
+  bench_report("insert sorted one by one", now_seconds() - start, 0, n);
+  ranks = skiplist_rank(loaded, INT32_MAX) == 2 * n && skiplist_rank(merged, INT32_MAX) == 2 * n ? ranks : 0;
+  skiplist_free(merged);
+  skiplist_free(loaded);
+  free(sorted);
+
+  if (found != 2 * num_operations || ranks == 0 || sum != 0 || list->links[0] != 0) {
+    printf("the list lost keys\n");
+    return 1;
+  }
+  skiplist_free(list);
+  free(keys);
+  return 0;
+}
@@ -0,0 +1,30 @@
+// Timing, random inputs and memory use, shared by the benchmarks and harnesses of every assignment.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/resource.h>
+
+static inline double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// xorshift64*, fixed seeds keep the inputs reproducible across runs
+static inline size_t bench_random(size_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+static inline double peak_rss_mb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;
+}
+
+#endif
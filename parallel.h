@@ -0,0 +1,165 @@
+// A parallel for over contiguous ranges, and teams of threads that wait for each other, shared by the builds of every
+// assignment that run on several threads.
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdlib.h>
+#include <pthread.h>
+
+// Work given to one thread of parallel_for.
+struct parallel_task {
+    void (*body)(void *context, size_t begin, size_t end);
+    void *context;
+    size_t begin;
+    size_t end;
+};
+
+static inline void *parallel_run_task(void *task) {
+  struct parallel_task *t = task;
+  t->body(t->context, t->begin, t->end);
+  return 0;
+}
+
+/// Runs body over [0, count) split into num_threads contiguous ranges, each range on its own thread.
+///
+/// With a single thread body runs in the calling thread, so the serial build takes exactly the same code path.
+static inline void parallel_for(size_t num_threads, size_t count,
+                                void (*body)(void *context, size_t begin, size_t end), void *context) {
+  if (num_threads > count) {
+    num_threads = count;
+  }
+  if (num_threads <= 1) {
+    body(context, 0, count);
+    return;
+  }
+
+  struct parallel_task *tasks = malloc(sizeof(struct parallel_task) * num_threads);
+  pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+  for (size_t t = 0; t < num_threads; ++t) {
+    tasks[t].body = body;
+    tasks[t].context = context;
+    tasks[t].begin = count * t / num_threads;
+    tasks[t].end = count * (t + 1) / num_threads;
+  }
+
+  char *started = calloc(num_threads, sizeof(char));
+  for (size_t t = 1; t < num_threads; ++t) {
+    started[t] = pthread_create(threads + t, 0, parallel_run_task, tasks + t) == 0;
+  }
+
+  parallel_run_task(tasks);
+  for (size_t t = 1; t < num_threads; ++t) {
+    if (started[t]) {
+      pthread_join(threads[t], 0);
+    } else {
+      // Not enough resources for another thread, the calling thread takes the range over.
+      parallel_run_task(tasks + t);
+    }
+  }
+
+  free(started);
+  free(threads);
+  free(tasks);
+}
+
+// Threads started together by parallel_team_run, which wait for each other at parallel_team_wait.
+struct parallel_team {
+    size_t num_threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // threads waiting at the barrier, and the number of barriers passed
+    size_t num_waiting;
+    size_t generation;
+    // set once every thread is started, or abandoned when one could not be
+    int ready;
+    int abandoned;
+};
+
+// A thread of a team with the body it runs.
+struct parallel_member {
+    struct parallel_team *team;
+    size_t thread;
+    void (*body)(void *context, struct parallel_team *team, size_t thread);
+    void *context;
+};
+
+static inline void *parallel_run_member(void *member) {
+  struct parallel_member *m = member;
+  pthread_mutex_lock(&m->team->mutex);
+  while (!m->team->ready) {
+    pthread_cond_wait(&m->team->cond, &m->team->mutex);
+  }
+  int abandoned = m->team->abandoned;
+  pthread_mutex_unlock(&m->team->mutex);
+  if (!abandoned) {
+    m->body(m->context, m->team, m->thread);
+  }
+  return 0;
+}
+
+/// Waits until every thread of the team reaches this barrier. What a thread wrote before it is visible to all the
+/// threads after it.
+static inline void parallel_team_wait(struct parallel_team *team) {
+  if (team->num_threads <= 1) {
+    return;
+  }
+  pthread_mutex_lock(&team->mutex);
+  size_t generation = team->generation;
+  if (++team->num_waiting == team->num_threads) {
+    team->num_waiting = 0;
+    ++team->generation;
+    pthread_cond_broadcast(&team->cond);
+  } else {
+    while (generation == team->generation) {
+      pthread_cond_wait(&team->cond, &team->mutex);
+    }
+  }
+  pthread_mutex_unlock(&team->mutex);
+}
+
+/// Runs body(context, team, thread) on num_threads threads, thread 0 in the calling thread, for steps that split the
+/// same data many times over and would spend more on starting threads in parallel_for than on the steps.
+///
+/// Bodies split their work by team->num_threads, not num_threads: when not every thread can be started, the team
+/// is a single thread in the calling thread, whose barriers return at once.
+static inline void parallel_team_run(size_t num_threads,
+                                     void (*body)(void *context, struct parallel_team *team, size_t thread),
+                                     void *context) {
+  struct parallel_team team = {.num_threads = num_threads > 1 ? num_threads : 1};
+  pthread_mutex_init(&team.mutex, 0);
+  pthread_cond_init(&team.cond, 0);
+  struct parallel_member *members = malloc(sizeof(struct parallel_member) * team.num_threads);
+  pthread_t *threads = malloc(sizeof(pthread_t) * team.num_threads);
+  size_t num_started = 1;
+  for (; num_started < team.num_threads; ++num_started) {
+    members[num_started] = (struct parallel_member) {.team = &team, .thread = num_started, .body = body,
+                                                     .context = context};
+    if (pthread_create(threads + num_started, 0, parallel_run_member, members + num_started) != 0) {
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&team.mutex);
+  team.ready = 1;
+  team.abandoned = num_started < team.num_threads;
+  pthread_cond_broadcast(&team.cond);
+  pthread_mutex_unlock(&team.mutex);
+  if (!team.abandoned) {
+    body(context, &team, 0);
+  }
+  for (size_t t = 1; t < num_started; ++t) {
+    pthread_join(threads[t], 0);
+  }
+  if (team.abandoned) {
+    team.num_threads = 1;
+    body(context, &team, 0);
+  }
+
+  pthread_cond_destroy(&team.cond);
+  pthread_mutex_destroy(&team.mutex);
+  free(threads);
+  free(members);
+}
+
+#endif